@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include "src/quadtree.h"
 
@@ -37,7 +38,7 @@ mark_insert() {
         while (n--) {
                 x = (double)(rand() % 1000);
                 y = (double)(rand() % 1000);
-                int status = quadtree_insert(tree, x, y, &val);
+                int status = quadtree_insert(tree, x, y, &val, NULL);
                 switch (status) {
                         case 0:
                                 ++fail;
@@ -58,9 +59,195 @@ mark_insert() {
         quadtree_free(tree);
 }
 
+/* Range queries over a tree well past the last level cache. */
+static int large = 2000000;
+
+static void
+noop_(quadtree_node_t *node) {
+}
+
+static void
+mark_prefetch() {
+        unsigned int distances[] = {0, 1, QUADTREE_PREFETCH_DISTANCE, 3};
+        quadtree_t *tree = quadtree_new(0, 0, 1000000, 1000000);
+        quadtree_node_list_t *list;
+        unsigned int found;
+        int i, d, n;
+        int val = 10;
+
+        /* Random order scatters neighbouring cells across the heap. */
+        for (n = 0; n < large; n++)
+                quadtree_insert(tree, (double)rand() / RAND_MAX * 1000000, (double)rand() / RAND_MAX * 1000000, &val,
+                                NULL);
+        printf("\n  %18s %u\n", "length:", tree->length);
+        for (d = 0; d < 4; d++) {
+                quadtree_set_prefetch_distance(distances[d]);
+                printf("  %15s %u", "distance", distances[d]);
+                srand(42);
+                found = 0;
+                start();
+                for (i = 0; i < 200; i++) {
+                        list = quadtree_search_bounds_include_partial(tree, (double)rand() / RAND_MAX * 1000000,
+                                                                      (double)rand() / RAND_MAX * 1000000, 50000);
+                        for (; list != NULL; found++) {
+                                quadtree_node_list_t *next = list->next;
+                                list->next = NULL;
+                                quadtree_node_list_free(list);
+                                list = next;
+                        }
+                }
+                printf(" search (%u found)", found);
+                stop();
+                printf("  %15s %u", "distance", distances[d]);
+                start();
+                for (i = 0; i < 5; i++)
+                        quadtree_walk(tree->root, noop_, noop_);
+                printf(" walk");
+                stop();
+        }
+        quadtree_set_prefetch_distance(QUADTREE_PREFETCH_DISTANCE);
+        quadtree_free(tree);
+}
+
+/* Exact lookups of every point, shuffled, one by one against batched. */
+static void
+mark_search_batch() {
+        quadtree_t *tree = quadtree_new(0, 0, 1000000, 1000000);
+        quadtree_node_t **out = malloc(sizeof(*out) * large);
+        double *xs = malloc(sizeof(*xs) * large);
+        double *ys = malloc(sizeof(*ys) * large);
+        size_t found = 0;
+        int i, j, val = 10;
+
+        for (i = 0; i < large; i++) {
+                xs[i] = (double)rand() / RAND_MAX * 1000000;
+                ys[i] = (double)rand() / RAND_MAX * 1000000;
+                quadtree_insert(tree, xs[i], ys[i], &val, NULL);
+        }
+        for (i = large - 1; i > 0; i--) {
+                double x = xs[i], y = ys[i];
+                j = rand() % (i + 1);
+                xs[i] = xs[j];
+                ys[i] = ys[j];
+                xs[j] = x;
+                ys[j] = y;
+        }
+        printf("\n  %18s", "one by one");
+        start();
+        for (i = 0; i < large; i++)
+                found += quadtree_node_search(tree, xs[i], ys[i]) != NULL;
+        stop();
+        printf("  %18s", "batched");
+        start();
+        found -= quadtree_search_batch(tree, xs, ys, large, out);
+        stop();
+        printf("  %18s %zu\n", "mismatches:", found);
+        free(out);
+        free(xs);
+        free(ys);
+        quadtree_free(tree);
+}
+
+/* A frame of adjacent tiles, one call per tile against one call per frame. */
+static void
+mark_search_multi() {
+        quadtree_t *tree = quadtree_new(0, 0, 1000000, 1000000);
+        quadtree_point_t corners[1024][2];
+        quadtree_bounds_t boxes[1024];
+        quadtree_node_list_t *results[1024];
+        double tile = 1000000 / 256.0; /* zoomed in, a 32 x 32 tile view */
+        int i, frame, val = 10;
+
+        for (i = 0; i < large; i++)
+                quadtree_insert(tree, (double)rand() / RAND_MAX * 1000000, (double)rand() / RAND_MAX * 1000000, &val,
+                                NULL);
+        /* Off the cell grid and with a margin, so neighbours share edge cells. */
+        for (i = 0; i < 1024; i++) {
+                double x = 400000 + i % 32 * tile * 0.9 + tile / 3, y = 400000 + i / 32 * tile * 0.9 + tile / 3;
+                corners[i][0].x = x - tile * 0.1;
+                corners[i][0].y = y + tile * 0.8;
+                corners[i][1].x = x + tile * 0.8;
+                corners[i][1].y = y - tile * 0.1;
+                boxes[i].nw = &corners[i][0];
+                boxes[i].se = &corners[i][1];
+                boxes[i].width = boxes[i].height = tile * 0.9;
+        }
+        printf("\n  %18s", "one per tile");
+        start();
+        for (frame = 0; frame < 50; frame++) {
+                /* A frame's results are all held until it is drawn. */
+                for (i = 0; i < 1024; i++)
+                        results[i] = quadtree_search_bounds_include_partial(
+                                tree, corners[i][0].x + tile * 0.45, corners[i][1].y + tile * 0.45, tile * 0.45);
+                for (i = 0; i < 1024; i++)
+                        quadtree_node_list_free(results[i]);
+        }
+        stop();
+        printf("  %18s", "one per frame");
+        start();
+        for (frame = 0; frame < 50; frame++) {
+                quadtree_search_bounds_multi(tree, boxes, 1024, results);
+                for (i = 0; i < 1024; i++)
+                        quadtree_node_list_free(results[i]);
+        }
+        stop();
+        quadtree_free(tree);
+}
+
+/*
+ * A tree using none of the optional features: what the node layout costs
+ * the common case, building, range searching and walking past the cache.
+ */
+static void
+mark_plain() {
+        quadtree_t *tree = quadtree_new(0, 0, 1000000, 1000000);
+        quadtree_node_list_t *list;
+        unsigned int found = 0;
+        int i, val = 10;
+
+        printf("\n  %18s %zu bytes\n", "node:", sizeof(quadtree_node_t));
+        printf("  %18s", "build");
+        start();
+        for (i = 0; i < large; i++)
+                quadtree_insert(tree, (double)rand() / RAND_MAX * 1000000, (double)rand() / RAND_MAX * 1000000, &val,
+                                NULL);
+        stop();
+        printf("  %18s", "search");
+        start();
+        for (i = 0; i < 200; i++) {
+                list = quadtree_search_bounds_include_partial(tree, (double)rand() / RAND_MAX * 1000000,
+                                                              (double)rand() / RAND_MAX * 1000000, 50000);
+                found += list != NULL;
+                quadtree_node_list_free(list);
+        }
+        stop();
+        printf("  %18s", "count");
+        start();
+        for (i = 0; i < 2000; i++) {
+                quadtree_point_t nw = {(double)rand() / RAND_MAX * 900000, (double)rand() / RAND_MAX * 900000 + 100000};
+                quadtree_point_t se = {nw.x + 100000, nw.y - 100000};
+                quadtree_bounds_t box = {&nw, &se, 100000, 100000};
+                found += quadtree_count_bounds(tree, &box) > 0;
+        }
+        stop();
+        printf("  %18s", "walk");
+        start();
+        for (i = 0; i < 5; i++)
+                quadtree_walk(tree->root, noop_, noop_);
+        stop();
+        printf("  %18s %u\n", "non empty:", found);
+        quadtree_free(tree);
+}
+
 int
 main(int argc, const char *argv[]) {
+        if (argc > 1)
+                large = atoi(argv[1]);
         srand(time(NULL));
         bench(mark_insert, "insertion");
+        bench(mark_prefetch, "prefetch");
+        bench(mark_search_batch, "search batch");
+        bench(mark_search_multi, "search multi");
+        bench(mark_plain, "plain tree");
         return 0;
 }
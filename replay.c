@@ -0,0 +1,555 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "src/quadtree.h"
+
+/*
+ * Replays a recording made with quadtree_record_start against a fresh tree
+ * of the same shape and reports latency per call. Calls go to replay
+ * threads by recorded thread (or round robin with -r); with more than one
+ * thread searches, counts, density grids and aggregates share a read lock
+ * and everything else takes it for writing, and latency includes waiting
+ * for it. A recorded tree with an aggregate is replayed with a count.
+ */
+
+#define CALLS QUADTREE_CALL_MORE
+#define BUCKETS 64 /* bucket b counts latencies below 2^b ns */
+
+static const char *call_names[CALLS] = {
+        "preload",         "insert",       "search",        "search_bounds",
+        "search_partial",  "move_leaf",    "clear",         "unlink_subtree",
+        "move_subtree",    "search_batch", "search_window", "search_multi",
+        "count_bounds",    "density_grid", "aggregate",     "search_polygon",
+        "search_polyline",
+};
+
+typedef struct histogram {
+        uint64_t counts[BUCKETS];
+        uint64_t n;
+        uint64_t total_ns;
+        uint64_t max_ns;
+        uint64_t missed; /* moves, clears and subtree calls with nothing there to act on */
+} histogram_t;
+
+/* Inputs of a call with more than four arguments, built before timing it. */
+typedef struct inputs {
+        double *args; /* the call's own and those of the MORE records after it */
+        size_t n;     /* points, boxes or vertices */
+        double *xs, *ys;
+        quadtree_point_t *points; /* vertices, or two corners per box */
+        quadtree_bounds_t *boxes;
+        quadtree_node_t **found;
+        quadtree_node_list_t **lists;
+        unsigned int *counts;
+} inputs_t;
+
+typedef struct worker {
+        pthread_t thread;
+        quadtree_recording_record_t **records;
+        size_t n;
+        histogram_t histograms[CALLS];
+} worker_t;
+
+static quadtree_t *tree;
+static pthread_rwlock_t lock;
+static int locking;
+static int paced;
+static struct timespec started;
+static uint64_t first_ns;
+static int key = 1;
+
+static void
+no_free_(void *key) {
+}
+
+static double
+one_(quadtree_node_t *leaf) {
+        return 1;
+}
+
+static double
+add_counts_(double a, double b) {
+        return a + b;
+}
+
+static double
+sub_counts_(double total, double removed) {
+        return total - removed;
+}
+
+static const quadtree_aggregate_t count_ = {0, one_, add_counts_, sub_counts_};
+
+static uint64_t
+now_(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+wait_until_(uint64_t ns) {
+        struct timespec at = started;
+        ns += at.tv_nsec;
+        at.tv_sec += ns / 1000000000ull;
+        at.tv_nsec = ns % 1000000000ull;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+                ;
+}
+
+static void
+add_(histogram_t *h, uint64_t ns) {
+        unsigned int b = 0;
+        while (b < BUCKETS - 1 && ns >> b != 0)
+                b++;
+        h->counts[b]++;
+        h->n++;
+        h->total_ns += ns;
+        if (ns > h->max_ns)
+                h->max_ns = ns;
+}
+
+/* The node with exactly these bounds, walking down the quadrants around its center. */
+static quadtree_node_t *
+find_subtree_(const double *a) {
+        quadtree_node_t *node = tree->root;
+        quadtree_point_t center = {(a[0] + a[2]) / 2, (a[1] + a[3]) / 2};
+        quadtree_bounds_t *b;
+
+        while (node != NULL && node->bounds != NULL) {
+                b = node->bounds;
+                if (b->nw->x == a[0] && b->se->y == a[1] && b->se->x == a[2] && b->nw->y == a[3])
+                        return node;
+                if (!quadtree_node_ispointer(node))
+                        return NULL;
+                if (center.x <= node->nw->bounds->se->x)
+                        node = center.y >= node->nw->bounds->se->y ? node->nw : node->sw;
+                else
+                        node = center.y >= node->nw->bounds->se->y ? node->ne : node->se;
+        }
+        return NULL;
+}
+
+static int
+writes_(uint32_t call) {
+        switch (call) {
+                case QUADTREE_CALL_INSERT:
+                case QUADTREE_CALL_MOVE_LEAF:
+                case QUADTREE_CALL_CLEAR:
+                case QUADTREE_CALL_UNLINK_SUBTREE:
+                case QUADTREE_CALL_MOVE_SUBTREE:
+                        return 1;
+                default:
+                        return 0;
+        }
+}
+
+/* Points box at corners and fills both from minx, miny, maxx, maxy. */
+static void
+box_(quadtree_bounds_t *box, quadtree_point_t *corners, const double *a) {
+        corners[0].x = a[0];
+        corners[0].y = a[3];
+        corners[1].x = a[2];
+        corners[1].y = a[1];
+        box->nw = &corners[0];
+        box->se = &corners[1];
+        box->width = a[2] - a[0];
+        box->height = a[3] - a[1];
+}
+
+/*
+ * Gathers the arguments of rec and the MORE records after it, and builds
+ * what the call takes from them. A count past what was recorded (a cut off
+ * file) is clamped. Returns 0 when out of memory.
+ */
+static int
+inputs_(quadtree_recording_record_t *rec, inputs_t *in) {
+        size_t more = 0, have, need = 0, i;
+        const double *v;
+
+        memset(in, 0, sizeof(*in));
+        while (rec[more + 1].call == QUADTREE_CALL_MORE)
+                more++;
+        have = 4 * (more + 1);
+        if (!(in->args = malloc(have * sizeof(*in->args))))
+                return 0;
+        for (i = 0; i <= more; i++)
+                memcpy(&in->args[4 * i], rec[i].args, sizeof(rec[i].args));
+        v = in->args;
+        switch (rec->call) {
+                case QUADTREE_CALL_SEARCH_BATCH:
+                        in->n = v[0] > (have - 1) / 2 ? (have - 1) / 2 : (size_t)v[0];
+                        in->xs = malloc(in->n * sizeof(*in->xs) + 1);
+                        in->ys = malloc(in->n * sizeof(*in->ys) + 1);
+                        in->found = malloc(in->n * sizeof(*in->found) + 1);
+                        if (!in->xs || !in->ys || !in->found)
+                                return 0;
+                        for (i = 0; i < in->n; i++) {
+                                in->xs[i] = v[1 + 2 * i];
+                                in->ys[i] = v[2 + 2 * i];
+                        }
+                        return 1;
+                case QUADTREE_CALL_SEARCH_MULTI:
+                        in->n = v[0] > (have - 1) / 4 ? (have - 1) / 4 : (size_t)v[0];
+                        in->points = malloc(2 * in->n * sizeof(*in->points) + 1);
+                        in->boxes = malloc(in->n * sizeof(*in->boxes) + 1);
+                        in->lists = malloc(in->n * sizeof(*in->lists) + 1);
+                        if (!in->points || !in->boxes || !in->lists)
+                                return 0;
+                        for (i = 0; i < in->n; i++)
+                                box_(&in->boxes[i], &in->points[2 * i], &v[1 + 4 * i]);
+                        return 1;
+                case QUADTREE_CALL_SEARCH_WINDOW:
+                        need = 2;
+                        /* fall through */
+                case QUADTREE_CALL_COUNT_BOUNDS:
+                case QUADTREE_CALL_DENSITY_GRID:
+                case QUADTREE_CALL_AGGREGATE:
+                        if (need == 2 && v[2] == 0)
+                                return 1;
+                        in->n = 1;
+                        if (!(in->points = malloc(2 * sizeof(*in->points))) ||
+                            !(in->boxes = malloc(sizeof(*in->boxes))))
+                                return 0;
+                        box_(in->boxes, in->points, &v[need == 2 ? 3 : 0]);
+                        if (rec->call == QUADTREE_CALL_DENSITY_GRID)
+                                in->counts = malloc((size_t)v[4] * (size_t)v[5] * sizeof(*in->counts) + 1);
+                        return rec->call != QUADTREE_CALL_DENSITY_GRID || in->counts != NULL;
+                case QUADTREE_CALL_SEARCH_POLYGON:
+                case QUADTREE_CALL_SEARCH_POLYLINE:
+                        need = rec->call == QUADTREE_CALL_SEARCH_POLYLINE;
+                        in->n = v[need] > (have - need - 1) / 2 ? (have - need - 1) / 2 : (size_t)v[need];
+                        if (!(in->points = malloc(in->n * sizeof(*in->points) + 1)))
+                                return 0;
+                        for (i = 0; i < in->n; i++) {
+                                in->points[i].x = v[need + 1 + 2 * i];
+                                in->points[i].y = v[need + 2 + 2 * i];
+                        }
+                        return 1;
+                default:
+                        return 1;
+        }
+}
+
+static void
+inputs_free_(inputs_t *in) {
+        free(in->args);
+        free(in->xs);
+        free(in->ys);
+        free(in->points);
+        free(in->boxes);
+        free(in->found);
+        free(in->lists);
+        free(in->counts);
+}
+
+/* Runs one call, returns its latency. Finding the node a call needs is not counted. */
+static uint64_t
+run_(quadtree_recording_record_t *rec, histogram_t *h) {
+        const double *a = rec->args;
+        quadtree_node_list_t *list = NULL;
+        quadtree_node_t *node = NULL, *old_root = NULL;
+        quadtree_point_t to = {a[2], a[3]};
+        uint64_t t0, t1, waited = 0;
+        int write = writes_(rec->call), ok = 1;
+        double out;
+        inputs_t in;
+        size_t i;
+
+        if (!inputs_(rec, &in)) {
+                inputs_free_(&in);
+                h->missed++;
+                return 0;
+        }
+        t0 = now_();
+        if (locking) {
+                if (write)
+                        pthread_rwlock_wrlock(&lock);
+                else
+                        pthread_rwlock_rdlock(&lock);
+                waited = now_() - t0;
+        }
+        switch (rec->call) {
+                case QUADTREE_CALL_MOVE_LEAF:
+                case QUADTREE_CALL_CLEAR:
+                        node = quadtree_node_search(tree, a[0], a[1]);
+                        break;
+                case QUADTREE_CALL_UNLINK_SUBTREE:
+                case QUADTREE_CALL_MOVE_SUBTREE:
+                        node = find_subtree_(a);
+                        if (node == tree->root)
+                                node = NULL;
+                        old_root = tree->root;
+                        break;
+                default:
+                        break;
+        }
+
+        t0 = now_();
+        switch (rec->call) {
+                case QUADTREE_CALL_INSERT:
+                        quadtree_insert_at(tree, a[0], a[1], a[2], &key, NULL);
+                        break;
+                case QUADTREE_CALL_SEARCH:
+                        quadtree_search(tree, a[0], a[1]);
+                        break;
+                case QUADTREE_CALL_SEARCH_BOUNDS:
+                        list = quadtree_search_bounds(tree, a[0], a[1], a[2]);
+                        break;
+                case QUADTREE_CALL_SEARCH_PARTIAL:
+                        list = quadtree_search_bounds_include_partial(tree, a[0], a[1], a[2]);
+                        break;
+                case QUADTREE_CALL_MOVE_LEAF:
+                        if (node != NULL)
+                                quadtree_move_leaf(tree, &node, &to);
+                        break;
+                case QUADTREE_CALL_CLEAR:
+                        if (node != NULL)
+                                quadtree_clear_leaf_with_condense(tree, node);
+                        break;
+                case QUADTREE_CALL_UNLINK_SUBTREE:
+                        if (node != NULL)
+                                quadtree_unlink_subtree(tree, node);
+                        break;
+                case QUADTREE_CALL_MOVE_SUBTREE:
+                        if (node != NULL)
+                                quadtree_move_subtree(tree, node);
+                        break;
+                case QUADTREE_CALL_SEARCH_BATCH:
+                        quadtree_search_batch(tree, in.xs, in.ys, in.n, in.found);
+                        break;
+                case QUADTREE_CALL_SEARCH_WINDOW:
+                        list = quadtree_search_window(tree, in.boxes, in.args[0], in.args[1]);
+                        break;
+                case QUADTREE_CALL_SEARCH_MULTI:
+                        ok = quadtree_search_bounds_multi(tree, in.boxes, in.n, in.lists) > 0;
+                        break;
+                case QUADTREE_CALL_COUNT_BOUNDS:
+                        quadtree_count_bounds(tree, in.boxes);
+                        break;
+                case QUADTREE_CALL_DENSITY_GRID:
+                        quadtree_density_grid(tree, in.boxes, (unsigned int)in.args[4], (unsigned int)in.args[5],
+                                              in.counts);
+                        break;
+                case QUADTREE_CALL_AGGREGATE:
+                        quadtree_aggregate_bounds(tree, in.boxes, &out);
+                        break;
+                case QUADTREE_CALL_SEARCH_POLYGON:
+                        list = quadtree_search_polygon(tree, in.points, in.n);
+                        break;
+                case QUADTREE_CALL_SEARCH_POLYLINE:
+                        list = quadtree_search_polyline(tree, in.points, in.n, in.args[0]);
+                        break;
+                default:
+                        break;
+        }
+        t1 = now_();
+        if (locking)
+                pthread_rwlock_unlock(&lock);
+
+        quadtree_node_list_free(list);
+        for (i = 0; in.lists != NULL && i < in.n; i++)
+                quadtree_node_list_free(in.lists[i]);
+        inputs_free_(&in);
+        if (node != NULL && rec->call == QUADTREE_CALL_UNLINK_SUBTREE)
+                quadtree_node_free(node, no_free_);
+        /* With auto_shrink the old root may already be gone. */
+        if (node != NULL && rec->call == QUADTREE_CALL_MOVE_SUBTREE && !tree->auto_shrink)
+                quadtree_node_free(old_root, no_free_);
+        if ((node == NULL && write && rec->call != QUADTREE_CALL_INSERT) || !ok)
+                h->missed++;
+        return waited + (t1 - t0);
+}
+
+static void *
+work_(void *arg) {
+        worker_t *worker = arg;
+        quadtree_recording_record_t *rec;
+        size_t i;
+
+        for (i = 0; i < worker->n; i++) {
+                rec = worker->records[i];
+                if (paced)
+                        wait_until_(rec->ns - first_ns);
+                add_(&worker->histograms[rec->call], run_(rec, &worker->histograms[rec->call]));
+        }
+        return NULL;
+}
+
+static double
+percentile_(histogram_t *h, double p) {
+        uint64_t seen = 0, want = (uint64_t)(p * h->n);
+        unsigned int b;
+        for (b = 0; b < BUCKETS; b++) {
+                if ((seen += h->counts[b]) > want)
+                        break;
+        }
+        return b == 0 ? 0 : (double)(1ull << b) / 1000;
+}
+
+static void
+report_(const char *name, histogram_t *h) {
+        uint64_t most = 0;
+        unsigned int b, bar;
+
+        printf("  %-15s %10llu calls, mean %9.3fus, p50 <%9.3fus, p99 <%9.3fus, p99.9 <%9.3fus, max %9.3fus", name,
+               (unsigned long long)h->n, (double)h->total_ns / h->n / 1000, percentile_(h, 0.5),
+               percentile_(h, 0.99), percentile_(h, 0.999), (double)h->max_ns / 1000);
+        if (h->missed > 0)
+                printf(", %llu missed", (unsigned long long)h->missed);
+        printf("\n");
+        for (b = 0; b < BUCKETS; b++)
+                most = h->counts[b] > most ? h->counts[b] : most;
+        for (b = 0; b < BUCKETS; b++) {
+                if (h->counts[b] == 0)
+                        continue;
+                printf("  %15s <%12.3fus %10llu ", "", (double)(1ull << b) / 1000, (unsigned long long)h->counts[b]);
+                for (bar = 0; bar < (h->counts[b] * 40 + most - 1) / most; bar++)
+                        putchar('#');
+                putchar('\n');
+        }
+}
+
+static void
+usage_(const char *name) {
+        fprintf(stderr, "usage: %s [-t threads] [-p] [-r] recording\n", name);
+        fprintf(stderr, "  -t  replay threads, default 1\n");
+        fprintf(stderr, "  -p  keep the recorded pacing instead of running flat out\n");
+        fprintf(stderr, "  -r  deal calls to threads round robin instead of by recorded thread\n");
+}
+
+int
+main(int argc, char *argv[]) {
+        quadtree_recording_header_t header;
+        quadtree_recording_record_t *records = NULL, *grown;
+        histogram_t total[CALLS];
+        quadtree_recording_record_t *rec;
+        worker_t *workers;
+        size_t n = 0, capacity = 0, preloaded = 0, calls = 0, i, w;
+        unsigned int threads = 1, c, b;
+        int opt, round_robin = 0;
+        uint64_t elapsed;
+        FILE *fp;
+
+        while ((opt = getopt(argc, argv, "t:pr")) != -1) {
+                switch (opt) {
+                        case 't':
+                                threads = (unsigned int)atoi(optarg);
+                                break;
+                        case 'p':
+                                paced = 1;
+                                break;
+                        case 'r':
+                                round_robin = 1;
+                                break;
+                        default:
+                                usage_(argv[0]);
+                                return 1;
+                }
+        }
+        if (optind != argc - 1 || threads == 0) {
+                usage_(argv[0]);
+                return 1;
+        }
+        if (!(fp = fopen(argv[optind], "rb"))) {
+                perror(argv[optind]);
+                return 1;
+        }
+        if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, QUADTREE_RECORDING_MAGIC, 4) != 0 ||
+            header.version != QUADTREE_RECORDING_FORMAT || header.record_size != sizeof(*records)) {
+                fprintf(stderr, "%s: not a quadtree recording\n", argv[optind]);
+                fclose(fp);
+                return 1;
+        }
+        for (;;) {
+                if (n == capacity) {
+                        capacity = capacity > 0 ? capacity * 2 : 4096;
+                        if (!(grown = realloc(records, capacity * sizeof(*records)))) {
+                                perror("realloc");
+                                return 1;
+                        }
+                        records = grown;
+                }
+                if (fread(&records[n], sizeof(*records), 1, fp) != 1)
+                        break;
+                if (records[n].call <= QUADTREE_CALL_MORE)
+                        n++;
+        }
+        fclose(fp);
+        /* Ends the MORE records of the last call; the failed read left room for it. */
+        memset(&records[n], 0, sizeof(*records));
+
+        if (header.shape[8] != 0)
+                tree = quadtree_new_with_aggregate(header.shape[0], header.shape[1], header.shape[2], header.shape[3],
+                                                   &count_);
+        else
+                tree = quadtree_new(header.shape[0], header.shape[1], header.shape[2], header.shape[3]);
+        quadtree_set_depth_limit(tree, (unsigned int)header.shape[4], header.shape[5]);
+        quadtree_set_auto_grow(tree, (int)header.shape[6], (int)header.shape[7]);
+        tree->key_free = no_free_;
+        while (preloaded < n && records[preloaded].call == QUADTREE_CALL_PRELOAD) {
+                quadtree_insert_at(tree, records[preloaded].args[0], records[preloaded].args[1],
+                                   records[preloaded].args[2], &key, NULL);
+                preloaded++;
+        }
+
+        workers = calloc(threads, sizeof(*workers));
+        for (w = 0; w < threads; w++)
+                workers[w].records = malloc((n - preloaded + 1) * sizeof(*workers[w].records));
+        for (i = preloaded; i < n; i++) {
+                rec = &records[i];
+                if (rec->call == QUADTREE_CALL_MORE)
+                        continue;
+                w = round_robin ? calls % threads : (rec->thread + threads - 1) % threads;
+                workers[w].records[workers[w].n++] = rec;
+                calls++;
+        }
+        first_ns = preloaded < n ? records[preloaded].ns : 0;
+        locking = threads > 1;
+        pthread_rwlock_init(&lock, NULL);
+
+        printf("# %zu points preloaded, %zu calls, %u thread%s%s\n", preloaded, calls, threads,
+               threads > 1 ? "s" : "", paced ? ", paced" : "");
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        elapsed = now_();
+        if (threads == 1) {
+                work_(&workers[0]);
+        } else {
+                for (w = 0; w < threads; w++)
+                        pthread_create(&workers[w].thread, NULL, work_, &workers[w]);
+                for (w = 0; w < threads; w++)
+                        pthread_join(workers[w].thread, NULL);
+        }
+        elapsed = now_() - elapsed;
+        printf("# %.4fs, %.0f calls/s, %u points left\n", elapsed / 1e9, calls / (elapsed / 1e9),
+               tree->length);
+
+        memset(total, 0, sizeof(total));
+        for (w = 0; w < threads; w++) {
+                for (c = 0; c < CALLS; c++) {
+                        for (b = 0; b < BUCKETS; b++)
+                                total[c].counts[b] += workers[w].histograms[c].counts[b];
+                        total[c].n += workers[w].histograms[c].n;
+                        total[c].total_ns += workers[w].histograms[c].total_ns;
+                        total[c].missed += workers[w].histograms[c].missed;
+                        if (workers[w].histograms[c].max_ns > total[c].max_ns)
+                                total[c].max_ns = workers[w].histograms[c].max_ns;
+                }
+                free(workers[w].records);
+        }
+        for (c = 0; c < CALLS; c++) {
+                if (total[c].n > 0)
+                        report_(call_names[c], &total[c]);
+        }
+
+        pthread_rwlock_destroy(&lock);
+        free(workers);
+        free(records);
+        quadtree_free(tree);
+        return 0;
+}
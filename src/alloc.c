@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+
+#include "quadtree.h"
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static void *
+malloc_alloc_(void *ctx, size_t size) {
+        return malloc(size);
+}
+
+static void
+malloc_release_(void *ctx, void *ptr, size_t size) {
+        free(ptr);
+}
+
+const quadtree_allocator_t quadtree_malloc_allocator = {malloc_alloc_, malloc_release_, NULL};
+
+void *
+quadtree_alloc(const quadtree_allocator_t *allocator, size_t size) {
+        return allocator->alloc(allocator->ctx, size);
+}
+
+void
+quadtree_release(const quadtree_allocator_t *allocator, void *ptr, size_t size) {
+        if (ptr != NULL)
+                allocator->release(allocator->ctx, ptr, size);
+}
+
+/*
+ * Arenas. One mapping reserved up front and handed out by bumping a
+ * pointer. Released blocks go on a free list per 16 byte size class and are
+ * reused first. Bigger blocks (id tables, scratch) go on one address ordered
+ * list where neighbours merge, first fit splits them, and a block ending at
+ * the bump pointer hands its space straight back. Tree allocations are a
+ * handful of small fixed sizes, so this packs nodes, bounds and points
+ * densely. An arena is not thread safe: give each tree its own. Read queries
+ * take their results from malloc, so concurrent readers never touch it.
+ */
+#define ARENA_GRAIN 16
+#define ARENA_CLASSES 16 /* blocks up to 256 bytes are recycled by size class */
+#define ARENA_HUGEPAGE (2u << 20)
+
+typedef struct large_block {
+        struct large_block *next;
+        size_t size;
+} large_block_t;
+
+typedef struct arena {
+        quadtree_allocator_t allocator; /* first, the handle is the arena */
+        char *base;
+        size_t capacity;
+        size_t used;
+        void *free_lists[ARENA_CLASSES];
+        large_block_t *large; /* released big blocks, by address */
+} arena_t;
+
+static void *
+alloc_large_(arena_t *arena, size_t rounded) {
+        large_block_t **it, *block, *rest;
+
+        for (it = &arena->large; (block = *it) != NULL; it = &block->next) {
+                if (block->size < rounded)
+                        continue;
+                if (block->size > rounded) {
+                        rest = (large_block_t *)((char *)block + rounded);
+                        rest->size = block->size - rounded;
+                        rest->next = block->next;
+                        *it = rest;
+                } else {
+                        *it = block->next;
+                }
+                return block;
+        }
+        return NULL;
+}
+
+static void
+release_large_(arena_t *arena, void *ptr, size_t rounded) {
+        large_block_t **it = &arena->large, *prev = NULL, *block = ptr;
+
+        while (*it != NULL && (char *)*it < (char *)ptr) {
+                prev = *it;
+                it = &prev->next;
+        }
+        block->size = rounded;
+        block->next = *it;
+        *it = block;
+        if (block->next != NULL && (char *)block + block->size == (char *)block->next) {
+                block->size += block->next->size;
+                block->next = block->next->next;
+        }
+        if (prev != NULL && (char *)prev + prev->size == (char *)block) {
+                prev->size += block->size;
+                prev->next = block->next;
+                block = prev;
+        }
+        /* The last block before the bump pointer goes back to it. */
+        if (block->next == NULL && (char *)block + block->size == arena->base + arena->used) {
+                arena->used -= block->size;
+                for (it = &arena->large; *it != block; it = &(*it)->next)
+                        ;
+                *it = NULL;
+        }
+}
+
+static void *
+arena_alloc_(void *ctx, size_t size) {
+        arena_t *arena = ctx;
+        size_t rounded = (size + ARENA_GRAIN - 1) & ~(size_t)(ARENA_GRAIN - 1);
+        size_t class = rounded / ARENA_GRAIN - 1;
+        void *block;
+
+        if (rounded == 0)
+                return NULL;
+        if (class < ARENA_CLASSES && (block = arena->free_lists[class]) != NULL) {
+                arena->free_lists[class] = *(void **)block;
+                return block;
+        }
+        if (class >= ARENA_CLASSES && (block = alloc_large_(arena, rounded)) != NULL)
+                return block;
+        if (rounded > arena->capacity - arena->used)
+                return NULL;
+        block = arena->base + arena->used;
+        arena->used += rounded;
+        return block;
+}
+
+static void
+arena_release_(void *ctx, void *ptr, size_t size) {
+        arena_t *arena = ctx;
+        size_t rounded = (size + ARENA_GRAIN - 1) & ~(size_t)(ARENA_GRAIN - 1);
+        size_t class = rounded / ARENA_GRAIN - 1;
+        if (size == 0)
+                return;
+        if (class >= ARENA_CLASSES) {
+                release_large_(arena, ptr, rounded);
+                return;
+        }
+        *(void **)ptr = arena->free_lists[class];
+        arena->free_lists[class] = ptr;
+}
+
+#ifdef __linux__
+
+static arena_t *
+arena_map_(size_t capacity, int hugetlb) {
+        arena_t *arena;
+        void *base = MAP_FAILED;
+
+        capacity = (capacity + ARENA_HUGEPAGE - 1) & ~(size_t)(ARENA_HUGEPAGE - 1);
+        if (capacity == 0 || !(arena = calloc(1, sizeof(*arena))))
+                return NULL;
+#ifdef MAP_HUGETLB
+        /* Explicit huge pages need a reserved pool, fall back to asking THP. */
+        if (hugetlb)
+                base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (base == MAP_FAILED) {
+                base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (base == MAP_FAILED) {
+                        free(arena);
+                        return NULL;
+                }
+#ifdef MADV_HUGEPAGE
+                madvise(base, capacity, MADV_HUGEPAGE);
+#endif
+        }
+        arena->allocator.alloc = arena_alloc_;
+        arena->allocator.release = arena_release_;
+        arena->allocator.ctx = arena;
+        arena->base = base;
+        arena->capacity = capacity;
+        return arena;
+}
+
+/* An arena of at least capacity bytes on huge pages where the system has them. */
+quadtree_allocator_t *
+quadtree_hugepage_arena_new(size_t capacity) {
+        arena_t *arena = arena_map_(capacity, 1);
+        return arena != NULL ? &arena->allocator : NULL;
+}
+
+/*
+ * As quadtree_hugepage_arena_new, with the pages bound to one NUMA node so a
+ * tree used from that socket stays in local memory. Pages are bound before
+ * first touch. Returns NULL if the kernel refuses the binding.
+ */
+quadtree_allocator_t *
+quadtree_numa_arena_new(size_t capacity, int numa_node) {
+        unsigned long mask[16];
+        arena_t *arena;
+
+        if (numa_node < 0 || (size_t)numa_node >= sizeof(mask) * 8)
+                return NULL;
+        /* mbind on huge pages from the hugetlb pool is not always allowed. */
+        if (!(arena = arena_map_(capacity, 0)))
+                return NULL;
+        memset(mask, 0, sizeof(mask));
+        mask[numa_node / (sizeof(mask[0]) * 8)] |= 1ul << (numa_node % (sizeof(mask[0]) * 8));
+        /* MPOL_BIND is 2, spelled out to not need libnuma's headers. */
+        if (syscall(SYS_mbind, arena->base, arena->capacity, 2, mask, sizeof(mask) * 8, 0) != 0) {
+                quadtree_arena_free(&arena->allocator);
+                return NULL;
+        }
+        return &arena->allocator;
+}
+
+/* Drops the arena and everything allocated from it. */
+void
+quadtree_arena_free(quadtree_allocator_t *allocator) {
+        arena_t *arena = (arena_t *)allocator;
+        munmap(arena->base, arena->capacity);
+        free(arena);
+}
+
+#else
+
+quadtree_allocator_t *
+quadtree_hugepage_arena_new(size_t capacity) {
+        return NULL;
+}
+
+quadtree_allocator_t *
+quadtree_numa_arena_new(size_t capacity, int numa_node) {
+        return NULL;
+}
+
+void
+quadtree_arena_free(quadtree_allocator_t *allocator) {
+}
+
+#endif
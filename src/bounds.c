@@ -21,17 +21,20 @@ quadtree_bounds_extend(quadtree_bounds_t *bounds, double x, double y) {
 
 void
 quadtree_bounds_free(quadtree_bounds_t *bounds) {
-        quadtree_point_free(bounds->nw);
-        quadtree_point_free(bounds->se);
-        free(bounds);
-        // rte_free(bounds);
+        quadtree_bounds_release(&quadtree_malloc_allocator, bounds);
+}
+
+void
+quadtree_bounds_release(const quadtree_allocator_t *allocator, quadtree_bounds_t *bounds) {
+        quadtree_point_release(allocator, bounds->nw);
+        quadtree_point_release(allocator, bounds->se);
+        quadtree_release(allocator, bounds, sizeof(*bounds));
 }
 
 quadtree_bounds_t *
 quadtree_bounds_new() {
         quadtree_bounds_t *bounds;
         if ((bounds = malloc(sizeof(*bounds))) == NULL)
-                // if((bounds = rte_malloc("bounds", sizeof(*bounds),0)) == NULL)
                 return NULL;
         bounds->nw = quadtree_point_new(INFINITY, -INFINITY);
         bounds->se = quadtree_point_new(-INFINITY, INFINITY);
@@ -42,12 +45,22 @@ quadtree_bounds_new() {
 
 quadtree_bounds_t *
 quadtree_bounds_new_with_points(double xmin, double ymin, double xmax, double ymax) {
+        return quadtree_bounds_alloc(&quadtree_malloc_allocator, xmin, ymin, xmax, ymax);
+}
+
+quadtree_bounds_t *
+quadtree_bounds_alloc(const quadtree_allocator_t *allocator, double xmin, double ymin, double xmax, double ymax) {
         quadtree_bounds_t *bounds;
-        // if((bounds = rte_malloc("bounds", sizeof(*bounds),0)) == NULL)
-        if ((bounds = malloc(sizeof(*bounds))) == NULL)
+        if ((bounds = quadtree_alloc(allocator, sizeof(*bounds))) == NULL)
+                return NULL;
+        bounds->nw = quadtree_point_alloc(allocator, xmin, ymax);
+        bounds->se = quadtree_point_alloc(allocator, xmax, ymin);
+        if (bounds->nw == NULL || bounds->se == NULL) {
+                quadtree_point_release(allocator, bounds->nw);
+                quadtree_point_release(allocator, bounds->se);
+                quadtree_release(allocator, bounds, sizeof(*bounds));
                 return NULL;
-        bounds->nw = quadtree_point_new(xmin, ymax);
-        bounds->se = quadtree_point_new(xmax, ymin);
+        }
         bounds->width = xmax - xmin;
         bounds->height = ymax - ymin;
         return bounds;
@@ -0,0 +1,65 @@
+#ifndef __QUADTREE_EXT_H__
+#define __QUADTREE_EXT_H__
+
+#include "quadtree.h"
+#include <assert.h>
+
+/* A node's optional data, read as the defaults when it has no ext block. */
+static inline quadtree_node_t *
+next_entry_(quadtree_node_t *node) {
+        return node->ext != NULL ? node->ext->overflow : NULL;
+}
+
+static inline quadtree_object_t *
+node_objects_(quadtree_node_t *node) {
+        return node->ext != NULL ? node->ext->objects : NULL;
+}
+
+static inline unsigned int
+node_id_(quadtree_node_t *node) {
+        return node->ext != NULL ? node->ext->id : 0;
+}
+
+static inline double
+node_time_(quadtree_node_t *node) {
+        return node->ext != NULL ? node->ext->time : 0;
+}
+
+/* Every point of a plain tree is timed 0, an empty cell has no range. */
+static inline double
+node_tmin_(quadtree_node_t *node) {
+        if (node->ext != NULL)
+                return node->ext->tmin;
+        return quadtree_node_isempty(node) ? HUGE_VAL : 0;
+}
+
+static inline double
+node_tmax_(quadtree_node_t *node) {
+        if (node->ext != NULL)
+                return node->ext->tmax;
+        return quadtree_node_isempty(node) ? -HUGE_VAL : 0;
+}
+
+static inline const quadtree_allocator_t *
+node_allocator_(quadtree_node_t *node) {
+        return node->ext != NULL ? node->ext->allocator : &quadtree_malloc_allocator;
+}
+
+/* A plain node can only take the defaults. */
+static inline void
+set_id_(quadtree_node_t *node, unsigned int id) {
+        if (node->ext != NULL)
+                node->ext->id = id;
+        else
+                assert(id == 0);
+}
+
+static inline void
+set_time_(quadtree_node_t *node, double time) {
+        if (node->ext != NULL)
+                node->ext->time = time;
+        else
+                assert(time == 0);
+}
+
+#endif
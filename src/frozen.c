@@ -0,0 +1,397 @@
+#include "quadtree.h"
+#include "ext.h"
+#include "grid.h"
+#include <string.h>
+
+/* Levels of quadrant groups laid out together before the next block starts. */
+#define FROZEN_BLOCK_LEVELS 3
+
+typedef struct pending {
+        quadtree_node_t *node;
+        uint32_t index;
+        unsigned int level;
+} pending_t;
+
+typedef struct pending_queue {
+        pending_t *items;
+        size_t head;
+        size_t length;
+        size_t capacity;
+} pending_queue_t;
+
+static int
+push_(pending_queue_t *queue, quadtree_node_t *node, uint32_t index, unsigned int level) {
+        pending_t *grown;
+        if (queue->length == queue->capacity) {
+                queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+                if (!(grown = realloc(queue->items, queue->capacity * sizeof(*grown))))
+                        return 0;
+                queue->items = grown;
+        }
+        queue->items[queue->length].node = node;
+        queue->items[queue->length].index = index;
+        queue->items[queue->length].level = level;
+        queue->length++;
+        return 1;
+}
+
+static void
+keep_key_(void *key) {
+}
+
+static unsigned int
+count_(quadtree_node_t *node) {
+        if (quadtree_node_ispointer(node))
+                return node->weight;
+        return quadtree_node_isleaf(node) ? 1 + node->weight : 0;
+}
+
+static size_t
+count_nodes_(quadtree_node_t *node) {
+        if (!quadtree_node_ispointer(node))
+                return 1;
+        return 1 + count_nodes_(node->nw) + count_nodes_(node->ne) + count_nodes_(node->sw) + count_nodes_(node->se);
+}
+
+/* Boxes are not frozen, they go with the tree. */
+static void
+release_objects_(quadtree_node_t *node, void (*key_free)(void *key)) {
+        quadtree_object_t *object;
+        while ((object = node_objects_(node)) != NULL) {
+                node->ext->objects = object->next;
+                if (key_free != NULL)
+                        key_free(object->key);
+                quadtree_release(node->ext->allocator, object, sizeof(*object));
+        }
+        if (quadtree_node_ispointer(node)) {
+                release_objects_(node->nw, key_free);
+                release_objects_(node->ne, key_free);
+                release_objects_(node->sw, key_free);
+                release_objects_(node->se, key_free);
+        }
+}
+
+static void
+fill_(quadtree_frozen_t *frozen, uint32_t index, quadtree_node_t *node, uint32_t first) {
+        quadtree_frozen_node_t *out = &frozen->nodes[index];
+        quadtree_node_t *entry;
+        uint32_t i = first;
+
+        memset(out, 0, sizeof(*out));
+        out->minx = node->bounds->nw->x;
+        out->miny = node->bounds->se->y;
+        out->maxx = node->bounds->se->x;
+        out->maxy = node->bounds->nw->y;
+        out->first = first;
+        out->count = count_(node);
+        if (frozen->aggregate != NULL)
+                out->agg = out->count > 0 ? node->ext->agg : frozen->aggregate->identity;
+
+        if (!quadtree_node_isleaf(node))
+                return;
+        for (entry = node; entry != NULL; entry = next_entry_(entry), i++) {
+                frozen->points[i].point = *entry->point;
+                frozen->points[i].key = entry->key;
+                if (frozen->values != NULL)
+                        frozen->values[i] = frozen->aggregate->init(entry);
+        }
+}
+
+/*
+ * Quadrant groups are placed breadth first, FROZEN_BLOCK_LEVELS levels at a
+ * time: a block holds a group and the groups below it down to that depth, so
+ * the first steps of a descent stay within a few pages. Deeper groups start
+ * blocks of their own. A child's first point follows from its elder
+ * siblings' counts, which lays the points out depth first.
+ */
+static int
+build_(quadtree_frozen_t *frozen, quadtree_node_t *root) {
+        pending_queue_t blocks = {NULL, 0, 0, 0};
+        pending_queue_t local = {NULL, 0, 0, 0};
+        uint32_t next = 1;
+        int ok = 1;
+
+        fill_(frozen, 0, root, 0);
+        if (quadtree_node_ispointer(root))
+                ok = push_(&blocks, root, 0, 0);
+
+        while (ok && blocks.head < blocks.length) {
+                pending_t group = blocks.items[blocks.head++];
+                local.head = local.length = 0;
+                ok = push_(&local, group.node, group.index, 0);
+                while (ok && local.head < local.length) {
+                        pending_t parent = local.items[local.head++];
+                        quadtree_node_t *quads[4] = {parent.node->nw, parent.node->ne, parent.node->sw,
+                                                     parent.node->se};
+                        uint32_t first = frozen->nodes[parent.index].first;
+                        int i;
+
+                        frozen->nodes[parent.index].child = next;
+                        for (i = 0; i < 4; i++) {
+                                fill_(frozen, next + i, quads[i], first);
+                                first += frozen->nodes[next + i].count;
+                                if (!quadtree_node_ispointer(quads[i]))
+                                        continue;
+                                if (parent.level + 1 < FROZEN_BLOCK_LEVELS)
+                                        ok = ok && push_(&local, quads[i], next + i, parent.level + 1);
+                                else
+                                        ok = ok && push_(&blocks, quads[i], next + i, 0);
+                        }
+                        next += 4;
+                }
+        }
+        free(blocks.items);
+        free(local.items);
+        return ok;
+}
+
+/*
+ * Moves tree into a frozen copy and frees it; the frozen tree now owns the
+ * keys and frees them with the tree's key_free. Boxes are dropped. Returns
+ * NULL, leaving the tree as it was, when out of memory.
+ */
+quadtree_frozen_t *
+quadtree_freeze(quadtree_t *tree) {
+        quadtree_frozen_t *frozen;
+        size_t nodes_size, points_size, values_size;
+        const quadtree_allocator_t *allocator = tree->allocator;
+        void *block;
+
+        quadtree_sync_weights(tree);
+        if (!(frozen = quadtree_alloc(allocator, sizeof(*frozen))))
+                return NULL;
+        frozen->allocator = allocator;
+        frozen->node_count = count_nodes_(tree->root);
+        frozen->length = count_(tree->root);
+        frozen->key_free = tree->key_free;
+        frozen->aggregate = tree->aggregate;
+
+        nodes_size = sizeof(quadtree_frozen_node_t) * frozen->node_count;
+        points_size = sizeof(quadtree_frozen_point_t) * frozen->length;
+        values_size = tree->aggregate != NULL ? sizeof(double) * frozen->length : 0;
+        /* Allocators only promise malloc alignment, line the nodes up by hand. */
+        frozen->block_size = nodes_size + points_size + values_size + 63;
+        if (!(block = quadtree_alloc(allocator, frozen->block_size))) {
+                quadtree_release(allocator, frozen, sizeof(*frozen));
+                return NULL;
+        }
+        frozen->block = block;
+        frozen->nodes = (quadtree_frozen_node_t *)(((uintptr_t)block + 63) & ~(uintptr_t)63);
+        frozen->points = (quadtree_frozen_point_t *)((char *)frozen->nodes + nodes_size);
+        frozen->values = tree->aggregate != NULL ? (double *)((char *)frozen->nodes + nodes_size + points_size) : NULL;
+
+        if (!build_(frozen, tree->root)) {
+                quadtree_release(allocator, block, frozen->block_size);
+                quadtree_release(allocator, frozen, sizeof(*frozen));
+                return NULL;
+        }
+
+        release_objects_(tree->root, tree->key_free);
+        quadtree_drop_ids(tree);
+        quadtree_node_free(tree->root, keep_key_);
+        quadtree_release(allocator, tree->tidy.path, tree->tidy.capacity);
+        quadtree_release(allocator, tree, sizeof(*tree));
+        return frozen;
+}
+
+void
+quadtree_frozen_free(quadtree_frozen_t *frozen) {
+        unsigned int i;
+        if (frozen->key_free != NULL) {
+                for (i = 0; i < frozen->length; i++)
+                        frozen->key_free(frozen->points[i].key);
+        }
+        quadtree_release(frozen->allocator, frozen->block, frozen->block_size);
+        quadtree_release(frozen->allocator, frozen, sizeof(*frozen));
+}
+
+/* queries */
+
+static inline int
+contains_(quadtree_frozen_node_t *node, double x, double y) {
+        return node->minx <= x && node->maxx >= x && node->miny <= y && node->maxy >= y;
+}
+
+static inline int
+overlaps_(quadtree_frozen_node_t *node, quadtree_bounds_t *box) {
+        return !(node->minx > box->se->x || box->nw->x > node->maxx || node->maxy < box->se->y ||
+                 box->nw->y < node->miny);
+}
+
+static inline int
+inside_(quadtree_frozen_node_t *node, quadtree_bounds_t *box) {
+        return box->nw->x <= node->minx && box->se->x >= node->maxx && box->se->y <= node->miny &&
+               box->nw->y >= node->maxy;
+}
+
+static inline int
+box_contains_(quadtree_bounds_t *box, quadtree_point_t *point) {
+        return box->nw->x <= point->x && box->nw->y >= point->y && box->se->x >= point->x && box->se->y <= point->y;
+}
+
+/* Same descent as quadtree_search: the first quadrant containing the point. */
+const quadtree_frozen_point_t *
+quadtree_frozen_search(quadtree_frozen_t *frozen, double x, double y) {
+        quadtree_frozen_node_t *node = frozen->nodes;
+        quadtree_frozen_node_t *quads;
+        uint32_t i;
+
+        while (node->child != 0) {
+                quads = &frozen->nodes[node->child];
+                for (i = 0; i < 4 && !contains_(&quads[i], x, y); i++)
+                        ;
+                if (i == 4)
+                        return NULL;
+                node = &quads[i];
+        }
+        for (i = node->first; i < node->first + node->count; i++) {
+                if (frozen->points[i].point.x == x && frozen->points[i].point.y == y)
+                        return &frozen->points[i];
+        }
+        return NULL;
+}
+
+static unsigned int
+search_bounds_(quadtree_frozen_t *frozen, quadtree_frozen_node_t *node, quadtree_bounds_t *box,
+               void (*callback)(const quadtree_frozen_point_t *point, void *ctx), void *ctx) {
+        quadtree_frozen_node_t *quads;
+        unsigned int count = 0;
+        uint32_t i;
+        int inside;
+
+        if (node->count == 0 || !overlaps_(node, box))
+                return 0;
+        inside = inside_(node, box);
+        if (inside || node->child == 0) {
+                /* A contained subtree is one run of points. */
+                for (i = node->first; i < node->first + node->count; i++) {
+                        if (inside || box_contains_(box, &frozen->points[i].point)) {
+                                callback(&frozen->points[i], ctx);
+                                count++;
+                        }
+                }
+                return count;
+        }
+        quads = &frozen->nodes[node->child];
+        for (i = 0; i < 4; i++)
+                count += search_bounds_(frozen, &quads[i], box, callback, ctx);
+        return count;
+}
+
+/* Calls back for every point inside box. Returns how many there were. */
+unsigned int
+quadtree_frozen_search_bounds(quadtree_frozen_t *frozen, quadtree_bounds_t *box,
+                              void (*callback)(const quadtree_frozen_point_t *point, void *ctx), void *ctx) {
+        return search_bounds_(frozen, frozen->nodes, box, callback, ctx);
+}
+
+static unsigned int
+count_bounds_(quadtree_frozen_t *frozen, quadtree_frozen_node_t *node, quadtree_bounds_t *box) {
+        quadtree_frozen_node_t *quads;
+        unsigned int count = 0;
+        uint32_t i;
+
+        if (node->count == 0 || !overlaps_(node, box))
+                return 0;
+        if (inside_(node, box))
+                return node->count;
+        if (node->child == 0) {
+                for (i = node->first; i < node->first + node->count; i++)
+                        count += box_contains_(box, &frozen->points[i].point);
+                return count;
+        }
+        quads = &frozen->nodes[node->child];
+        for (i = 0; i < 4; i++)
+                count += count_bounds_(frozen, &quads[i], box);
+        return count;
+}
+
+unsigned int
+quadtree_frozen_count_bounds(quadtree_frozen_t *frozen, quadtree_bounds_t *box) {
+        return count_bounds_(frozen, frozen->nodes, box);
+}
+
+static unsigned int
+aggregate_bounds_(quadtree_frozen_t *frozen, quadtree_frozen_node_t *node, quadtree_bounds_t *box, double *agg) {
+        const quadtree_aggregate_t *aggregate = frozen->aggregate;
+        quadtree_frozen_node_t *quads;
+        unsigned int count = 0;
+        uint32_t i;
+
+        if (node->count == 0 || !overlaps_(node, box))
+                return 0;
+        if (inside_(node, box)) {
+                *agg = aggregate->combine(*agg, node->agg);
+                return node->count;
+        }
+        if (node->child == 0) {
+                for (i = node->first; i < node->first + node->count; i++) {
+                        if (box_contains_(box, &frozen->points[i].point)) {
+                                *agg = aggregate->combine(*agg, frozen->values[i]);
+                                count++;
+                        }
+                }
+                return count;
+        }
+        quads = &frozen->nodes[node->child];
+        for (i = 0; i < 4; i++)
+                count += aggregate_bounds_(frozen, &quads[i], box, agg);
+        return count;
+}
+
+/* As quadtree_aggregate_bounds, for trees frozen with an aggregate. */
+unsigned int
+quadtree_frozen_aggregate_bounds(quadtree_frozen_t *frozen, quadtree_bounds_t *box, double *out) {
+        if (frozen->aggregate == NULL)
+                return 0;
+        *out = frozen->aggregate->identity;
+        return aggregate_bounds_(frozen, frozen->nodes, box, out);
+}
+
+static unsigned int
+density_grid_(quadtree_frozen_t *frozen, density_grid_t *grid, quadtree_frozen_node_t *node) {
+        quadtree_frozen_node_t *quads;
+        unsigned int col, row, count = 0;
+        uint32_t i;
+
+        if (node->count == 0 || !overlaps_(node, grid->box))
+                return 0;
+        if (inside_(node, grid->box)) {
+                col = grid_col_(grid, node->minx);
+                row = grid_row_(grid, node->maxy);
+                if (col == grid_col_(grid, node->maxx) && row == grid_row_(grid, node->miny)) {
+                        grid->counts[row * grid->width + col] += node->count;
+                        return node->count;
+                }
+        }
+        if (node->child == 0) {
+                for (i = node->first; i < node->first + node->count; i++) {
+                        quadtree_point_t *point = &frozen->points[i].point;
+                        if (box_contains_(grid->box, point)) {
+                                grid->counts[grid_row_(grid, point->y) * grid->width + grid_col_(grid, point->x)]++;
+                                count++;
+                        }
+                }
+                return count;
+        }
+        quads = &frozen->nodes[node->child];
+        for (i = 0; i < 4; i++)
+                count += density_grid_(frozen, grid, &quads[i]);
+        return count;
+}
+
+/* As quadtree_density_grid. */
+unsigned int
+quadtree_frozen_density_grid(quadtree_frozen_t *frozen, quadtree_bounds_t *box, unsigned int width,
+                             unsigned int height, unsigned int *out_counts) {
+        density_grid_t grid;
+
+        if (width == 0 || height == 0)
+                return 0;
+        memset(out_counts, 0, sizeof(*out_counts) * width * height);
+        grid.box = box;
+        grid.width = width;
+        grid.height = height;
+        grid.counts = out_counts;
+        return density_grid_(frozen, &grid, frozen->nodes);
+}
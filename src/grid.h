@@ -0,0 +1,32 @@
+#ifndef __QUADTREE_GRID_H__
+#define __QUADTREE_GRID_H__
+
+#include "quadtree.h"
+
+/* Raster binning shared by quadtree_density_grid and its frozen twin. */
+typedef struct density_grid {
+        quadtree_bounds_t *box;
+        unsigned int width;
+        unsigned int height;
+        unsigned int *counts;
+} density_grid_t;
+
+/* Raster column of x, the box's east edge belongs to the last column. */
+static inline unsigned int
+grid_col_(density_grid_t *grid, double x) {
+        if (!(grid->box->width > 0))
+                return 0;
+        unsigned int col = (unsigned int)((x - grid->box->nw->x) / grid->box->width * grid->width);
+        return col < grid->width ? col : grid->width - 1;
+}
+
+/* Rows count down from the box's north edge. */
+static inline unsigned int
+grid_row_(density_grid_t *grid, double y) {
+        if (!(grid->box->height > 0))
+                return 0;
+        unsigned int row = (unsigned int)((grid->box->nw->y - y) / grid->box->height * grid->height);
+        return row < grid->height ? row : grid->height - 1;
+}
+
+#endif
@@ -0,0 +1,311 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "quadtree.h"
+#include "ext.h"
+#include <pthread.h>
+
+typedef struct join_ctx {
+        double d;
+        double d2;
+        int (*predicate)(quadtree_node_t *a, quadtree_node_t *b, double d, void *ctx);
+        void (*callback)(quadtree_node_t *a, quadtree_node_t *b, void *ctx);
+        void *ctx;
+} join_ctx_t;
+
+typedef struct join_task {
+        quadtree_node_t *a;
+        quadtree_node_t *b; /* same as a for a self pair */
+} join_task_t;
+
+typedef struct join_pool {
+        join_ctx_t *join;
+        join_task_t *tasks;
+        size_t length;
+        size_t next;
+        pthread_mutex_t lock;
+} join_pool_t;
+
+static void
+cross_(join_ctx_t *join, quadtree_node_t *a, quadtree_node_t *b);
+
+/* Squared distance between the closest points of two boxes. */
+static inline double
+bounds_dist2_(quadtree_bounds_t *a, quadtree_bounds_t *b) {
+        double dx = fmax(0, fmax(a->nw->x - b->se->x, b->nw->x - a->se->x));
+        double dy = fmax(0, fmax(b->se->y - a->nw->y, a->se->y - b->nw->y));
+        return dx * dx + dy * dy;
+}
+
+static inline double
+point_dist2_(quadtree_point_t *a, quadtree_point_t *b) {
+        double dx = a->x - b->x;
+        double dy = a->y - b->y;
+        return dx * dx + dy * dy;
+}
+
+static inline double
+area_(quadtree_node_t *node) {
+        return node->bounds->width * node->bounds->height;
+}
+
+/* Of a candidate pair, descend into a rather than b? */
+static inline int
+split_first_(quadtree_node_t *a, quadtree_node_t *b) {
+        return quadtree_node_ispointer(a) && (!quadtree_node_ispointer(b) || area_(a) >= area_(b));
+}
+
+static inline int
+match_(join_ctx_t *join, quadtree_node_t *a, quadtree_node_t *b) {
+        if (join->predicate != NULL)
+                return join->predicate(a, b, join->d, join->ctx);
+        return point_dist2_(a->point, b->point) <= join->d2;
+}
+
+/* Pairs inside one leaf and its overflow chain. */
+static void
+self_leaf_(join_ctx_t *join, quadtree_node_t *leaf) {
+        quadtree_node_t *a;
+        quadtree_node_t *b;
+        for (a = leaf; a != NULL; a = next_entry_(a)) {
+                for (b = next_entry_(a); b != NULL; b = next_entry_(b)) {
+                        if (match_(join, a, b))
+                                join->callback(a, b, join->ctx);
+                }
+        }
+}
+
+static void
+cross_leaves_(join_ctx_t *join, quadtree_node_t *leaf_a, quadtree_node_t *leaf_b) {
+        quadtree_node_t *a;
+        quadtree_node_t *b;
+        for (a = leaf_a; a != NULL; a = next_entry_(a)) {
+                for (b = leaf_b; b != NULL; b = next_entry_(b)) {
+                        if (match_(join, a, b))
+                                join->callback(a, b, join->ctx);
+                }
+        }
+}
+
+static void
+self_(join_ctx_t *join, quadtree_node_t *node) {
+        quadtree_node_t *quads[4];
+        int i, j;
+
+        if (quadtree_node_isleaf(node)) {
+                self_leaf_(join, node);
+        } else if (quadtree_node_ispointer(node)) {
+                quads[0] = node->nw;
+                quads[1] = node->ne;
+                quads[2] = node->sw;
+                quads[3] = node->se;
+                for (i = 0; i < 4; i++) {
+                        self_(join, quads[i]);
+                        for (j = i + 1; j < 4; j++)
+                                cross_(join, quads[i], quads[j]);
+                }
+        }
+}
+
+/*
+ * a and b are disjoint subtrees, possibly of different trees. Every pair
+ * across them is reported once, with the point from a first.
+ */
+static void
+cross_(join_ctx_t *join, quadtree_node_t *a, quadtree_node_t *b) {
+        if (quadtree_node_isempty(a) || quadtree_node_isempty(b))
+                return;
+        if (bounds_dist2_(a->bounds, b->bounds) > join->d2)
+                return;
+
+        if (quadtree_node_isleaf(a) && quadtree_node_isleaf(b)) {
+                cross_leaves_(join, a, b);
+                return;
+        }
+        /* Descend into the larger pointer side. */
+        if (split_first_(a, b)) {
+                cross_(join, a->nw, b);
+                cross_(join, a->ne, b);
+                cross_(join, a->sw, b);
+                cross_(join, a->se, b);
+        } else {
+                cross_(join, a, b->nw);
+                cross_(join, a, b->ne);
+                cross_(join, a, b->sw);
+                cross_(join, a, b->se);
+        }
+}
+
+static void
+join_init_(join_ctx_t *join, double d, int (*predicate)(quadtree_node_t *a, quadtree_node_t *b, double d, void *ctx),
+           void (*callback)(quadtree_node_t *a, quadtree_node_t *b, void *ctx), void *ctx) {
+        join->d = d;
+        join->d2 = d * d;
+        join->predicate = predicate;
+        join->callback = callback;
+        join->ctx = ctx;
+}
+
+void
+quadtree_self_join(quadtree_t *tree, double d,
+                   void (*callback)(quadtree_node_t *a, quadtree_node_t *b, void *ctx), void *ctx) {
+        join_ctx_t join;
+        join_init_(&join, d, NULL, callback, ctx);
+        self_(&join, tree->root);
+}
+
+/*
+ * Calls back for every (a, b) with a from tree_a and b from tree_b that
+ * satisfies predicate, or that are within d of each other if predicate is
+ * NULL. Node pairs whose bounds are more than d apart are never compared, so
+ * a predicate must only accept points within d. The trees may cover
+ * different areas.
+ */
+void
+quadtree_join(quadtree_t *tree_a, quadtree_t *tree_b,
+              int (*predicate)(quadtree_node_t *a, quadtree_node_t *b, double d, void *ctx), double d,
+              void (*callback)(quadtree_node_t *a, quadtree_node_t *b, void *ctx), void *ctx) {
+        join_ctx_t join;
+        join_init_(&join, d, predicate, callback, ctx);
+        cross_(&join, tree_a->root, tree_b->root);
+}
+
+/* parallel */
+
+static int
+push_task_(join_task_t **tasks, size_t *length, size_t *capacity, quadtree_node_t *a, quadtree_node_t *b) {
+        join_task_t *grown;
+        if (*length == *capacity) {
+                *capacity = *capacity ? *capacity * 2 : 64;
+                if (!(grown = realloc(*tasks, *capacity * sizeof(**tasks))))
+                        return 0;
+                *tasks = grown;
+        }
+        (*tasks)[*length].a = a;
+        (*tasks)[*length].b = b;
+        (*length)++;
+        return 1;
+}
+
+/*
+ * Break the root pair into independent subtree pairs, one level per round,
+ * until there are enough to keep every thread busy.
+ */
+static join_task_t *
+plan_tasks_(join_ctx_t *join, quadtree_node_t *root, size_t want, size_t *length) {
+        join_task_t *tasks = NULL;
+        join_task_t *next;
+        size_t capacity = 0, next_length, next_capacity, i;
+        int expanded = 1, ok = 1;
+
+        *length = 0;
+        if (!push_task_(&tasks, length, &capacity, root, root))
+                return NULL;
+
+        while (ok && expanded && *length < want) {
+                next = NULL;
+                next_length = next_capacity = 0;
+                expanded = 0;
+                for (i = 0; ok && i < *length; i++) {
+                        quadtree_node_t *a = tasks[i].a;
+                        quadtree_node_t *b = tasks[i].b;
+                        if (a == b && quadtree_node_ispointer(a)) {
+                                quadtree_node_t *quads[4] = {a->nw, a->ne, a->sw, a->se};
+                                int j, k;
+                                for (j = 0; j < 4; j++) {
+                                        ok = ok && push_task_(&next, &next_length, &next_capacity, quads[j], quads[j]);
+                                        for (k = j + 1; k < 4; k++)
+                                                ok = ok && push_task_(&next, &next_length, &next_capacity, quads[j],
+                                                                      quads[k]);
+                                }
+                                expanded = 1;
+                        } else if (a != b && !quadtree_node_isempty(a) && !quadtree_node_isempty(b) &&
+                                   bounds_dist2_(a->bounds, b->bounds) <= join->d2 &&
+                                   (quadtree_node_ispointer(a) || quadtree_node_ispointer(b))) {
+                                if (!split_first_(a, b)) {
+                                        a = tasks[i].b;
+                                        b = tasks[i].a;
+                                }
+                                ok = ok && push_task_(&next, &next_length, &next_capacity, a->nw, b);
+                                ok = ok && push_task_(&next, &next_length, &next_capacity, a->ne, b);
+                                ok = ok && push_task_(&next, &next_length, &next_capacity, a->sw, b);
+                                ok = ok && push_task_(&next, &next_length, &next_capacity, a->se, b);
+                                expanded = 1;
+                        } else {
+                                ok = ok && push_task_(&next, &next_length, &next_capacity, a, b);
+                        }
+                }
+                free(tasks);
+                tasks = next;
+                *length = next_length;
+        }
+        if (!ok) {
+                free(tasks);
+                return NULL;
+        }
+        return tasks;
+}
+
+static void *
+worker_(void *arg) {
+        join_pool_t *pool = arg;
+        join_task_t *task;
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                task = pool->next < pool->length ? &pool->tasks[pool->next++] : NULL;
+                pthread_mutex_unlock(&pool->lock);
+                if (task == NULL)
+                        return NULL;
+                if (task->a == task->b)
+                        self_(pool->join, task->a);
+                else
+                        cross_(pool->join, task->a, task->b);
+        }
+}
+
+/*
+ * Same as quadtree_self_join, spread over threads. The callback is called
+ * concurrently and must be thread safe. Returns 0, or -1 if the threads or
+ * task list could not be set up (no pair has been reported then).
+ */
+int
+quadtree_self_join_parallel(quadtree_t *tree, double d,
+                            void (*callback)(quadtree_node_t *a, quadtree_node_t *b, void *ctx), void *ctx,
+                            unsigned int threads) {
+        join_ctx_t join;
+        join_pool_t pool;
+        pthread_t *ids;
+        unsigned int i, started = 0;
+
+        join_init_(&join, d, NULL, callback, ctx);
+
+        if (threads < 2) {
+                self_(&join, tree->root);
+                return 0;
+        }
+
+        pool.join = &join;
+        pool.next = 0;
+        if (!(pool.tasks = plan_tasks_(&join, tree->root, (size_t)threads * 8, &pool.length)))
+                return -1;
+        if (!(ids = malloc(sizeof(*ids) * threads))) {
+                free(pool.tasks);
+                return -1;
+        }
+        pthread_mutex_init(&pool.lock, NULL);
+
+        for (i = 0; i < threads; i++) {
+                if (pthread_create(&ids[i], NULL, worker_, &pool) != 0)
+                        break;
+                started++;
+        }
+        /* Whatever could not be handed to a thread runs here. */
+        worker_(&pool);
+        for (i = 0; i < started; i++)
+                pthread_join(ids[i], NULL);
+
+        pthread_mutex_destroy(&pool.lock);
+        free(ids);
+        free(pool.tasks);
+        return 0;
+}
@@ -1,4 +1,5 @@
 #include "quadtree.h"
+#include "ext.h"
 
 /* helpers */
 
@@ -38,15 +39,39 @@ quadtree_node_isleaf(quadtree_node_t* node) {
 
 void
 quadtree_node_reset(quadtree_node_t* node, void (*key_free)(void*)) {
-        quadtree_point_free(node->point);
+        quadtree_point_release(node_allocator_(node), node->point);
         (*key_free)(node->key);
 }
 
 /* api */
 quadtree_node_t*
 quadtree_node_new() {
-        quadtree_node_t* node = malloc(sizeof(quadtree_node_t));
-        // quadtree_node_t *node = rte_malloc("node", sizeof(quadtree_node_t), 0);
+        return quadtree_node_alloc(&quadtree_malloc_allocator);
+}
+
+static void
+ext_init_(quadtree_node_ext_t* ext, const quadtree_allocator_t* allocator) {
+        ext->allocator = allocator;
+        ext->agg = 0;
+        ext->time = 0;
+        ext->tmin = HUGE_VAL;
+        ext->tmax = -HUGE_VAL;
+        ext->overflow = NULL;
+        ext->objects = NULL;
+        ext->id = 0;
+}
+
+/* Nodes from any allocator but malloc need the ext block to remember it. */
+quadtree_node_t*
+quadtree_node_alloc(const quadtree_allocator_t* allocator) {
+        return quadtree_node_alloc_ext(allocator, allocator != &quadtree_malloc_allocator);
+}
+
+/* With ext set the block comes in the same allocation, right after the node. */
+quadtree_node_t*
+quadtree_node_alloc_ext(const quadtree_allocator_t* allocator, int ext) {
+        size_t size = sizeof(quadtree_node_t) + (ext ? sizeof(quadtree_node_ext_t) : 0);
+        quadtree_node_t* node = quadtree_alloc(allocator, size);
         if (node == NULL) {
                 return NULL;
         }
@@ -61,28 +86,110 @@ quadtree_node_new() {
         node->key = NULL;
         node->children_cnt = 0;
         node->weight = 0;
+        node->weight_dirty = 0;
+        node->ext = NULL;
+        if (ext) {
+                node->ext = (quadtree_node_ext_t*)(node + 1);
+                ext_init_(node->ext, allocator);
+        }
         return node;
 }
 
+/*
+ * Gives a plain node its ext block, allocated on its own. A plain node came
+ * from malloc, so the block does too. Returns 0 when out of memory.
+ */
+int
+quadtree_node_extend(quadtree_node_t* node) {
+        quadtree_node_ext_t* ext;
+        if (node->ext != NULL)
+                return 1;
+        if (!(ext = quadtree_alloc(&quadtree_malloc_allocator, sizeof(*ext))))
+                return 0;
+        ext_init_(ext, &quadtree_malloc_allocator);
+        node->ext = ext;
+        return 1;
+}
+
+/* Frees the node struct and its ext block, not what they point to. */
+void
+quadtree_node_release(quadtree_node_t* node) {
+        quadtree_node_ext_t* ext = node->ext;
+        if (ext == NULL) {
+                quadtree_release(&quadtree_malloc_allocator, node, sizeof(*node));
+        } else if (ext == (quadtree_node_ext_t*)(node + 1)) {
+                quadtree_release(ext->allocator, node, sizeof(*node) + sizeof(*ext));
+        } else {
+                const quadtree_allocator_t* allocator = ext->allocator;
+                quadtree_release(allocator, ext, sizeof(*ext));
+                quadtree_release(allocator, node, sizeof(*node));
+        }
+}
+
+/* The next entry in a leaf's overflow chain, NULL at its end. */
+quadtree_node_t*
+quadtree_node_next(quadtree_node_t* node) {
+        return next_entry_(node);
+}
+
+/* The point's timestamp, 0 for points inserted without one. */
+double
+quadtree_node_time(quadtree_node_t* node) {
+        return node_time_(node);
+}
+
 quadtree_node_t*
 quadtree_node_with_bounds(double minx, double miny, double maxx, double maxy) {
+        return quadtree_node_alloc_with_bounds(&quadtree_malloc_allocator, minx, miny, maxx, maxy);
+}
+
+quadtree_node_t*
+quadtree_node_alloc_with_bounds(const quadtree_allocator_t* allocator, double minx, double miny, double maxx,
+                                double maxy) {
         quadtree_node_t* node;
-        if (!(node = quadtree_node_new()))
+        if (!(node = quadtree_node_alloc(allocator)))
                 return NULL;
-        /*
-        if(!(node->bounds = quadtree_bounds_new())) return NULL;
-        quadtree_bounds_extend(node->bounds, maxx, maxy);
-        quadtree_bounds_extend(node->bounds, minx, miny);
-        */
-        quadtree_bounds_t* bounds = quadtree_bounds_new_with_points(minx, miny, maxx, maxy);
-        if (bounds == NULL)
+        quadtree_bounds_t* bounds = quadtree_bounds_alloc(allocator, minx, miny, maxx, maxy);
+        if (bounds == NULL) {
+                quadtree_node_release(node);
+                return NULL;
+        }
+        node->bounds = bounds;
+        return node;
+}
+
+/* A cell from the same allocator as like, with an ext block if like has one. */
+quadtree_node_t*
+quadtree_node_alloc_like(quadtree_node_t* like, double minx, double miny, double maxx, double maxy) {
+        const quadtree_allocator_t* allocator = node_allocator_(like);
+        quadtree_node_t* node;
+        if (!(node = quadtree_node_alloc_ext(allocator, like->ext != NULL)))
+                return NULL;
+        quadtree_bounds_t* bounds = quadtree_bounds_alloc(allocator, minx, miny, maxx, maxy);
+        if (bounds == NULL) {
+                quadtree_node_release(node);
                 return NULL;
+        }
         node->bounds = bounds;
         return node;
 }
 
 void
 quadtree_node_free(quadtree_node_t* node, void (*key_free)(void*)) {
+        quadtree_node_t* entry;
+        quadtree_object_t* object;
+        if (node->ext != NULL) {
+                while ((object = node->ext->objects) != NULL) {
+                        node->ext->objects = object->next;
+                        (*key_free)(object->key);
+                        quadtree_release(node->ext->allocator, object, sizeof(*object));
+                }
+                while ((entry = node->ext->overflow) != NULL) {
+                        node->ext->overflow = entry->ext->overflow;
+                        quadtree_node_reset(entry, key_free);
+                        quadtree_node_release(entry);
+                }
+        }
         if (node->nw != NULL)
                 quadtree_node_free(node->nw, key_free);
         if (node->ne != NULL)
@@ -92,8 +199,7 @@ quadtree_node_free(quadtree_node_t* node, void (*key_free)(void*)) {
         if (node->se != NULL)
                 quadtree_node_free(node->se, key_free);
 
-        quadtree_bounds_free(node->bounds);
+        quadtree_bounds_release(node_allocator_(node), node->bounds);
         quadtree_node_reset(node, key_free);
-        // rte_free(node);
-        free(node);
+        quadtree_node_release(node);
 }
@@ -2,9 +2,13 @@
 
 quadtree_point_t*
 quadtree_point_new(double x, double y) {
+        return quadtree_point_alloc(&quadtree_malloc_allocator, x, y);
+}
+
+quadtree_point_t*
+quadtree_point_alloc(const quadtree_allocator_t* allocator, double x, double y) {
         quadtree_point_t* point;
-        if (!(point = malloc(sizeof(*point))))
-                // if(!(point = rte_malloc("point", sizeof(*point), 0)))
+        if (!(point = quadtree_alloc(allocator, sizeof(*point))))
                 return NULL;
         point->x = x;
         point->y = y;
@@ -13,6 +17,10 @@ quadtree_point_new(double x, double y) {
 
 void
 quadtree_point_free(quadtree_point_t* point) {
-        free(point);
-        // rte_free(point);
+        quadtree_point_release(&quadtree_malloc_allocator, point);
+}
+
+void
+quadtree_point_release(const quadtree_allocator_t* allocator, quadtree_point_t* point) {
+        quadtree_release(allocator, point, sizeof(*point));
 }
@@ -1,13 +1,20 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include "quadtree.h"
+#include "ext.h"
+#include "grid.h"
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 /* private prototypes */
 static int
 split_node_(quadtree_t *tree, quadtree_node_t *node, quadtree_node_t **fill_this_in);
 
 static int
-insert_(quadtree_t *tree, quadtree_node_t *root, quadtree_point_t *point, void *key, quadtree_node_t **node_p);
+insert_(quadtree_t *tree, quadtree_node_t *root, quadtree_point_t *point, double time, void *key,
+        quadtree_node_t **node_p);
 
 static int
 node_contains_(quadtree_node_t *outer, quadtree_point_t *it);
@@ -27,6 +34,32 @@ bounds_contains_point_(quadtree_bounds_t *bounds, quadtree_point_t *point);
 static void
 condense_parent(quadtree_t *tree, quadtree_node_t *parent);
 
+static quadtree_node_t *
+lift_(quadtree_t *tree, quadtree_node_t *node);
+
+static void
+add_weight_(quadtree_t *tree, quadtree_node_t *node, int delta, double value);
+
+static unsigned int
+sync_weight_(quadtree_t *tree, quadtree_node_t *node);
+
+static void
+sink_objects_(quadtree_t *tree, quadtree_node_t *node);
+
+#ifdef QUADTREE_TRACE
+#define TRACE_(event, tree, node, count) quadtree_trace_emit((event), node_depth_((tree), (node)), (count))
+#else
+#define TRACE_(event, tree, node, count) ((void)0)
+#endif
+
+#if defined(__GNUC__)
+#define PREFETCH_(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH_(addr) ((void)(addr))
+#endif
+
+static unsigned int prefetch_distance_ = QUADTREE_PREFETCH_DISTANCE;
+
 void
 descent_(quadtree_node_t *node) {
         if (node->bounds != NULL)
@@ -48,6 +81,13 @@ node_contains_(quadtree_node_t *outer, quadtree_point_t *it) {
                outer->bounds->se->x >= it->x && outer->bounds->se->y <= it->y;
 }
 
+/* Inside and off the edges, where no sibling can also claim the point. */
+static inline int
+node_strictly_contains_(quadtree_node_t *outer, quadtree_point_t *it) {
+        return outer->bounds != NULL && outer->bounds->nw->x < it->x && outer->bounds->nw->y > it->y &&
+               outer->bounds->se->x > it->x && outer->bounds->se->y < it->y;
+}
+
 /* private implementations */
 static inline int
 bounds_contains_bounds_(quadtree_bounds_t *inside, quadtree_bounds_t *outside) {
@@ -67,6 +107,17 @@ bounds_contains_point_(quadtree_bounds_t *bounds, quadtree_point_t *point) {
                bounds->se->x >= point->x && bounds->se->y <= point->y;
 }
 
+/*
+ * Every level halves the cell exactly, so the depth is how many binary
+ * exponents the cell's width sits below the root's. No walk up the parents.
+ */
+static inline unsigned int
+node_depth_(quadtree_t *tree, quadtree_node_t *node) {
+        if (node->bounds == NULL)
+                node = node->parent;
+        return (unsigned int)(ilogb(tree->root->bounds->width) - ilogb(node->bounds->width));
+}
+
 static void
 elision_(void *key) {
 }
@@ -93,11 +144,313 @@ get_quadrant_(quadtree_node_t *root, quadtree_point_t *point) {
         return NULL;
 }
 
+/* The id and timestamp travel with the point. */
 static inline void
 swap_points(quadtree_node_t *node, quadtree_node_t *new_node) {
         quadtree_point_t *tmp = node->point;
+        void *key = node->key;
         node->point = new_node->point;
+        node->key = new_node->key;
         new_node->point = tmp;
+        new_node->key = key;
+        if (node->ext != NULL) {
+                unsigned int id = node->ext->id;
+                double time = node->ext->time;
+                node->ext->id = new_node->ext->id;
+                node->ext->time = new_node->ext->time;
+                new_node->ext->id = id;
+                new_node->ext->time = time;
+        }
+}
+
+static inline void
+bind_id_(quadtree_t *tree, quadtree_node_t *node) {
+        if (node_id_(node) != 0)
+                tree->ids.nodes[node->ext->id - 1] = node;
+}
+
+/* Gives node and everything below it an ext block, children first. */
+static int
+extend_node_(quadtree_node_t *node) {
+        if (node->ext != NULL)
+                return 1;
+        if (quadtree_node_ispointer(node) && !(extend_node_(node->nw) && extend_node_(node->ne) &&
+                                               extend_node_(node->sw) && extend_node_(node->se)))
+                return 0;
+        if (!quadtree_node_extend(node))
+                return 0;
+        if (!quadtree_node_isempty(node))
+                node->ext->tmin = node->ext->tmax = 0;
+        return 1;
+}
+
+/*
+ * A tree stays plain until it first needs a bucket, a timestamp, an id or a
+ * box, then every node gets its ext block in one pass. New nodes take after
+ * the node they come from. The root goes last, so a pass cut short by
+ * running out of memory is picked up again next time. Returns 0 then.
+ */
+static int
+extend_(quadtree_t *tree) {
+        return tree->root->ext != NULL || extend_node_(tree->root);
+}
+
+/* Make room for one more id so that taking it cannot fail. */
+static int
+reserve_id_(quadtree_t *tree) {
+        quadtree_id_table_t *ids = &tree->ids;
+        quadtree_node_t **nodes;
+        unsigned int *free_ids;
+        unsigned int capacity;
+
+        if (!extend_(tree))
+                return 0;
+        if (ids->free_length > 0 || ids->length < ids->capacity)
+                return 1;
+        capacity = ids->capacity ? ids->capacity * 2 : 64;
+        /* The allocator has no realloc, so both columns move together. */
+        if (!(nodes = quadtree_alloc(tree->allocator, sizeof(*nodes) * capacity)))
+                return 0;
+        if (!(free_ids = quadtree_alloc(tree->allocator, sizeof(*free_ids) * capacity))) {
+                quadtree_release(tree->allocator, nodes, sizeof(*nodes) * capacity);
+                return 0;
+        }
+        if (ids->capacity > 0) {
+                memcpy(nodes, ids->nodes, sizeof(*nodes) * ids->capacity);
+                memcpy(free_ids, ids->free, sizeof(*free_ids) * ids->capacity);
+        }
+        quadtree_release(tree->allocator, ids->nodes, sizeof(*nodes) * ids->capacity);
+        quadtree_release(tree->allocator, ids->free, sizeof(*free_ids) * ids->capacity);
+        ids->nodes = nodes;
+        ids->free = free_ids;
+        ids->capacity = capacity;
+        return 1;
+}
+
+static unsigned int
+take_id_(quadtree_t *tree, quadtree_node_t *node) {
+        quadtree_id_table_t *ids = &tree->ids;
+        node->ext->id = ids->free_length > 0 ? ids->free[--ids->free_length] : ++ids->length;
+        bind_id_(tree, node);
+        return node->ext->id;
+}
+
+static void
+release_id_(quadtree_t *tree, unsigned int id) {
+        if (id == 0)
+                return;
+        tree->ids.nodes[id - 1] = NULL;
+        tree->ids.free[tree->ids.free_length++] = id;
+}
+
+/* Points leaving the tree with a subtree lose their ids. */
+static void
+release_subtree_ids_(quadtree_t *tree, quadtree_node_t *node) {
+        quadtree_node_t *entry;
+        for (entry = node; entry != NULL; entry = next_entry_(entry)) {
+                release_id_(tree, node_id_(entry));
+                set_id_(entry, 0);
+        }
+        if (quadtree_node_ispointer(node)) {
+                release_subtree_ids_(tree, node->nw);
+                release_subtree_ids_(tree, node->ne);
+                release_subtree_ids_(tree, node->sw);
+                release_subtree_ids_(tree, node->se);
+        }
+}
+
+static void
+set_child_(quadtree_t *tree, quadtree_node_t *parent, coordinate_t coord, quadtree_node_t *child) {
+        if (parent == NULL) {
+                tree->root = child;
+                return;
+        }
+        switch (coord) {
+                case NW:
+                        parent->nw = child;
+                        break;
+                case NE:
+                        parent->ne = child;
+                        break;
+                case SW:
+                        parent->sw = child;
+                        break;
+                case SE:
+                        parent->se = child;
+                        break;
+                default:
+                        printf("Whose demon node is this?\n");
+                        assert(0);
+        }
+}
+
+static inline quadtree_node_t *
+get_child_(quadtree_node_t *parent, coordinate_t coord) {
+        switch (coord) {
+                case NW:
+                        return parent->nw;
+                case NE:
+                        return parent->ne;
+                case SW:
+                        return parent->sw;
+                case SE:
+                        return parent->se;
+                default:
+                        return NULL;
+        }
+}
+
+/* Overflow entries have no bounds of their own, they live in their leaf's cell. */
+static inline quadtree_node_t *
+leaf_cell_(quadtree_node_t *node) {
+        return node->bounds != NULL ? node : node->parent;
+}
+
+/* A leaf stops splitting once it is at the depth limit, under the minimum
+ * cell size, or so small that halving it no longer changes the doubles. */
+static int
+leaf_at_limit_(quadtree_t *tree, quadtree_node_t *node) {
+        double hw = node->bounds->width / 2;
+        double hh = node->bounds->height / 2;
+        if (node->bounds->nw->x + hw == node->bounds->nw->x || node->bounds->nw->y - hh == node->bounds->nw->y)
+                return 1;
+        if (tree->min_cell_size > 0 && (hw < tree->min_cell_size || hh < tree->min_cell_size))
+                return 1;
+        return tree->max_depth > 0 && node_depth_(tree, node) >= tree->max_depth;
+}
+
+/*
+ * Finger search start: climb from hint to the first cell that a descent from
+ * the root would also pass through on its way to point. Bounds are closed,
+ * so a point on a cell's edge may belong to a sibling and the climb goes on
+ * until point is strictly inside, or up to the root.
+ */
+static quadtree_node_t *
+climb_(quadtree_t *tree, quadtree_node_t *hint, quadtree_point_t *point) {
+        if (hint == NULL)
+                return tree->root;
+        hint = leaf_cell_(hint);
+        while (hint->parent != NULL && !node_strictly_contains_(hint, point))
+                hint = hint->parent;
+        return hint;
+}
+
+static quadtree_node_t *
+find_entry_(quadtree_node_t *leaf, double x, double y) {
+        for (; leaf != NULL; leaf = next_entry_(leaf)) {
+                if (leaf->point->x == x && leaf->point->y == y)
+                        return leaf;
+        }
+        return NULL;
+}
+
+/* Number of points stored at or below node. */
+static inline unsigned int
+node_count_(quadtree_node_t *node) {
+        if (quadtree_node_ispointer(node))
+                return node->weight;
+        return quadtree_node_isleaf(node) ? 1 + node->weight : 0;
+}
+
+static inline double
+node_aggregate_(quadtree_t *tree, quadtree_node_t *node) {
+        return node_count_(node) > 0 ? node->ext->agg : tree->aggregate->identity;
+}
+
+/* Aggregate of a leaf's chain, or of a pointer's quadrants. */
+static double
+recompute_aggregate_(quadtree_t *tree, quadtree_node_t *node) {
+        const quadtree_aggregate_t *aggregate = tree->aggregate;
+        double agg = aggregate->identity;
+        quadtree_node_t *entry;
+
+        if (quadtree_node_ispointer(node)) {
+                agg = aggregate->combine(agg, node_aggregate_(tree, node->nw));
+                agg = aggregate->combine(agg, node_aggregate_(tree, node->ne));
+                agg = aggregate->combine(agg, node_aggregate_(tree, node->sw));
+                agg = aggregate->combine(agg, node_aggregate_(tree, node->se));
+        } else if (quadtree_node_isleaf(node)) {
+                for (entry = node; entry != NULL; entry = next_entry_(entry))
+                        agg = aggregate->combine(agg, aggregate->init(entry));
+        }
+        return agg;
+}
+
+/* node gained (delta > 0) or lost points whose aggregate is value. */
+static void
+apply_aggregate_(quadtree_t *tree, quadtree_node_t *node, int delta, double value) {
+        const quadtree_aggregate_t *aggregate = tree->aggregate;
+        quadtree_node_ext_t *ext = node->ext;
+        if (aggregate == NULL)
+                return;
+        if (delta > 0)
+                ext->agg = node_count_(node) == (unsigned int)delta ? value : aggregate->combine(ext->agg, value);
+        else if (node_count_(node) == 0)
+                ext->agg = aggregate->identity;
+        else if (aggregate->inverse != NULL)
+                ext->agg = aggregate->inverse(ext->agg, value);
+        else
+                ext->agg = recompute_aggregate_(tree, node);
+}
+
+static inline double
+point_value_(quadtree_t *tree, quadtree_node_t *node) {
+        return tree->aggregate != NULL ? tree->aggregate->init(node) : 0;
+}
+
+/* Chains only exist in an extended tree, see extend_. */
+static int
+push_overflow_(quadtree_node_t *leaf, quadtree_point_t *point, double time, void *key, quadtree_node_t **node_p) {
+        quadtree_node_t *entry;
+        if (!(entry = quadtree_node_alloc_ext(leaf->ext->allocator, 1)))
+                return 0;
+        entry->parent = leaf;
+        entry->point = point;
+        entry->ext->time = time;
+        entry->key = key;
+        entry->ext->overflow = leaf->ext->overflow;
+        leaf->ext->overflow = entry;
+        if (node_p != NULL)
+                *node_p = entry;
+        return 1;
+}
+
+static void
+unlink_overflow_(quadtree_node_t *entry) {
+        quadtree_node_t **it = &entry->parent->ext->overflow;
+        while (*it != entry)
+                it = &(*it)->ext->overflow;
+        *it = entry->ext->overflow;
+        entry->ext->overflow = NULL;
+}
+
+/* Hand the leaf's cell to its first overflow entry so that the leaf itself can
+ * be freed. Entries keep their identity. */
+static quadtree_node_t *
+promote_overflow_(quadtree_t *tree, quadtree_node_t *leaf) {
+        quadtree_node_t *entry = next_entry_(leaf);
+        quadtree_node_t *it;
+        quadtree_object_t *object;
+
+        entry->bounds = leaf->bounds;
+        entry->coord = leaf->coord;
+        entry->parent = leaf->parent;
+        entry->children_cnt = leaf->children_cnt;
+        entry->weight = leaf->weight - 1;
+        entry->ext->tmin = leaf->ext->tmin;
+        entry->ext->tmax = leaf->ext->tmax;
+        entry->ext->objects = leaf->ext->objects;
+        for (it = entry->ext->overflow; it != NULL; it = it->ext->overflow)
+                it->parent = entry;
+        for (object = entry->ext->objects; object != NULL; object = object->next)
+                object->node = entry;
+        set_child_(tree, leaf->parent, leaf->coord, entry);
+
+        leaf->bounds = NULL;
+        leaf->parent = NULL;
+        leaf->ext->overflow = NULL;
+        leaf->ext->objects = NULL;
+        return entry;
 }
 
 static inline void
@@ -189,6 +542,23 @@ swap_children_count(quadtree_node_t *node, quadtree_node_t *new_node) {
         tmp = node->weight;
         node->weight = new_node->weight;
         new_node->weight = tmp;
+
+        int dirty = node->weight_dirty;
+        node->weight_dirty = new_node->weight_dirty;
+        new_node->weight_dirty = dirty;
+
+        if (node->ext == NULL)
+                return;
+        double agg = node->ext->agg;
+        node->ext->agg = new_node->ext->agg;
+        new_node->ext->agg = agg;
+
+        double t = node->ext->tmin;
+        node->ext->tmin = new_node->ext->tmin;
+        new_node->ext->tmin = t;
+        t = node->ext->tmax;
+        node->ext->tmax = new_node->ext->tmax;
+        new_node->ext->tmax = t;
 }
 
 static inline void
@@ -209,8 +579,25 @@ swap_children(quadtree_node_t *node, quadtree_node_t *new_node) {
         new_node->se = se;
 }
 
+/* Boxes belong to the cell, not the struct. */
+static inline void
+swap_objects(quadtree_node_t *node, quadtree_node_t *new_node) {
+        quadtree_object_t *tmp, *it;
+        if (node->ext == NULL)
+                return;
+        tmp = node->ext->objects;
+        node->ext->objects = new_node->ext->objects;
+        new_node->ext->objects = tmp;
+        for (it = node->ext->objects; it != NULL; it = it->next)
+                it->node = node;
+        for (it = new_node->ext->objects; it != NULL; it = it->next)
+                it->node = new_node;
+}
+
 static void
 swap_node_details(quadtree_t *tree, quadtree_node_t *node, quadtree_node_t *new_node) {
+        TRACE_(QUADTREE_TRACE_SWAP, tree, node, 1);
+
         /* swap parents first */
         swap_parents(tree, node, new_node);
 
@@ -219,16 +606,16 @@ swap_node_details(quadtree_t *tree, quadtree_node_t *node, quadtree_node_t *new_
         swap_bounds(node, new_node);
         swap_children(node, new_node);
         swap_children_count(node, new_node);
+        swap_objects(node, new_node);
+        bind_id_(tree, node);
+        bind_id_(tree, new_node);
 }
 
+/* Give node four empty quadrants. */
 static int
-split_node_(quadtree_t *tree, quadtree_node_t *node, quadtree_node_t **fill_this_in) {
-        quadtree_node_t *nw;
-        quadtree_node_t *ne;
-        quadtree_node_t *sw;
-        quadtree_node_t *se;
-        quadtree_point_t *old;
-        void *key;
+subdivide_(quadtree_node_t *node) {
+        quadtree_node_t *quads[4];
+        int i, failed = 0;
 
         double x = node->bounds->nw->x;
         double y = node->bounds->nw->y;
@@ -236,41 +623,57 @@ split_node_(quadtree_t *tree, quadtree_node_t *node, quadtree_node_t **fill_this
         double hh = node->bounds->height / 2;
 
         // minx,   miny,       maxx,       maxy
-        if (!(nw = quadtree_node_with_bounds(x, y - hh, x + hw, y)))
-                return 0;
-        if (!(ne = quadtree_node_with_bounds(x + hw, y - hh, x + hw * 2, y)))
-                return 0;
-        if (!(sw = quadtree_node_with_bounds(x, y - hh * 2, x + hw, y - hh)))
-                return 0;
-        if (!(se = quadtree_node_with_bounds(x + hw, y - hh * 2, x + hw * 2, y - hh)))
+        quads[NW] = quadtree_node_alloc_like(node, x, y - hh, x + hw, y);
+        quads[NE] = quadtree_node_alloc_like(node, x + hw, y - hh, x + hw * 2, y);
+        quads[SW] = quadtree_node_alloc_like(node, x, y - hh * 2, x + hw, y - hh);
+        quads[SE] = quadtree_node_alloc_like(node, x + hw, y - hh * 2, x + hw * 2, y - hh);
+        for (i = 0; i < 4; i++)
+                failed |= quads[i] == NULL;
+        if (failed) {
+                for (i = 0; i < 4; i++) {
+                        if (quads[i] != NULL)
+                                quadtree_node_free(quads[i], elision_);
+                }
                 return 0;
+        }
 
-        nw->coord = NW;
-        nw->parent = node;
-        node->nw = nw;
+        for (i = 0; i < 4; i++) {
+                quads[i]->coord = (coordinate_t)i;
+                quads[i]->parent = node;
+        }
+        node->nw = quads[NW];
+        node->ne = quads[NE];
+        node->sw = quads[SW];
+        node->se = quads[SE];
+        return 1;
+}
 
-        ne->coord = NE;
-        ne->parent = node;
-        node->ne = ne;
+static int
+split_node_(quadtree_t *tree, quadtree_node_t *node, quadtree_node_t **fill_this_in) {
+        quadtree_point_t *old;
+        void *key;
+        unsigned int id;
+        double time;
 
-        sw->coord = SW;
-        sw->parent = node;
-        node->sw = sw;
+        if (!subdivide_(node))
+                return 0;
 
-        se->coord = SE;
-        se->parent = node;
-        node->se = se;
+        TRACE_(QUADTREE_TRACE_SPLIT, tree, node, 4);
 
         old = node->point;
         key = node->key;
+        id = node_id_(node);
+        time = node_time_(node);
         node->weight = 1;
         node->point = NULL;
         node->key = NULL;
+        set_id_(node, 0);
 
         quadtree_node_t *new_node = NULL;
-        int ret = insert_(tree, node, old, key, &new_node);
+        int ret = insert_(tree, node, old, time, key, &new_node);
         if (ret > 0) {
                 assert(new_node != NULL);
+                set_id_(new_node, id);
                 swap_node_details(tree, node, new_node);
                 *fill_this_in = new_node;
         }
@@ -284,7 +687,7 @@ find_(quadtree_node_t *node, double x, double y) {
                 return NULL;
         }
         if (quadtree_node_isleaf(node)) {
-                if (node->point->x == x && node->point->y == y)
+                if ((node = find_entry_(node, x, y)) != NULL)
                         return node->point;
         } else if (quadtree_node_ispointer(node)) {
                 quadtree_point_t test;
@@ -302,8 +705,7 @@ find_node_from_point_(quadtree_node_t *node, double x, double y) {
                 return NULL;
         }
         if (quadtree_node_isleaf(node)) {
-                if (node->point->x == x && node->point->y == y)
-                        return node;
+                return find_entry_(node, x, y);
         } else if (quadtree_node_ispointer(node)) {
                 quadtree_point_t test;
                 test.x = x;
@@ -314,13 +716,51 @@ find_node_from_point_(quadtree_node_t *node, double x, double y) {
         return NULL;
 }
 
+/*
+ * Range traversals visit nw, ne, sw, se depth first, so each child is a
+ * pointer chase that misses once the tree is bigger than the cache. Before
+ * descending, fetch the nodes levels below: the levels in between were
+ * requested by earlier visits and are read from cache, along with the
+ * bounds the next visits test first.
+ */
+static void
+prefetch_below_(quadtree_node_t *node, unsigned int levels) {
+        quadtree_node_t *quads[4] = {node->nw, node->ne, node->sw, node->se};
+        int i;
+
+        for (i = 0; i < 4; i++) {
+                if (levels == 1) {
+                        PREFETCH_(quads[i]);
+                } else {
+                        PREFETCH_(quads[i]->bounds);
+                        if (quads[i]->nw != NULL)
+                                prefetch_below_(quads[i], levels - 1);
+                }
+        }
+}
+
+static inline void
+prefetch_children_(quadtree_node_t *node) {
+        if (prefetch_distance_ > 0 && node->nw != NULL)
+                prefetch_below_(node, prefetch_distance_);
+}
+
+static void
+add_leaf_(quadtree_node_t *leaf, quadtree_bounds_t *box, quadtree_node_list_t **result) {
+        for (; leaf != NULL; leaf = next_entry_(leaf)) {
+                if (box == NULL || bounds_contains_point_(box, leaf->point))
+                        quadtree_node_list_add(result, leaf);
+        }
+}
+
 static void
 extract_all_(quadtree_node_t *root, quadtree_node_list_t **result) {
         if (root == NULL) {
                 return;
         } else if (quadtree_node_isleaf(root)) {
-                quadtree_node_list_add(result, root);
+                add_leaf_(root, NULL, result);
         } else {
+                prefetch_children_(root);
                 extract_all_(root->nw, result);
                 extract_all_(root->ne, result);
                 extract_all_(root->sw, result);
@@ -333,9 +773,9 @@ extract_all_within_bounds_(quadtree_node_t *root, quadtree_bounds_t *box, quadtr
         if (root == NULL) {
                 return;
         } else if (quadtree_node_isleaf(root)) {
-                if (bounds_contains_point_(box, root->point))
-                        quadtree_node_list_add(result, root);
+                add_leaf_(root, box, result);
         } else {
+                prefetch_children_(root);
                 extract_all_within_bounds_(root->nw, box, result);
                 extract_all_within_bounds_(root->ne, box, result);
                 extract_all_within_bounds_(root->sw, box, result);
@@ -347,8 +787,8 @@ static void
 eval_quad_(quadtree_node_t *root, quadtree_bounds_t *box, quadtree_node_list_t **result) {
         if (bounds_contains_bounds_(root->bounds, box)) {
                 extract_all_(root, result);
-        } else if (bounds_contains_point_(box, root->point)) {
-                search_bounds_(root, box, result);
+        } else if (quadtree_node_isleaf(root)) {
+                add_leaf_(root, box, result);
         }
 }
 
@@ -363,6 +803,7 @@ eval_quad_partial_(quadtree_node_t *root, quadtree_bounds_t *box, quadtree_node_
                 /* If overlapping a part of it explore child quads */
         } else if (bounds_overlap_bounds_(root->bounds, box)) {
                 if (quadtree_node_ispointer(root)) {
+                        prefetch_children_(root);
                         eval_quad_partial_(root->nw, box, result);
                         eval_quad_partial_(root->ne, box, result);
                         eval_quad_partial_(root->sw, box, result);
@@ -371,8 +812,8 @@ eval_quad_partial_(quadtree_node_t *root, quadtree_bounds_t *box, quadtree_node_
                         extract_all_within_bounds_(root, box, result);
                 }
                 /* If its a leaf */
-        } else if (quadtree_node_isleaf(root) && bounds_contains_point_(box, root->point)) {
-                quadtree_node_list_add(result, root);
+        } else if (quadtree_node_isleaf(root)) {
+                add_leaf_(root, box, result);
         }
 }
 
@@ -382,9 +823,7 @@ search_bounds_(quadtree_node_t *root, quadtree_bounds_t *box, quadtree_node_list
                 return;
         }
         if (quadtree_node_isleaf(root)) {
-                if (bounds_contains_point_(box, root->point)) {
-                        quadtree_node_list_add(result, root);
-                }
+                add_leaf_(root, box, result);
         } else if (quadtree_node_ispointer(root)) {
                 /* recursion occurs within eval_quad() */
                 eval_quad_(root->nw, box, result);
@@ -400,11 +839,10 @@ search_bounds_include_partial_(quadtree_node_t *root, quadtree_bounds_t *box, qu
                 return;
         }
         if (quadtree_node_isleaf(root)) {
-                if (bounds_contains_point_(box, root->point)) {
-                        quadtree_node_list_add(result, root);
-                }
+                add_leaf_(root, box, result);
         } else if (quadtree_node_ispointer(root)) {
                 /* recursion occurs within eval_quad() */
+                prefetch_children_(root);
                 eval_quad_partial_(root->nw, box, result);
                 eval_quad_partial_(root->ne, box, result);
                 eval_quad_partial_(root->sw, box, result);
@@ -412,6 +850,86 @@ search_bounds_include_partial_(quadtree_node_t *root, quadtree_bounds_t *box, qu
         }
 }
 
+/*
+ * Subtrees fully inside box are counted from their weight, unvisited, unless
+ * lazy mode left the weight stale: those are counted by their leaves.
+ */
+static unsigned int
+count_bounds_(quadtree_node_t *root, quadtree_bounds_t *box) {
+        quadtree_node_t *entry;
+        unsigned int count = 0;
+
+        if (quadtree_node_isempty(root) || !bounds_overlap_bounds_(root->bounds, box))
+                return 0;
+        if (!root->weight_dirty && bounds_contains_bounds_(root->bounds, box))
+                return node_count_(root);
+        if (quadtree_node_isleaf(root)) {
+                for (entry = root; entry != NULL; entry = next_entry_(entry))
+                        count += bounds_contains_point_(box, entry->point);
+                return count;
+        }
+        prefetch_children_(root);
+        return count_bounds_(root->nw, box) + count_bounds_(root->ne, box) + count_bounds_(root->sw, box) +
+               count_bounds_(root->se, box);
+}
+
+/* Like search_bounds_include_partial_, skipping subtrees timed outside [from, to]. */
+static void
+search_window_(quadtree_node_t *root, quadtree_bounds_t *box, double from, double to, quadtree_node_list_t **result) {
+        quadtree_node_t *entry;
+
+        if (quadtree_node_isempty(root) || node_tmax_(root) < from || node_tmin_(root) > to)
+                return;
+        if (box != NULL && !bounds_overlap_bounds_(root->bounds, box))
+                return;
+        if (quadtree_node_isleaf(root)) {
+                for (entry = root; entry != NULL; entry = next_entry_(entry)) {
+                        if (node_time_(entry) >= from && node_time_(entry) <= to &&
+                            (box == NULL || bounds_contains_point_(box, entry->point)))
+                                quadtree_node_list_add(result, entry);
+                }
+                return;
+        }
+        prefetch_children_(root);
+        search_window_(root->nw, box, from, to, result);
+        search_window_(root->ne, box, from, to, result);
+        search_window_(root->sw, box, from, to, result);
+        search_window_(root->se, box, from, to, result);
+}
+
+/* count_bounds_ binned: subtrees inside one raster cell add their weight. */
+static unsigned int
+density_grid_(density_grid_t *grid, quadtree_node_t *root) {
+        quadtree_bounds_t *b = root->bounds;
+        quadtree_node_t *entry;
+        unsigned int col, row, count = 0;
+
+        if (quadtree_node_isempty(root) || !bounds_overlap_bounds_(b, grid->box))
+                return 0;
+        if (!root->weight_dirty && bounds_contains_bounds_(b, grid->box)) {
+                col = grid_col_(grid, b->nw->x);
+                row = grid_row_(grid, b->nw->y);
+                if (col == grid_col_(grid, b->se->x) && row == grid_row_(grid, b->se->y)) {
+                        count = node_count_(root);
+                        grid->counts[row * grid->width + col] += count;
+                        return count;
+                }
+        }
+        if (quadtree_node_isleaf(root)) {
+                for (entry = root; entry != NULL; entry = next_entry_(entry)) {
+                        if (bounds_contains_point_(grid->box, entry->point)) {
+                                col = grid_col_(grid, entry->point->x);
+                                row = grid_row_(grid, entry->point->y);
+                                grid->counts[row * grid->width + col]++;
+                                count++;
+                        }
+                }
+                return count;
+        }
+        return density_grid_(grid, root->nw) + density_grid_(grid, root->ne) + density_grid_(grid, root->sw) +
+               density_grid_(grid, root->se);
+}
+
 static void
 inc_parent_cnt(quadtree_node_t *node) {
         node->parent->children_cnt += 1;
@@ -425,22 +943,144 @@ dec_parent_cnt(quadtree_node_t *node) {
 }
 
 static void
-dec_parent_cnt_with_weight(quadtree_node_t *node) {
+dec_parent_cnt_with_weight(quadtree_t *tree, quadtree_node_t *node, double value) {
         dec_parent_cnt(node);
+        add_weight_(tree, node, -1, value);
+}
+
+/*
+ * The number of points at node changed by delta, fix its ancestors. value is
+ * the aggregate of those points, if the tree keeps one. A bucket leaf's own
+ * count of overflow entries is always kept exact. In lazy mode the ancestors
+ * are only flagged, stopping at the first one already flagged.
+ */
+static void
+add_weight_(quadtree_t *tree, quadtree_node_t *node, int delta, double value) {
+        if (node->bounds == NULL) {
+                node = node->parent;
+                node->weight += delta;
+                apply_aggregate_(tree, node, delta, value);
+        }
+        if (tree->lazy_weight) {
+                while ((node = node->parent) != NULL && !node->weight_dirty)
+                        node->weight_dirty = 1;
+                return;
+        }
+        while (node->parent != NULL) {
+                node = node->parent;
+                node->weight += delta;
+                apply_aggregate_(tree, node, delta, value);
+        }
+}
+
+/* Recompute flagged weights below node. Returns the points under node. */
+static unsigned int
+sync_weight_(quadtree_t *tree, quadtree_node_t *node) {
+        if (node->weight_dirty) {
+                node->weight = sync_weight_(tree, node->nw) + sync_weight_(tree, node->ne) +
+                               sync_weight_(tree, node->sw) + sync_weight_(tree, node->se);
+                if (tree->aggregate != NULL)
+                        node->ext->agg = recompute_aggregate_(tree, node);
+                node->weight_dirty = 0;
+        }
+        return node_count_(node);
+}
+
+/* sync_weight_ for the flagged subtrees inside box, those straddling its edge stay flagged. */
+static void
+sync_weight_in_(quadtree_t *tree, quadtree_node_t *node, quadtree_bounds_t *box) {
+        if (!node->weight_dirty || !bounds_overlap_bounds_(node->bounds, box))
+                return;
+        if (bounds_contains_bounds_(node->bounds, box)) {
+                sync_weight_(tree, node);
+                return;
+        }
+        sync_weight_in_(tree, node->nw, box);
+        sync_weight_in_(tree, node->ne, box);
+        sync_weight_in_(tree, node->sw, box);
+        sync_weight_in_(tree, node->se, box);
+}
+
+/* Re-derive the aggregate along node's path, e.g. after its key changed. */
+static void
+refresh_aggregate_(quadtree_t *tree, quadtree_node_t *node) {
+        node = leaf_cell_(node);
+        node->ext->agg = recompute_aggregate_(tree, node);
+        if (tree->lazy_weight) {
+                while ((node = node->parent) != NULL && !node->weight_dirty)
+                        node->weight_dirty = 1;
+                return;
+        }
+        while ((node = node->parent) != NULL)
+                node->ext->agg = recompute_aggregate_(tree, node);
+}
+
+/*
+ * Stretch the time ranges on node's path to cover time. Always the whole
+ * path: ranges left loose by removals are not nested, so one already
+ * covering time says nothing about those above it.
+ */
+static void
+widen_time_(quadtree_node_t *node, double time) {
+        if (node->ext == NULL)
+                return;
+        for (node = leaf_cell_(node); node != NULL; node = node->parent) {
+                if (time < node->ext->tmin)
+                        node->ext->tmin = time;
+                if (time > node->ext->tmax)
+                        node->ext->tmax = time;
+        }
+}
+
+/* Exact range of a leaf's chain, or the union of a pointer's quadrants. */
+static void
+retime_(quadtree_node_t *node) {
+        quadtree_node_ext_t *ext = node->ext;
+        quadtree_node_t *quads[4];
+        quadtree_node_t *entry;
+        int i;
+
+        if (ext == NULL)
+                return;
+        ext->tmin = HUGE_VAL;
+        ext->tmax = -HUGE_VAL;
         if (quadtree_node_isleaf(node)) {
-                while (node->parent != NULL) {
-                        node->parent->weight--;
-                        node = node->parent;
+                for (entry = node; entry != NULL; entry = entry->ext->overflow) {
+                        if (entry->ext->time < ext->tmin)
+                                ext->tmin = entry->ext->time;
+                        if (entry->ext->time > ext->tmax)
+                                ext->tmax = entry->ext->time;
+                }
+        } else if (quadtree_node_ispointer(node)) {
+                quads[0] = node->nw;
+                quads[1] = node->ne;
+                quads[2] = node->sw;
+                quads[3] = node->se;
+                for (i = 0; i < 4; i++) {
+                        if (node_count_(quads[i]) == 0)
+                                continue;
+                        if (quads[i]->ext->tmin < ext->tmin)
+                                ext->tmin = quads[i]->ext->tmin;
+                        if (quads[i]->ext->tmax > ext->tmax)
+                                ext->tmax = quads[i]->ext->tmax;
                 }
         }
 }
 
 /* cribbed from the google closure library. */
 static int
-insert_(quadtree_t *tree, quadtree_node_t *root, quadtree_point_t *point, void *key, quadtree_node_t **node_p) {
+insert_(quadtree_t *tree, quadtree_node_t *root, quadtree_point_t *point, double time, void *key,
+        quadtree_node_t **node_p) {
         if (quadtree_node_isempty(root)) {
                 root->point = point;
                 root->key = key;
+                set_time_(root, time);
+                if (root->ext != NULL) {
+                        root->ext->tmin = time;
+                        root->ext->tmax = time;
+                }
+                if (tree->aggregate != NULL)
+                        root->ext->agg = tree->aggregate->init(root);
                 if (root->parent != NULL) {
                         inc_parent_cnt(root);
                 }
@@ -451,20 +1091,29 @@ insert_(quadtree_t *tree, quadtree_node_t *root, quadtree_point_t *point, void *
                 return 1; /* normal insertion flag */
         } else if (quadtree_node_isleaf(root)) {
                 quadtree_node_t *fill_this_in = NULL;
-                if (root->point->x == point->x && root->point->y == point->y) {
-                        reset_node_(tree, root);
-                        root->point = point;
-                        root->key = key;
+                quadtree_node_t *entry = find_entry_(root, point->x, point->y);
+                if (entry != NULL) {
+                        reset_node_(tree, entry);
+                        entry->point = point;
+                        entry->key = key;
+                        set_time_(entry, time);
                         if (node_p != NULL)
-                                *node_p = root;
+                                *node_p = entry;
                         return 2; /* replace insertion flag */
+                } else if (leaf_at_limit_(tree, root)) {
+                        /* Coincident or near coincident points share a bucket. */
+                        if (!extend_(tree))
+                                return 0;
+                        return push_overflow_(root, point, time, key, node_p);
                 } else {
                         if (!split_node_(tree, root, &fill_this_in)) {
                                 printf("Failed to split node\n");
                                 return 0; /* failed insertion flag */
                         }
+                        if (node_objects_(fill_this_in) != NULL)
+                                sink_objects_(tree, fill_this_in);
 
-                        return insert_(tree, fill_this_in, point, key, node_p);
+                        return insert_(tree, fill_this_in, point, time, key, node_p);
                 }
         } else if (quadtree_node_ispointer(root)) {
                 quadtree_node_t *quadrant = get_quadrant_(root, point);
@@ -482,175 +1131,1236 @@ insert_(quadtree_t *tree, quadtree_node_t *root, quadtree_point_t *point, void *
                                root->se->bounds->se->x, root->se->bounds->se->y);
                         return 0;
                 }
-                return insert_(tree, quadrant, point, key, node_p);
+                return insert_(tree, quadrant, point, time, key, node_p);
         }
         return 0;
 }
 
-/* public */
-quadtree_t *
-quadtree_new(double minx, double miny, double maxx, double maxy) {
-        quadtree_t *tree = NULL;
-        if (!(tree = malloc(sizeof(*tree)))) {
-                return NULL;
-        }
-        tree->root = quadtree_node_with_bounds(minx, miny, maxx, maxy);
-        if (!(tree->root)) {
-                return NULL;
-        }
-        tree->key_free = NULL;
-        tree->length = 0;
-        return tree;
+/* boxes */
+
+static inline int
+loose_contains_(quadtree_t *tree, quadtree_node_t *node, quadtree_bounds_t *box) {
+        quadtree_bounds_t *b = node->bounds;
+        double px = b->width * (tree->looseness - 1) / 2;
+        double py = b->height * (tree->looseness - 1) / 2;
+        return b->nw->x - px <= box->nw->x && b->se->x + px >= box->se->x && b->se->y - py <= box->se->y &&
+               b->nw->y + py >= box->nw->y;
 }
 
-quadtree_node_list_t *
-quadtree_node_list_new(quadtree_node_t *node) {
-        quadtree_node_list_t *new = malloc(sizeof(quadtree_node_list_t));
-        if (new == NULL) {
-                return NULL;
-        }
-        new->node = node;
+static inline int
+loose_overlaps_(quadtree_t *tree, quadtree_node_t *node, quadtree_bounds_t *box) {
+        quadtree_bounds_t *b = node->bounds;
+        double px = b->width * (tree->looseness - 1) / 2;
+        double py = b->height * (tree->looseness - 1) / 2;
+        return !(box->se->x < b->nw->x - px || box->nw->x > b->se->x + px || box->nw->y < b->se->y - py ||
+                 box->se->y > b->nw->y + py);
+}
+
+/* Neither points, quadrants nor boxes. */
+static inline int
+bare_(quadtree_node_t *node) {
+        return quadtree_node_isempty(node) && node_objects_(node) == NULL;
+}
+
+static void
+set_box_(quadtree_object_t *object, double minx, double miny, double maxx, double maxy) {
+        object->nw.x = minx;
+        object->nw.y = maxy;
+        object->se.x = maxx;
+        object->se.y = miny;
+        object->box.nw = &object->nw;
+        object->box.se = &object->se;
+        object->box.width = maxx - minx;
+        object->box.height = maxy - miny;
+}
+
+static void
+attach_(quadtree_node_t *node, quadtree_object_t *object) {
+        object->node = node;
+        object->next = node->ext->objects;
+        node->ext->objects = object;
+}
+
+static void
+detach_(quadtree_object_t *object) {
+        quadtree_object_t **it = &object->node->ext->objects;
+        while (*it != object)
+                it = &(*it)->next;
+        *it = object->next;
+        object->next = NULL;
+}
+
+/* The quadrant of node that should hold object, NULL if none fits. */
+static quadtree_node_t *
+fit_child_(quadtree_t *tree, quadtree_node_t *node, quadtree_object_t *object) {
+        quadtree_point_t center = {(object->nw.x + object->se.x) / 2, (object->nw.y + object->se.y) / 2};
+        quadtree_node_t *child = get_quadrant_(node, &center);
+        return child != NULL && loose_contains_(tree, child, &object->box) ? child : NULL;
+}
+
+static quadtree_node_t *
+place_(quadtree_t *tree, quadtree_node_t *node, quadtree_object_t *object) {
+        quadtree_node_t *child;
+        while (quadtree_node_ispointer(node) && (child = fit_child_(tree, node, object)) != NULL)
+                node = child;
+        return node;
+}
+
+/*
+ * A crowded cell without quadrants gets some and lets its boxes sink into
+ * them. Cells at the depth limit, and buckets, keep all their boxes.
+ */
+static void
+split_for_objects_(quadtree_t *tree, quadtree_node_t *node) {
+        quadtree_node_t *pointer = node;
+        quadtree_object_t *it;
+        unsigned int n = 0;
+
+        if (quadtree_node_ispointer(node) || next_entry_(node) != NULL)
+                return;
+        for (it = node_objects_(node); it != NULL; it = it->next)
+                n++;
+        if (n <= QUADTREE_NODE_OBJECTS || leaf_at_limit_(tree, node))
+                return;
+        if (quadtree_node_isleaf(node)) {
+                if (split_node_(tree, node, &pointer) <= 0)
+                        return;
+        } else {
+                if (!subdivide_(node))
+                        return;
+                /* No longer empty as far as the parent is concerned. */
+                if (node->parent != NULL)
+                        inc_parent_cnt(node);
+        }
+        sink_objects_(tree, pointer);
+}
+
+/* Move the boxes of node down into whichever quadrant now fits them. */
+static void
+sink_objects_(quadtree_t *tree, quadtree_node_t *node) {
+        quadtree_object_t **it = &node->ext->objects;
+        quadtree_object_t *object;
+        quadtree_node_t *child;
+
+        while ((object = *it) != NULL) {
+                if ((child = fit_child_(tree, node, object)) != NULL) {
+                        *it = object->next;
+                        attach_(child, object);
+                } else {
+                        it = &object->next;
+                }
+        }
+        split_for_objects_(tree, node->nw);
+        split_for_objects_(tree, node->ne);
+        split_for_objects_(tree, node->sw);
+        split_for_objects_(tree, node->se);
+}
+
+/*
+ * Climbing from node, fold quadrants that were only there for boxes once no
+ * box or point is left under them.
+ */
+static void
+prune_(quadtree_t *tree, quadtree_node_t *node) {
+        quadtree_node_t *parent;
+
+        for (; node != NULL && node_objects_(node) == NULL; node = parent) {
+                parent = node->parent;
+                if (quadtree_node_isleaf(node))
+                        return;
+                if (!quadtree_node_ispointer(node))
+                        continue;
+                if (!bare_(node->nw) || !bare_(node->ne) || !bare_(node->sw) || !bare_(node->se))
+                        return;
+                quadtree_node_free(node->nw, elision_);
+                quadtree_node_free(node->ne, elision_);
+                quadtree_node_free(node->sw, elision_);
+                quadtree_node_free(node->se, elision_);
+                node->nw = node->ne = node->sw = node->se = NULL;
+                node->children_cnt = 0;
+                node->weight = 0;
+                node->weight_dirty = 0;
+                if (parent != NULL) {
+                        dec_parent_cnt(node);
+                        if (parent->children_cnt == 1) {
+                                condense_parent(tree, parent);
+                                return;
+                        }
+                }
+        }
+}
+
+static void
+search_objects_(quadtree_t *tree, quadtree_node_t *node, quadtree_bounds_t *box, quadtree_object_list_t **result) {
+        quadtree_object_list_t *item;
+        quadtree_object_t *object;
+
+        if (!loose_overlaps_(tree, node, box))
+                return;
+        for (object = node_objects_(node); object != NULL; object = object->next) {
+                if (bounds_overlap_bounds_(&object->box, box) &&
+                    (item = quadtree_alloc(&quadtree_malloc_allocator, sizeof(*item))) != NULL) {
+                        item->allocator = &quadtree_malloc_allocator;
+                        item->object = object;
+                        item->next = *result;
+                        *result = item;
+                }
+        }
+        if (quadtree_node_ispointer(node)) {
+                search_objects_(tree, node->nw, box, result);
+                search_objects_(tree, node->ne, box, result);
+                search_objects_(tree, node->sw, box, result);
+                search_objects_(tree, node->se, box, result);
+        }
+}
+
+/*
+ * Double the root towards point until it fits. The old root becomes one
+ * quadrant of the new one, so no existing node moves.
+ */
+static int
+grow_root_(quadtree_t *tree, quadtree_point_t *point) {
+        if (!isfinite(point->x) || !isfinite(point->y))
+                return 0;
+
+        while (!node_contains_(tree->root, point)) {
+                quadtree_node_t *old = tree->root;
+                quadtree_bounds_t *b = old->bounds;
+                double minx = b->nw->x, maxy = b->nw->y, maxx = b->se->x, miny = b->se->y;
+                int west = point->x < minx;
+                int south = point->y < miny;
+                double midx = west ? minx : maxx;
+                double midy = south ? miny : maxy;
+                quadtree_node_t *root;
+                quadtree_node_t *quads[4];
+                int i, failed = 0;
+
+                if (b->width <= 0 || b->height <= 0)
+                        return 0;
+                if (west)
+                        minx -= b->width;
+                else
+                        maxx += b->width;
+                if (south)
+                        miny -= b->height;
+                else
+                        maxy += b->height;
+
+                if (!(root = quadtree_node_alloc_like(old, minx, miny, maxx, maxy)))
+                        return 0;
+                old->coord = south ? (west ? NE : NW) : (west ? SE : SW);
+                // minx,   miny,       maxx,       maxy
+                quadtree_node_t *nw = old->coord == NW ? old : quadtree_node_alloc_like(old, minx, midy, midx, maxy);
+                quadtree_node_t *ne = old->coord == NE ? old : quadtree_node_alloc_like(old, midx, midy, maxx, maxy);
+                quadtree_node_t *sw = old->coord == SW ? old : quadtree_node_alloc_like(old, minx, miny, midx, midy);
+                quadtree_node_t *se = old->coord == SE ? old : quadtree_node_alloc_like(old, midx, miny, maxx, midy);
+                quads[0] = nw;
+                quads[1] = ne;
+                quads[2] = sw;
+                quads[3] = se;
+                for (i = 0; i < 4; i++)
+                        failed |= quads[i] == NULL;
+                if (failed) {
+                        for (i = 0; i < 4; i++) {
+                                if (quads[i] != NULL && quads[i] != old)
+                                        quadtree_node_free(quads[i], elision_);
+                        }
+                        quadtree_node_free(root, elision_);
+                        old->coord = NO_COORDINATE;
+                        return 0;
+                }
+
+                root->nw = nw;
+                root->ne = ne;
+                root->sw = sw;
+                root->se = se;
+                for (i = 0; i < 4; i++) {
+                        quads[i]->coord = (coordinate_t)i;
+                        quads[i]->parent = root;
+                }
+                root->weight = node_count_(old);
+                if (tree->aggregate != NULL)
+                        root->ext->agg = node_aggregate_(tree, old);
+                root->weight_dirty = tree->lazy_weight;
+                if (root->ext != NULL) {
+                        root->ext->tmin = old->ext->tmin;
+                        root->ext->tmax = old->ext->tmax;
+                }
+                root->children_cnt = quadtree_node_isempty(old) ? 0 : 1;
+                tree->root = root;
+        }
+        return 1;
+}
+
+/*
+ * Undo grow_root_ while a single pointer quadrant holds every point.
+ */
+static void
+shrink_root_(quadtree_t *tree) {
+        quadtree_node_t *root;
+        quadtree_node_t *keep;
+        int occupied;
+
+        if (tree->lazy_weight)
+                sync_weight_(tree, tree->root);
+        while (quadtree_node_ispointer(root = tree->root) && root->children_cnt == 1 && node_objects_(root) == NULL) {
+                keep = NULL;
+                occupied = 0;
+                if (!bare_(root->nw) && ++occupied)
+                        keep = root->nw;
+                if (!bare_(root->ne) && ++occupied)
+                        keep = root->ne;
+                if (!bare_(root->sw) && ++occupied)
+                        keep = root->sw;
+                if (!bare_(root->se) && ++occupied)
+                        keep = root->se;
+                if (occupied != 1 || !quadtree_node_ispointer(keep))
+                        return;
+
+                set_child_(tree, root, keep->coord, NULL);
+                keep->parent = NULL;
+                keep->coord = NO_COORDINATE;
+                tree->root = keep;
+                quadtree_node_free(root, elision_);
+        }
+}
+
+/* Aggregate twin of count_bounds_, returns how many points went into *agg. */
+static unsigned int
+aggregate_bounds_(quadtree_t *tree, quadtree_node_t *root, quadtree_bounds_t *box, double *agg) {
+        const quadtree_aggregate_t *aggregate = tree->aggregate;
+        quadtree_node_t *entry;
+        unsigned int count = 0;
+
+        if (quadtree_node_isempty(root) || !bounds_overlap_bounds_(root->bounds, box))
+                return 0;
+        if (!root->weight_dirty && bounds_contains_bounds_(root->bounds, box)) {
+                *agg = aggregate->combine(*agg, root->ext->agg);
+                return node_count_(root);
+        }
+        if (quadtree_node_isleaf(root)) {
+                for (entry = root; entry != NULL; entry = next_entry_(entry)) {
+                        if (bounds_contains_point_(box, entry->point)) {
+                                *agg = aggregate->combine(*agg, aggregate->init(entry));
+                                count++;
+                        }
+                }
+                return count;
+        }
+        return aggregate_bounds_(tree, root->nw, box, agg) + aggregate_bounds_(tree, root->ne, box, agg) +
+               aggregate_bounds_(tree, root->sw, box, agg) + aggregate_bounds_(tree, root->se, box, agg);
+}
+
+/* public */
+quadtree_t *
+quadtree_new(double minx, double miny, double maxx, double maxy) {
+        return quadtree_new_with_options(minx, miny, maxx, maxy, NULL);
+}
+
+/*
+ * A tree that takes its nodes, points and id table from allocator (NULL for
+ * malloc); query results stay on malloc, see quadtree_allocator_t. The
+ * allocator must outlive the tree.
+ */
+quadtree_t *
+quadtree_new_with_allocator(double minx, double miny, double maxx, double maxy,
+                            const quadtree_allocator_t *allocator) {
+        quadtree_options_t options = {allocator, NULL};
+        return quadtree_new_with_options(minx, miny, maxx, maxy, &options);
+}
+
+/* Every constructor ends up here, NULL options for the defaults. */
+quadtree_t *
+quadtree_new_with_options(double minx, double miny, double maxx, double maxy, const quadtree_options_t *options) {
+        const quadtree_allocator_t *allocator = options != NULL ? options->allocator : NULL;
+        quadtree_t *tree = NULL;
+        if (allocator == NULL)
+                allocator = &quadtree_malloc_allocator;
+        if (!(tree = quadtree_alloc(allocator, sizeof(*tree)))) {
+                return NULL;
+        }
+        tree->allocator = allocator;
+        tree->root = quadtree_node_alloc_with_bounds(allocator, minx, miny, maxx, maxy);
+        if (!(tree->root)) {
+                quadtree_release(allocator, tree, sizeof(*tree));
+                return NULL;
+        }
+        /* Aggregates live in the ext blocks, so such a tree has them from the start. */
+        if (options != NULL && options->aggregate != NULL && !quadtree_node_extend(tree->root)) {
+                quadtree_node_free(tree->root, elision_);
+                quadtree_release(allocator, tree, sizeof(*tree));
+                return NULL;
+        }
+        tree->key_free = NULL;
+        tree->length = 0;
+        tree->max_depth = 0;
+        tree->min_cell_size = 0;
+        tree->auto_grow = 0;
+        tree->auto_shrink = 0;
+        tree->lazy_weight = 0;
+        tree->aggregate = options != NULL ? options->aggregate : NULL;
+        tree->wal = NULL;
+        tree->feed = NULL;
+        tree->recorder = NULL;
+        tree->ids.nodes = NULL;
+        tree->ids.free = NULL;
+        tree->ids.length = 0;
+        tree->ids.capacity = 0;
+        tree->ids.free_length = 0;
+        tree->looseness = 2;
+        tree->tidy.path = NULL;
+        tree->tidy.length = 0;
+        tree->tidy.capacity = 0;
+        tree->tidy.repaired = 0;
+        return tree;
+}
+
+/*
+ * A tree whose nodes also cache an aggregate of their points, kept up to date
+ * alongside weight. init maps a point to its value, combine must be
+ * associative and commutative with identity as its neutral element, inverse
+ * may be NULL (deletes then recombine the quadrants along the path).
+ */
+quadtree_t *
+quadtree_new_with_aggregate(double minx, double miny, double maxx, double maxy,
+                            const quadtree_aggregate_t *aggregate) {
+        quadtree_options_t options = {NULL, aggregate};
+        return quadtree_new_with_options(minx, miny, maxx, maxy, &options);
+}
+
+/*
+ * Bound how deep inserts may split. A leaf at max_depth, or whose quadrants
+ * would be narrower than min_cell_size, keeps further points in its overflow
+ * chain instead of splitting. Zero disables either limit.
+ */
+void
+quadtree_set_depth_limit(quadtree_t *tree, unsigned int max_depth, double min_cell_size) {
+        tree->max_depth = max_depth;
+        tree->min_cell_size = min_cell_size;
+}
+
+/*
+ * With grow set, inserts outside the root double the root until the point
+ * fits instead of failing with -2. With shrink also set, removals drop the
+ * root again while one quadrant holds everything.
+ */
+void
+quadtree_set_auto_grow(quadtree_t *tree, int grow, int shrink) {
+        tree->auto_grow = grow;
+        tree->auto_shrink = grow && shrink;
+}
+
+/*
+ * In lazy mode inserts and removals stop walking to the root to update
+ * weight. They flag the path instead, and weights are recomputed for flagged
+ * nodes only, by quadtree_sync_weights() or by the calls that change the tree.
+ * Queries stay read only: count_bounds, density_grid and aggregate_bounds
+ * visit every leaf of a flagged subtree rather than syncing it. One insert
+ * flags the root, so until the next sync these queries cost as much as a
+ * search over the same box, O(N) for a box covering the tree. Whoever holds
+ * the writers' lock can call quadtree_sync_weights_in on the box first.
+ * Read node->weight directly only after a sync.
+ */
+void
+quadtree_set_lazy_weight(quadtree_t *tree, int lazy) {
+        if (!lazy)
+                quadtree_sync_weights(tree);
+        tree->lazy_weight = lazy;
+}
+
+/*
+ * How many levels below the current node the range traversals (bounds
+ * searches, count_bounds, walk) prefetch, 0 to turn it off. Deeper hides more
+ * latency but touches 4^(levels-1) cached nodes per visit; 2 or 3 suits most
+ * machines. Applies to every tree; set it before querying from threads.
+ */
+void
+quadtree_set_prefetch_distance(unsigned int levels) {
+        prefetch_distance_ = levels;
+}
+
+void
+quadtree_sync_weights(quadtree_t *tree) {
+        sync_weight_(tree, tree->root);
+}
+
+/*
+ * quadtree_sync_weights for the part of the tree inside box, costing the
+ * flagged nodes there rather than the whole tree. Queries over box then
+ * count whole cells from their weight again. Writes the tree: hold the
+ * writers' lock.
+ */
+void
+quadtree_sync_weights_in(quadtree_t *tree, quadtree_bounds_t *box) {
+        sync_weight_in_(tree, tree->root, box);
+}
+
+/*
+ * Results come from malloc, not the tree's allocator: arenas are not thread
+ * safe, and readers may run concurrently.
+ */
+quadtree_node_list_t *
+quadtree_node_list_new(quadtree_node_t *node) {
+        const quadtree_allocator_t *allocator = &quadtree_malloc_allocator;
+        quadtree_node_list_t *new = quadtree_alloc(allocator, sizeof(quadtree_node_list_t));
+        if (new == NULL) {
+                return NULL;
+        }
+        new->allocator = allocator;
+        new->node = node;
         new->next = NULL;
         return new;
 }
 
-void
-quadtree_node_list_free(quadtree_node_list_t *list) {
-        quadtree_node_list_t *next = NULL;
-        quadtree_node_list_t *curr = list;
-        if (list == NULL) {
-                return;
-        }
+void
+quadtree_node_list_free(quadtree_node_list_t *list) {
+        quadtree_node_list_t *next = NULL;
+        quadtree_node_list_t *curr = list;
+        if (list == NULL) {
+                return;
+        }
+
+        while (curr != NULL) {
+                next = curr->next;
+                quadtree_release(curr->allocator, curr, sizeof(*curr));
+                curr = next;
+        }
+}
+
+void
+quadtree_node_list_add(quadtree_node_list_t **list_p, quadtree_node_t *node) {
+        quadtree_node_list_t *new = quadtree_node_list_new(node);
+        if (new == NULL)
+                return;
+        new->next = *list_p;
+        *list_p = new;
+}
+
+static int
+insert_at_(quadtree_t *tree, quadtree_node_t *hint, double x, double y, double time, void *key,
+           quadtree_node_t **node_p) {
+        quadtree_point_t *point;
+        quadtree_node_t *start;
+        int insert_status;
+
+        /* backup container for node pointer if user doesn't provide one */
+        quadtree_node_t *node;
+        if (node_p == NULL) {
+                node_p = &node;
+        }
+
+        if (time != 0 && !extend_(tree))
+                return -1;
+        if (!(point = quadtree_point_alloc(tree->allocator, x, y)))
+                return -1;
+        start = climb_(tree, hint, point);
+        if (!node_contains_(start, point)) {
+                if (!(tree->auto_grow && grow_root_(tree, point))) {
+                        quadtree_point_release(tree->allocator, point);
+                        return -2;
+                }
+                start = tree->root;
+        }
+
+        if (!(insert_status = insert_(tree, start, point, time, key, node_p))) {
+                quadtree_point_release(tree->allocator, point);
+                return -3;
+        }
+        widen_time_(*node_p, time);
+        if (insert_status == 1) {
+                tree->length++;
+                add_weight_(tree, *node_p, 1, point_value_(tree, *node_p));
+                TRACE_(QUADTREE_TRACE_INSERT, tree, *node_p, tree->length);
+        }
+
+        else if (insert_status == 2 && tree->aggregate != NULL) {
+                refresh_aggregate_(tree, *node_p);
+        }
+
+        return insert_status;
+}
+
+/* Changes go to the tree's log and to its change feed, if it has them. */
+static inline int
+recording_(quadtree_t *tree) {
+        return tree->wal != NULL || tree->feed != NULL;
+}
+
+static void
+record_(quadtree_t *tree, quadtree_wal_op_t op, const double *args, unsigned int argc, void *key) {
+        if (tree->wal != NULL)
+                quadtree_wal_log(tree->wal, op, args, argc, key);
+        if (tree->feed != NULL)
+                quadtree_feed_log(tree->feed, op, args, argc, key);
+}
+
+static void
+record_subtree_(quadtree_t *tree, quadtree_wal_op_t op, const double *head, unsigned int head_n,
+                quadtree_node_t *subtree) {
+        if (tree->wal != NULL)
+                quadtree_wal_log_subtree(tree->wal, op, head, head_n, subtree);
+        if (tree->feed != NULL)
+                quadtree_feed_log_subtree(tree->feed, op, head, head_n, subtree);
+}
+
+/* Calls, successful or not, go to the tree's recorder if it has one. */
+static inline void
+called_(quadtree_t *tree, quadtree_call_t call, double a, double b, double c, double d) {
+        if (tree->recorder != NULL)
+                quadtree_record_call(tree->recorder, call, a, b, c, d);
+}
+
+/* Between quadtree_record_begin and _end: box as minx, miny, maxx, maxy. */
+static void
+record_box_(quadtree_recorder_t *recorder, quadtree_bounds_t *box) {
+        quadtree_record_arg(recorder, box->nw->x);
+        quadtree_record_arg(recorder, box->se->y);
+        quadtree_record_arg(recorder, box->se->x);
+        quadtree_record_arg(recorder, box->nw->y);
+}
+
+static int
+insert_logged_(quadtree_t *tree, quadtree_node_t *hint, double x, double y, double time, void *key,
+               quadtree_node_t **node_p) {
+        int status;
+
+        called_(tree, QUADTREE_CALL_INSERT, x, y, time, 0);
+        status = insert_at_(tree, hint, x, y, time, key, node_p);
+        if (status > 0 && recording_(tree)) {
+                double args[3] = {x, y, time};
+                record_(tree, QUADTREE_WAL_INSERT, args, 3, key);
+        }
+        return status;
+}
+
+/* Points inserted without a timestamp have time 0. */
+int
+quadtree_insert(quadtree_t *tree, double x, double y, void *key, quadtree_node_t **node_p) {
+        return insert_logged_(tree, NULL, x, y, 0, key, node_p);
+}
+
+/*
+ * Finger variants. hint is any node of the tree near the point, typically
+ * its old leaf; the walk climbs from there only as far as needed instead of
+ * descending from the root. A NULL hint starts at the root.
+ */
+int
+quadtree_insert_from(quadtree_t *tree, quadtree_node_t *hint, double x, double y, void *key,
+                     quadtree_node_t **node_p) {
+        return insert_logged_(tree, hint, x, y, 0, key, node_p);
+}
+
+/*
+ * quadtree_insert with a timestamp, e.g. when the position was reported.
+ * Replacing a point gives it the new time.
+ */
+int
+quadtree_insert_at(quadtree_t *tree, double x, double y, double time, void *key, quadtree_node_t **node_p) {
+        return insert_logged_(tree, NULL, x, y, time, key, node_p);
+}
+
+quadtree_point_t *
+quadtree_search(quadtree_t *tree, double x, double y) {
+        called_(tree, QUADTREE_CALL_SEARCH, x, y, 0, 0);
+        return find_(tree->root, x, y);
+}
+
+quadtree_node_t *
+quadtree_node_search(quadtree_t *tree, double x, double y) {
+        called_(tree, QUADTREE_CALL_SEARCH, x, y, 0, 0);
+        return find_node_from_point_(tree->root, x, y);
+}
+
+quadtree_point_t *
+quadtree_search_from(quadtree_t *tree, quadtree_node_t *hint, double x, double y) {
+        quadtree_point_t point = {x, y};
+        called_(tree, QUADTREE_CALL_SEARCH, x, y, 0, 0);
+        return find_(climb_(tree, hint, &point), x, y);
+}
+
+quadtree_node_t *
+quadtree_node_search_from(quadtree_t *tree, quadtree_node_t *hint, double x, double y) {
+        quadtree_point_t point = {x, y};
+        called_(tree, QUADTREE_CALL_SEARCH, x, y, 0, 0);
+        return find_node_from_point_(climb_(tree, hint, &point), x, y);
+}
+
+/*
+ * Batched lookups. A single search is a chain of dependent misses: the node,
+ * its nw child, that child's bounds and their se corner, which is the split
+ * both ways. The batch keeps a group of searches and moves each one a single
+ * load at a time, prefetching the next load before moving to the next search,
+ * so a whole group of misses overlaps instead of one at a time.
+ */
+typedef enum lookup_stage {
+        AT_NODE,   /* node requested */
+        AT_SPLIT,  /* node's nw child requested */
+        AT_BOUNDS, /* nw bounds requested */
+        AT_EDGE,   /* nw se corner requested */
+        AT_LEAF,   /* leaf point requested */
+} lookup_stage_t;
+
+typedef struct lookup {
+        size_t index;
+        quadtree_node_t *node;
+        lookup_stage_t stage;
+} lookup_t;
+
+/* One load for lookup, returns 1 once out[lookup->index] is known. */
+static int
+lookup_step_(lookup_t *lookup, const double *xs, const double *ys, quadtree_node_t **out) {
+        quadtree_node_t *node = lookup->node;
+        quadtree_point_t *edge;
+        double x = xs[lookup->index], y = ys[lookup->index];
+        int west, north;
+
+        switch (lookup->stage) {
+                case AT_NODE:
+                        if (node->nw != NULL) {
+                                PREFETCH_(node->nw);
+                                lookup->stage = AT_SPLIT;
+                        } else if (node->point != NULL) {
+                                PREFETCH_(node->point);
+                                lookup->stage = AT_LEAF;
+                        } else {
+                                out[lookup->index] = NULL;
+                                return 1;
+                        }
+                        return 0;
+                case AT_SPLIT:
+                        PREFETCH_(node->nw->bounds);
+                        lookup->stage = AT_BOUNDS;
+                        return 0;
+                case AT_BOUNDS:
+                        PREFETCH_(node->nw->bounds->se);
+                        lookup->stage = AT_EDGE;
+                        return 0;
+                case AT_EDGE:
+                        /* Same pick as get_quadrant_: edges go to nw, then ne, then sw. */
+                        edge = node->nw->bounds->se;
+                        west = x <= edge->x;
+                        north = y >= edge->y;
+                        node = north ? (west ? node->nw : node->ne) : (west ? node->sw : node->se);
+                        PREFETCH_(node);
+                        lookup->node = node;
+                        lookup->stage = AT_NODE;
+                        return 0;
+                case AT_LEAF:
+                        out[lookup->index] = find_entry_(node, x, y);
+                        return 1;
+        }
+        return 1;
+}
+
+/* Next lookup that needs a walk, settling the ones outside the root. */
+static int
+lookup_start_(quadtree_t *tree, lookup_t *lookup, size_t *next, size_t n, const double *xs, const double *ys,
+              quadtree_node_t **out) {
+        quadtree_point_t point;
+        for (; *next < n; (*next)++) {
+                point.x = xs[*next];
+                point.y = ys[*next];
+                if (node_contains_(tree->root, &point)) {
+                        lookup->index = (*next)++;
+                        lookup->node = tree->root;
+                        lookup->stage = AT_NODE;
+                        return 1;
+                }
+                out[*next] = NULL;
+        }
+        return 0;
+}
+
+/*
+ * quadtree_node_search for each of the n points (xs[i], ys[i]), into out[i]
+ * (NULL where there is no point). Returns how many were found.
+ */
+size_t
+quadtree_search_batch(quadtree_t *tree, const double *xs, const double *ys, size_t n, quadtree_node_t **out) {
+        lookup_t group[QUADTREE_BATCH_GROUP];
+        size_t next = 0, found = 0;
+        int i, active = 0;
+
+        if (tree->recorder != NULL) {
+                quadtree_record_begin(tree->recorder, QUADTREE_CALL_SEARCH_BATCH);
+                quadtree_record_arg(tree->recorder, n);
+                for (next = 0; next < n; next++) {
+                        quadtree_record_arg(tree->recorder, xs[next]);
+                        quadtree_record_arg(tree->recorder, ys[next]);
+                }
+                quadtree_record_end(tree->recorder);
+                next = 0;
+        }
+        while (active < QUADTREE_BATCH_GROUP && lookup_start_(tree, &group[active], &next, n, xs, ys, out))
+                active++;
+        while (active > 0) {
+                for (i = 0; i < active; i++) {
+                        if (!lookup_step_(&group[i], xs, ys, out))
+                                continue;
+                        found += out[group[i].index] != NULL;
+                        if (!lookup_start_(tree, &group[i], &next, n, xs, ys, out))
+                                group[i--] = group[--active];
+                }
+        }
+        return found;
+}
+
+quadtree_node_list_t *
+quadtree_search_bounds(quadtree_t *tree, double x, double y, double radius) {
+        /* Build box, on the stack so a query allocates only its results */
+        quadtree_point_t top_left = {x - radius, y + radius};
+        quadtree_point_t bottom_right = {x + radius, y - radius};
+        quadtree_bounds_t box = {&top_left, &bottom_right, radius * 2, radius * 2};
+
+        /* Will contain list of matching nodes */
+        quadtree_node_list_t *result = NULL;
+        called_(tree, QUADTREE_CALL_SEARCH_BOUNDS, x, y, radius, 0);
+        search_bounds_(tree->root, &box, &result);
+        return result;
+}
+
+/*
+ * Leaves and overflow entries inside box, edges included, whose time is in
+ * [from, to]. A NULL box only filters by time.
+ */
+quadtree_node_list_t *
+quadtree_search_window(quadtree_t *tree, quadtree_bounds_t *box, double from, double to) {
+        quadtree_node_list_t *results = NULL;
+
+        if (tree->recorder != NULL) {
+                quadtree_record_begin(tree->recorder, QUADTREE_CALL_SEARCH_WINDOW);
+                quadtree_record_arg(tree->recorder, from);
+                quadtree_record_arg(tree->recorder, to);
+                quadtree_record_arg(tree->recorder, box != NULL);
+                if (box != NULL)
+                        record_box_(tree->recorder, box);
+                quadtree_record_end(tree->recorder);
+        }
+        search_window_(tree->root, box, from, to, &results);
+        return results;
+}
+
+quadtree_node_list_t *
+quadtree_search_bounds_include_partial(quadtree_t *tree, double x, double y, double radius) {
+        // TODO: error checking on valid bounds for map
+
+        /* Build box, on the stack so a query allocates only its results */
+        quadtree_point_t top_left = {x - radius, y + radius};
+        quadtree_point_t bottom_right = {x + radius, y - radius};
+        quadtree_bounds_t box = {&top_left, &bottom_right, radius * 2, radius * 2};
+
+        /* Will contain list of matching nodes */
+        quadtree_node_list_t *result = NULL;
+        called_(tree, QUADTREE_CALL_SEARCH_PARTIAL, x, y, radius, 0);
+        search_bounds_include_partial_(tree->root, &box, &result);
+        return result;
+}
+
+/*
+ * Shared traversal for many boxes. Each node carries the queries still
+ * active there, tagged inside (take everything below) or crossing, and
+ * children get the subset that reaches them. Sets live on one scratch stack
+ * and are addressed by offset since it may move when grown.
+ */
+typedef struct multi_query {
+        quadtree_bounds_t *boxes;
+        quadtree_node_list_t **results;
+        size_t *stack;
+        size_t length;
+        size_t capacity;
+} multi_query_t;
+
+#define MULTI_INSIDE 1
+
+static int
+multi_push_(multi_query_t *multi, size_t tagged) {
+        size_t *grown;
+        if (multi->length == multi->capacity) {
+                multi->capacity *= 2;
+                if (!(grown = realloc(multi->stack, sizeof(*grown) * multi->capacity)))
+                        return 0;
+                multi->stack = grown;
+        }
+        multi->stack[multi->length++] = tagged;
+        return 1;
+}
+
+/*
+ * Queries from..to all reach node. Leaves take their points; pointers hand
+ * each child the subset reaching it, with the same choices per query as
+ * eval_quad_partial_, so every list comes out as the single call's would.
+ */
+static int
+search_multi_(multi_query_t *multi, quadtree_node_t *node, size_t from, size_t to) {
+        quadtree_node_t *quads[4];
+        size_t i, q, start = multi->length;
+        int c, inside;
+
+        if (quadtree_node_isleaf(node)) {
+                for (i = from; i < to; i++) {
+                        q = multi->stack[i] >> 1;
+                        inside = multi->stack[i] & MULTI_INSIDE;
+                        add_leaf_(node, inside ? NULL : &multi->boxes[q], &multi->results[q]);
+                }
+                return 1;
+        }
+        if (!quadtree_node_ispointer(node))
+                return 1;
+
+        prefetch_children_(node);
+        quads[0] = node->nw;
+        quads[1] = node->ne;
+        quads[2] = node->sw;
+        quads[3] = node->se;
+        for (c = 0; c < 4; c++) {
+                quadtree_bounds_t *bounds = quads[c]->bounds;
+                for (i = from; i < to; i++) {
+                        q = multi->stack[i] >> 1;
+                        inside = multi->stack[i] & MULTI_INSIDE;
+                        /* Points lie in their cell, a box missing it can take none. */
+                        if (!inside && !bounds_overlap_bounds_(bounds, &multi->boxes[q]))
+                                continue;
+                        inside = inside || bounds_contains_bounds_(bounds, &multi->boxes[q]);
+                        if (!multi_push_(multi, q << 1 | inside)) {
+                                multi->length = start;
+                                return 0;
+                        }
+                }
+                /* Alone below here: the single query walk has nothing to share. */
+                if (multi->length - start == 1) {
+                        q = multi->stack[start] >> 1;
+                        if (multi->stack[start] & MULTI_INSIDE)
+                                extract_all_(quads[c], &multi->results[q]);
+                        else
+                                eval_quad_partial_(quads[c], &multi->boxes[q], &multi->results[q]);
+                } else if (multi->length > start && !search_multi_(multi, quads[c], start, multi->length)) {
+                        multi->length = start;
+                        return 0;
+                }
+                multi->length = start;
+        }
+        return 1;
+}
+
+/*
+ * quadtree_search_bounds_include_partial for n boxes at once, each getting
+ * its own list in results[i]. Upper levels and nodes the boxes share are
+ * visited once for the batch. Returns 1, or -1 when out of memory (results
+ * then hold what was found so far and still need freeing).
+ */
+int
+quadtree_search_bounds_multi(quadtree_t *tree, quadtree_bounds_t *boxes, size_t n, quadtree_node_list_t **results) {
+        multi_query_t multi;
+        size_t i;
+        int ok;
+
+        if (tree->recorder != NULL) {
+                quadtree_record_begin(tree->recorder, QUADTREE_CALL_SEARCH_MULTI);
+                quadtree_record_arg(tree->recorder, n);
+                for (i = 0; i < n; i++)
+                        record_box_(tree->recorder, &boxes[i]);
+                quadtree_record_end(tree->recorder);
+        }
+        for (i = 0; i < n; i++)
+                results[i] = NULL;
+        if (n == 0)
+                return 1;
+        multi.boxes = boxes;
+        multi.results = results;
+        multi.capacity = n * 4;
+        multi.length = n;
+        if (!(multi.stack = malloc(sizeof(*multi.stack) * multi.capacity)))
+                return -1;
+        for (i = 0; i < n; i++)
+                multi.stack[i] = i << 1;
+        ok = search_multi_(&multi, tree->root, 0, n);
+        free(multi.stack);
+        return ok ? 1 : -1;
+}
+
+/*
+ * Cursor. Visits the tree in the same nw, ne, sw, se order as the recursive
+ * searches, but one leaf per call.
+ */
+void
+quadtree_cursor_init(quadtree_cursor_t *cursor, quadtree_t *tree, quadtree_bounds_t *box) {
+        cursor->top = tree->root;
+        cursor->node = tree->root;
+        cursor->entry = NULL;
+        cursor->allocator = &quadtree_malloc_allocator;
+        cursor->bounded = box != NULL;
+        if (box != NULL) {
+                cursor->nw = *box->nw;
+                cursor->se = *box->se;
+        }
+        cursor->box.nw = &cursor->nw;
+        cursor->box.se = &cursor->se;
+        cursor->box.width = cursor->se.x - cursor->nw.x;
+        cursor->box.height = cursor->nw.y - cursor->se.y;
+}
+
+quadtree_cursor_t *
+quadtree_cursor_open(quadtree_t *tree, quadtree_bounds_t *box) {
+        quadtree_cursor_t *cursor;
+        if (!(cursor = quadtree_alloc(&quadtree_malloc_allocator, sizeof(*cursor))))
+                return NULL;
+        quadtree_cursor_init(cursor, tree, box);
+        return cursor;
+}
+
+/* Next node in preorder once the subtree under node is done. */
+static quadtree_node_t *
+cursor_skip_(quadtree_cursor_t *cursor, quadtree_node_t *node) {
+        while (node != cursor->top && node->parent != NULL) {
+                if (node->coord != SE)
+                        return get_child_(node->parent, (coordinate_t)(node->coord + 1));
+                node = node->parent;
+        }
+        return NULL;
+}
+
+quadtree_node_t *
+quadtree_cursor_next(quadtree_cursor_t *cursor) {
+        quadtree_bounds_t *box = cursor->bounded ? &cursor->box : NULL;
+        quadtree_node_t *node;
+
+        for (;;) {
+                if ((node = cursor->entry) != NULL) {
+                        cursor->entry = next_entry_(node);
+                        if (box == NULL || bounds_contains_point_(box, node->point))
+                                return node;
+                        continue;
+                }
+                if ((node = cursor->node) == NULL)
+                        return NULL;
+
+                if (quadtree_node_ispointer(node) && (box == NULL || bounds_overlap_bounds_(node->bounds, box))) {
+                        cursor->node = node->nw;
+                        continue;
+                }
+                cursor->node = cursor_skip_(cursor, node);
+                if (quadtree_node_isleaf(node)) {
+                        cursor->entry = next_entry_(node);
+                        if (box == NULL || bounds_contains_point_(box, node->point))
+                                return node;
+                }
+        }
+}
+
+void
+quadtree_cursor_close(quadtree_cursor_t *cursor) {
+        quadtree_release(cursor->allocator, cursor, sizeof(*cursor));
+}
+
+/*
+ * Number of points inside box, same as the length of the
+ * quadtree_search_bounds_include_partial result for that box. Cells inside
+ * box count from their weight, so this costs the cells along box's edge,
+ * except for cells lazy mode left flagged, see quadtree_set_lazy_weight.
+ */
+unsigned int
+quadtree_count_bounds(quadtree_t *tree, quadtree_bounds_t *box) {
+        called_(tree, QUADTREE_CALL_COUNT_BOUNDS, box->nw->x, box->se->y, box->se->x, box->nw->y);
+        return count_bounds_(tree->root, box);
+}
+
+/*
+ * Point counts over a width x height raster laid on box, row major from the
+ * north west cell, into out_counts (width * height entries, zeroed first).
+ * Cells are half open except along the box's east and south edges. Returns
+ * the number of points binned.
+ *
+ * A tree cell inside box and inside one raster cell counts from its weight.
+ * Tree cells are closed, so one whose edge a raster line crosses or merely
+ * touches may hold points on either side and is walked down to its leaves,
+ * as are cells along box's edge and cells lazy mode left flagged. The cost
+ * is therefore the leaves along the width + height raster lines, about
+ * (width + height) * sqrt(n) for n evenly spread points, and every point
+ * once raster cells are no bigger than leaves.
+ */
+unsigned int
+quadtree_density_grid(quadtree_t *tree, quadtree_bounds_t *box, unsigned int width, unsigned int height,
+                      unsigned int *out_counts) {
+        density_grid_t grid;
+
+        if (tree->recorder != NULL) {
+                quadtree_record_begin(tree->recorder, QUADTREE_CALL_DENSITY_GRID);
+                record_box_(tree->recorder, box);
+                quadtree_record_arg(tree->recorder, width);
+                quadtree_record_arg(tree->recorder, height);
+                quadtree_record_end(tree->recorder);
+        }
+        if (width == 0 || height == 0)
+                return 0;
+        memset(out_counts, 0, sizeof(*out_counts) * width * height);
+        grid.box = box;
+        grid.width = width;
+        grid.height = height;
+        grid.counts = out_counts;
+        return density_grid_(&grid, tree->root);
+}
+
+/*
+ * Combines the aggregate of every point inside box into *out, starting from
+ * the identity. Returns the number of points combined.
+ */
+unsigned int
+quadtree_aggregate_bounds(quadtree_t *tree, quadtree_bounds_t *box, double *out) {
+        called_(tree, QUADTREE_CALL_AGGREGATE, box->nw->x, box->se->y, box->se->x, box->nw->y);
+        if (tree->aggregate == NULL)
+                return 0;
+        *out = tree->aggregate->identity;
+        return aggregate_bounds_(tree, tree->root, box, out);
+}
 
-        while (curr != NULL) {
-                next = curr->next;
-                free(curr);
-                curr = next;
-        }
+/* Call after changing what aggregate->init returns for node. */
+void
+quadtree_aggregate_refresh(quadtree_t *tree, quadtree_node_t *node) {
+        if (tree->aggregate != NULL)
+                refresh_aggregate_(tree, node);
 }
 
+/*
+ * A cell's loose bounds reach looseness times its size around its centre, so
+ * a box straddling a split line can still sink to a small cell. With the
+ * default of 2 any box no larger than a cell fits the cell holding its
+ * centre. Set it before inserting boxes.
+ */
 void
-quadtree_node_list_add(quadtree_node_list_t **list_p, quadtree_node_t *node) {
-        quadtree_node_list_t *new = quadtree_node_list_new(node);
-        new->next = *list_p;
-        *list_p = new;
+quadtree_set_looseness(quadtree_t *tree, double looseness) {
+        tree->looseness = looseness < 1 ? 1 : looseness;
 }
 
-int
-quadtree_insert(quadtree_t *tree, double x, double y, void *key, quadtree_node_t **node_p) {
-        quadtree_point_t *point;
-        int insert_status;
+/* Can the root hold object? Grows it if the tree is allowed to. */
+static int
+fit_root_(quadtree_t *tree, quadtree_object_t *object) {
+        if (!(object->nw.x <= object->se.x && object->se.y <= object->nw.y))
+                return 0;
+        if (loose_contains_(tree, tree->root, &object->box))
+                return 1;
+        return tree->auto_grow && grow_root_(tree, &object->nw) && grow_root_(tree, &object->se);
+}
 
-        /* backup container for node pointer if user doesn't provide one */
+/*
+ * Stores a box in the deepest cell whose loose bounds contain it. Boxes live
+ * next to the points in the same nodes, and a cell holding more than
+ * QUADTREE_NODE_OBJECTS of them splits like it would for points. Returns 1,
+ * -1 when out of memory and -2 when the box does not fit the root.
+ */
+int
+quadtree_insert_box(quadtree_t *tree, double minx, double miny, double maxx, double maxy, void *key,
+                    quadtree_object_t **object_p) {
+        quadtree_object_t *object;
         quadtree_node_t *node;
-        if (node_p == NULL) {
-                node_p = &node;
-        }
 
-        if (!(point = quadtree_point_new(x, y)))
+        if (!extend_(tree))
                 return -1;
-        if (!node_contains_(tree->root, point)) {
-                quadtree_point_free(point);
+        if (!(object = quadtree_alloc(tree->allocator, sizeof(*object))))
+                return -1;
+        object->key = key;
+        set_box_(object, minx, miny, maxx, maxy);
+        if (!fit_root_(tree, object)) {
+                quadtree_release(tree->allocator, object, sizeof(*object));
                 return -2;
         }
 
-        if (!(insert_status = insert_(tree, tree->root, point, key, node_p))) {
-                quadtree_point_free(point);
-                return -3;
+        node = place_(tree, tree->root, object);
+        attach_(node, object);
+        split_for_objects_(tree, node);
+        if (object_p != NULL)
+                *object_p = object;
+        return 1;
+}
+
+/*
+ * Update a box. It stays put while its cell is still the deepest fit,
+ * otherwise it climbs only as far as needed and sinks again from there.
+ * Returns 1, or -2 (box unchanged) if it no longer fits the root.
+ */
+int
+quadtree_move_box(quadtree_t *tree, quadtree_object_t *object, double minx, double miny, double maxx, double maxy) {
+        quadtree_node_t *from = object->node;
+        quadtree_node_t *node = from;
+        quadtree_point_t nw = object->nw;
+        quadtree_point_t se = object->se;
+
+        set_box_(object, minx, miny, maxx, maxy);
+        if (!(object->nw.x <= object->se.x && object->se.y <= object->nw.y)) {
+                set_box_(object, nw.x, se.y, se.x, nw.y);
+                return -2;
         }
-        if (insert_status == 1) {
-                tree->length++;
-                quadtree_node_t *child = *node_p;
-                while (child->parent != NULL) {
-                        child->parent->weight++;
-                        child = child->parent;
+        if (loose_contains_(tree, from, &object->box) &&
+            (!quadtree_node_ispointer(from) || fit_child_(tree, from, object) == NULL))
+                return 1;
+
+        while (node->parent != NULL && !loose_contains_(tree, node, &object->box))
+                node = node->parent;
+        if (!loose_contains_(tree, node, &object->box)) {
+                if (!fit_root_(tree, object)) {
+                        set_box_(object, nw.x, se.y, se.x, nw.y);
+                        return -2;
                 }
+                node = tree->root;
         }
 
-        return insert_status;
+        detach_(object);
+        node = place_(tree, node, object);
+        attach_(node, object);
+        prune_(tree, from);
+        split_for_objects_(tree, node);
+        return 1;
 }
 
-quadtree_point_t *
-quadtree_search(quadtree_t *tree, double x, double y) {
-        return find_(tree->root, x, y);
-}
+/* Drops a box, returns its key. */
+void *
+quadtree_remove_box(quadtree_t *tree, quadtree_object_t *object) {
+        quadtree_node_t *node = object->node;
+        void *key = object->key;
 
-quadtree_node_t *
-quadtree_node_search(quadtree_t *tree, double x, double y) {
-        return find_node_from_point_(tree->root, x, y);
+        detach_(object);
+        quadtree_release(tree->allocator, object, sizeof(*object));
+        prune_(tree, node);
+        return key;
 }
 
-quadtree_node_list_t *
-quadtree_search_bounds(quadtree_t *tree, double x, double y, double radius) {
-        /* Build box */
-        quadtree_point_t *top_left = quadtree_point_new(x - radius, y + radius);
-        if (top_left == NULL) {
-                return NULL;
-        }
-        quadtree_point_t *bottom_right = quadtree_point_new(x + radius, y - radius);
-        if (bottom_right == NULL) {
-                quadtree_point_free(top_left);
-                return NULL;
-        }
-        quadtree_bounds_t *box = quadtree_bounds_new();
-        if (box == NULL) {
-                quadtree_point_free(top_left);
-                quadtree_point_free(bottom_right);
-                return NULL;
-        }
-        box->nw = top_left;
-        box->se = bottom_right;
-
-        /* Will contain list of matching nodes */
-        quadtree_node_list_t *result = NULL;
-        search_bounds_(tree->root, box, &result);
-        quadtree_bounds_free(box);
+/* Boxes overlapping box, edges included. */
+quadtree_object_list_t *
+quadtree_search_overlap(quadtree_t *tree, quadtree_bounds_t *box) {
+        quadtree_object_list_t *result = NULL;
+        search_objects_(tree, tree->root, box, &result);
         return result;
 }
 
-quadtree_node_list_t *
-quadtree_search_bounds_include_partial(quadtree_t *tree, double x, double y, double radius) {
-        // TODO: error checking on valid bounds for map
-
-        /* Build box */
-        quadtree_point_t *top_left = quadtree_point_new(x - radius, y + radius);
-        if (top_left == NULL) {
-                return NULL;
-        }
-        quadtree_point_t *bottom_right = quadtree_point_new(x + radius, y - radius);
-        if (bottom_right == NULL) {
-                quadtree_point_free(top_left);
-                return NULL;
-        }
-        quadtree_bounds_t *box = quadtree_bounds_new();
-        if (box == NULL) {
-                quadtree_point_free(top_left);
-                quadtree_point_free(bottom_right);
-                return NULL;
+void
+quadtree_object_list_free(quadtree_object_list_t *list) {
+        quadtree_object_list_t *next;
+        for (; list != NULL; list = next) {
+                next = list->next;
+                quadtree_release(list->allocator, list, sizeof(*list));
         }
-        box->nw = top_left;
-        box->se = bottom_right;
-
-        /* Will contain list of matching nodes */
-        quadtree_node_list_t *result = NULL;
-        search_bounds_include_partial_(tree->root, box, &result);
-        quadtree_bounds_free(box);
-        return result;
 }
 
 void
 quadtree_free(quadtree_t *tree) {
+        quadtree_drop_ids(tree);
         if (tree->key_free != NULL) {
                 quadtree_node_free(tree->root, tree->key_free);
         } else {
                 quadtree_node_free(tree->root, elision_);
         }
-        free(tree);
+        quadtree_release(tree->allocator, tree->tidy.path, tree->tidy.capacity);
+        quadtree_release(tree->allocator, tree, sizeof(*tree));
 }
 
 void
 quadtree_walk(quadtree_node_t *root, void (*descent)(quadtree_node_t *node), void (*ascent)(quadtree_node_t *node)) {
+        quadtree_node_t *entry;
         (*descent)(root);
+        for (entry = next_entry_(root); entry != NULL; entry = next_entry_(entry)) {
+                (*descent)(entry);
+                (*ascent)(entry);
+        }
+        prefetch_children_(root);
         if (root->nw != NULL)
                 quadtree_walk(root->nw, descent, ascent);
         if (root->ne != NULL)
@@ -662,10 +2372,12 @@ quadtree_walk(quadtree_node_t *root, void (*descent)(quadtree_node_t *node), voi
         (*ascent)(root);
 }
 
-/* Call this on a leaf.
- * Assumes all siblings are empty. */
-static void
-condense_(quadtree_t *tree, quadtree_node_t *node) {
+/*
+ * Call this on a leaf. Assumes all siblings are empty.
+ * The leaf takes its parent's place and cell; returns the grandparent.
+ */
+static quadtree_node_t *
+lift_(quadtree_t *tree, quadtree_node_t *node) {
         assert(!quadtree_node_ispointer(node));
         quadtree_node_t *parent = node->parent;
         quadtree_node_t *gparent = parent->parent;
@@ -693,6 +2405,8 @@ condense_(quadtree_t *tree, quadtree_node_t *node) {
                 parent->se = NULL;
         }
 
+        TRACE_(QUADTREE_TRACE_CONDENSE, tree, node, 4);
+
         node->coord = parent->coord;
 
         switch (parent->coord) {
@@ -728,11 +2442,17 @@ condense_(quadtree_t *tree, quadtree_node_t *node) {
         node->sw = NULL;
         node->se = NULL;
 
-        if (gparent == NULL) {
+        if (gparent == NULL)
                 tree->root = node;
-        } else if (gparent->children_cnt == 1) {
+        return gparent;
+}
+
+/* lift_, then on up while the levels above are left with one child. */
+static void
+condense_(quadtree_t *tree, quadtree_node_t *node) {
+        quadtree_node_t *gparent = lift_(tree, node);
+        if (gparent != NULL && gparent->children_cnt == 1)
                 condense_parent(tree, gparent);
-        }
 }
 
 static void
@@ -741,22 +2461,24 @@ condense_parent(quadtree_t *tree, quadtree_node_t *parent) {
                 return;
         }
 
+        /* Cells holding boxes keep their shape. */
+        if (node_objects_(parent) != NULL || node_objects_(parent->nw) != NULL || node_objects_(parent->ne) != NULL ||
+            node_objects_(parent->sw) != NULL || node_objects_(parent->se) != NULL)
+                return;
+
         quadtree_node_t *last_child = NULL;
-        /* TODO: Rewrite lost code :( */
-        /* while (parent != NULL) { */
-        /*         /1* Parent replaces last child. *1/ */
-        /*         if (!quadtree_node_isempty(parent->nw)) */
-        /*                 last_child = parent->nw; */
-        /*         if (!quadtree_node_isempty(parent->ne)) */
-        /*                 last_child = parent->ne; */
-        /*         if (!quadtree_node_isempty(parent->sw)) */
-        /*                 last_child = parent->sw; */
-        /*         if (!quadtree_node_isempty(parent->se)) */
-        /*                 last_child = parent->se; */
-        /*         parent = last_child->parent; */
-        /* } */
+        /* Parent replaces last child. */
+        if (!quadtree_node_isempty(parent->nw))
+                last_child = parent->nw;
+        if (!quadtree_node_isempty(parent->ne))
+                last_child = parent->ne;
+        if (!quadtree_node_isempty(parent->sw))
+                last_child = parent->sw;
+        if (!quadtree_node_isempty(parent->se))
+                last_child = parent->se;
         assert(last_child != NULL);
-        if (quadtree_node_ispointer(last_child)) {
+        /* Buckets stay at the depth they filled up at. */
+        if (quadtree_node_ispointer(last_child) || next_entry_(last_child) != NULL) {
                 return;
         }
 
@@ -765,61 +2487,117 @@ condense_parent(quadtree_t *tree, quadtree_node_t *parent) {
 
 /*
  * Reset a leaf node into an empty node.
- * Returns key.
+ * Returns key. Without the tree this cannot keep weights or ids in step:
+ * trees handing out ids clear with quadtree_clear_leaf_with_condense.
  */
 void *
 quadtree_clear_leaf(quadtree_node_t *node) {
         void *key = node->key;
-        free(node->point);
+        quadtree_node_t *entry = node->bounds != NULL ? next_entry_(node) : NULL;
+
+        assert(node_id_(node) == 0 && (entry == NULL || node_id_(entry) == 0));
+        if (node->bounds == NULL) {
+                /* Overflow entry, drop it from its chain. */
+                unlink_overflow_(node);
+                quadtree_point_release(node_allocator_(node), node->point);
+                quadtree_node_release(node);
+                return key;
+        }
+
+        quadtree_point_release(node_allocator_(node), node->point);
         node->point = NULL;
         node->key = NULL;
 
+        /* Refill the leaf from its chain, the point keeps its time. */
+        if (entry != NULL) {
+                node->point = entry->point;
+                node->key = entry->key;
+                node->ext->time = entry->ext->time;
+                node->ext->overflow = entry->ext->overflow;
+                node->weight--;
+                quadtree_node_release(entry);
+        }
+
         return key;
 }
 
-/*
- * Reset a leaf node into an empty node.
- * Returns key.
- */
-void *
-quadtree_clear_leaf_with_condense(quadtree_t *tree, quadtree_node_t *node) {
+static void *
+clear_leaf_(quadtree_t *tree, quadtree_node_t *node) {
         void *key = node->key;
-        free(node->point);
+        double value = point_value_(tree, node);
+        quadtree_node_t *leaf;
+
+        release_id_(tree, node_id_(node));
+        set_id_(node, 0);
+
+        if (node->bounds == NULL) {
+                /* Overflow entry: the cell stays occupied by its leaf. */
+                unlink_overflow_(node);
+                add_weight_(tree, node, -1, value);
+                quadtree_point_release(node_allocator_(node), node->point);
+                quadtree_node_release(node);
+                tree->length--;
+                return key;
+        } else if (next_entry_(node) != NULL) {
+                leaf = promote_overflow_(tree, node);
+                if (tree->aggregate != NULL)
+                        leaf->ext->agg = recompute_aggregate_(tree, leaf);
+                add_weight_(tree, leaf, -1, value);
+                quadtree_point_release(node_allocator_(node), node->point);
+                quadtree_node_release(node);
+                tree->length--;
+                return key;
+        }
+
+        quadtree_point_release(node_allocator_(node), node->point);
         node->point = NULL;
         node->key = NULL;
         if (node->parent != NULL) {
-                dec_parent_cnt_with_weight(node);
+                dec_parent_cnt_with_weight(tree, node, value);
                 if (node->parent->children_cnt == 1) {
                         condense_parent(tree, node->parent);
+                } else if (node->parent->children_cnt == 0) {
+                        prune_(tree, node->parent);
                 }
         }
         tree->length--;
+        if (tree->auto_shrink)
+                shrink_root_(tree);
         return key;
 }
 
-void
-recalc_weight(quadtree_node_t *node, unsigned int weight_diff) {
-        while (node->parent != NULL) {
-                node->parent->weight -= weight_diff;
-                node = node->parent;
+/*
+ * Reset a leaf node into an empty node.
+ * Returns key.
+ */
+void *
+quadtree_clear_leaf_with_condense(quadtree_t *tree, quadtree_node_t *node) {
+        called_(tree, QUADTREE_CALL_CLEAR, node->point->x, node->point->y, 0, 0);
+        if (recording_(tree)) {
+                double args[2] = {node->point->x, node->point->y};
+                record_(tree, QUADTREE_WAL_CLEAR, args, 2, NULL);
         }
+        return clear_leaf_(tree, node);
 }
 
 /*
  * Cuts out subtree and recalcs the weight of the ancestor nodes.
  * Don't call this on root.
  */
-void
-quadtree_unlink_subtree(quadtree_t *destination_tree, quadtree_node_t *subtree_root) {
+static void
+unlink_subtree_(quadtree_t *destination_tree, quadtree_node_t *subtree_root) {
         assert(subtree_root->parent != NULL);
 
-        unsigned int weight_diff = subtree_root->weight;
+        unsigned int weight_diff = sync_weight_(destination_tree, subtree_root);
+        double value = destination_tree->aggregate != NULL ? node_aggregate_(destination_tree, subtree_root) : 0;
+
+        TRACE_(QUADTREE_TRACE_UNLINK_SUBTREE, destination_tree, subtree_root, weight_diff);
 
-        quadtree_node_t *filler_node = quadtree_node_new();
+        quadtree_node_t *filler_node =
+                quadtree_node_alloc_like(subtree_root, subtree_root->bounds->nw->x, subtree_root->bounds->se->y,
+                                         subtree_root->bounds->se->x, subtree_root->bounds->nw->y);
         filler_node->parent = subtree_root->parent;
         filler_node->coord = subtree_root->coord;
-        filler_node->bounds = quadtree_bounds_new_with_points(subtree_root->bounds->nw->x, subtree_root->bounds->se->y,
-                                                              subtree_root->bounds->se->x, subtree_root->bounds->nw->y);
 
         assert(quadtree_node_isempty(filler_node));
 
@@ -843,56 +2621,202 @@ quadtree_unlink_subtree(quadtree_t *destination_tree, quadtree_node_t *subtree_r
 
         subtree_root->parent = NULL;
         subtree_root->coord = NO_COORDINATE;
+        release_subtree_ids_(destination_tree, subtree_root);
 
         dec_parent_cnt(filler_node);
-        recalc_weight(filler_node, weight_diff);
+        add_weight_(destination_tree, filler_node, -(int)weight_diff, value);
+        destination_tree->length -= weight_diff;
         if (filler_node->parent->children_cnt == 1) {
                 condense_parent(destination_tree, filler_node->parent);
         }
+        if (destination_tree->auto_shrink)
+                shrink_root_(destination_tree);
+}
+
+void
+quadtree_unlink_subtree(quadtree_t *destination_tree, quadtree_node_t *subtree_root) {
+        quadtree_bounds_t *b = subtree_root->bounds;
+        called_(destination_tree, QUADTREE_CALL_UNLINK_SUBTREE, b->nw->x, b->se->y, b->se->x, b->nw->y);
+        if (recording_(destination_tree))
+                record_subtree_(destination_tree, QUADTREE_WAL_UNLINK, NULL, 0, subtree_root);
+        unlink_subtree_(destination_tree, subtree_root);
 }
 
 void
 quadtree_move_subtree(quadtree_t *destination_tree, quadtree_node_t *subtree_root) {
-        quadtree_unlink_subtree(destination_tree, subtree_root);
+        quadtree_bounds_t *b = subtree_root->bounds;
+        called_(destination_tree, QUADTREE_CALL_MOVE_SUBTREE, b->nw->x, b->se->y, b->se->x, b->nw->y);
+        if (recording_(destination_tree)) {
+                double head[4] = {b->nw->x, b->se->y, b->se->x, b->nw->y};
+                record_subtree_(destination_tree, QUADTREE_WAL_REROOT, head, 4, subtree_root);
+        }
+        unlink_subtree_(destination_tree, subtree_root);
         destination_tree->root = subtree_root;
+        destination_tree->length = node_count_(subtree_root);
 }
 
-int
-quadtree_move_leaf(quadtree_t *tree, quadtree_node_t **node_p, quadtree_point_t *point) {
-        int ret = 0;
-        void *key = NULL;
+/*
+ * Is cell the one a search for point descends to? Strictly inside it is. On
+ * an edge it shares with a neighbour only if every split above sends point
+ * its way, since searches, inserts and recovery all take that one path.
+ */
+static int
+owns_point_(quadtree_node_t *cell, quadtree_point_t *point) {
+        if (node_strictly_contains_(cell, point))
+                return 1;
+        for (; cell->parent != NULL; cell = cell->parent) {
+                if (get_quadrant_(cell->parent, point) != cell)
+                        return 0;
+        }
+        return node_contains_(cell, point);
+}
+
+static int
+move_leaf_(quadtree_t *tree, quadtree_node_t **node_p, quadtree_point_t *point) {
+        int ret = 0, owned;
         quadtree_node_t *node = *node_p;
+        quadtree_node_t *cell, *onto;
+        unsigned int id;
 
         if (tree == NULL || node == NULL || point == NULL) {
                 return -1;
         }
 
         assert(quadtree_node_isleaf(node));
-
-        if (node_contains_(node, point)) {
+        cell = leaf_cell_(node);
+
+        /* A bucket neighbour already on the point is replaced below, so that
+         * no two entries ever share a coordinate. A point on an edge another
+         * cell owns goes there, where an equal point would be. */
+        owned = owns_point_(cell, point);
+        onto = owned ? find_entry_(cell, point->x, point->y) : NULL;
+        if (owned && (onto == NULL || onto == node)) {
+                TRACE_(QUADTREE_TRACE_MOVE_INPLACE, tree, node, 1);
                 node->point->x = point->x;
                 node->point->y = point->y;
                 return 1;
-        } else if (node_contains_(node->parent, point)) {
-                ret = quadtree_insert(tree, point->x, point->y, key, node_p);
-                if (ret != 1) {
-                        printf("Insert returned %d, what do?\n", ret);
-                        return ret;
-                }
-                key = quadtree_clear_leaf_with_condense(tree, node);
-        } else {
-                key = quadtree_clear_leaf_with_condense(tree, node);
-                ret = quadtree_insert(tree, point->x, point->y, key, node_p);
-                if (ret != 1) {
-                        printf("Insert returned %d, what do?\n", ret);
-                        return ret;
-                }
         }
 
+        TRACE_(QUADTREE_TRACE_MOVE_RELOCATE, tree, node, 1);
+        /*
+         * Reinsert before clearing: the old cell is still there to start the
+         * finger search from, and condensing keeps the new leaf's struct.
+         * Keep the id out of the clear, it goes to the new node. Landing on
+         * another point replaces it, as an insert would: that point's key is
+         * freed and its id released, and the moving leaf still goes.
+         */
+        id = node_id_(node);
+        set_id_(node, 0);
+        ret = insert_at_(tree, cell, point->x, point->y, node_time_(node), node->key, node_p);
+        if (ret <= 0) {
+                *node_p = node;
+                set_id_(node, id);
+                return ret;
+        }
+        if (ret == 2) {
+                release_id_(tree, node_id_(*node_p));
+                set_id_(*node_p, 0);
+        }
+        clear_leaf_(tree, node);
+
         assert(quadtree_node_isleaf(*node_p));
+        set_id_(*node_p, id);
+        bind_id_(tree, *node_p);
+        return ret;
+}
+
+int
+quadtree_move_leaf(quadtree_t *tree, quadtree_node_t **node_p, quadtree_point_t *point) {
+        double args[4];
+        int ret;
+
+        if (tree != NULL && *node_p != NULL && point != NULL)
+                called_(tree, QUADTREE_CALL_MOVE_LEAF, (*node_p)->point->x, (*node_p)->point->y, point->x, point->y);
+        if (tree != NULL && recording_(tree) && *node_p != NULL && point != NULL) {
+                args[0] = (*node_p)->point->x;
+                args[1] = (*node_p)->point->y;
+                args[2] = point->x;
+                args[3] = point->y;
+        }
+        ret = move_leaf_(tree, node_p, point);
+        if (ret > 0 && recording_(tree))
+                record_(tree, QUADTREE_WAL_MOVE, args, 4, NULL);
+        return ret;
+}
+
+/*
+ * The id of the point at node, handing out a new one if it has none yet.
+ * Returns 0 when the table cannot grow.
+ */
+unsigned int
+quadtree_node_id(quadtree_t *tree, quadtree_node_t *node) {
+        if (node_id_(node) != 0)
+                return node_id_(node);
+        if (!reserve_id_(tree))
+                return 0;
+        return take_id_(tree, node);
+}
+
+/* The leaf or overflow entry holding the point, NULL for a released id. */
+quadtree_node_t *
+quadtree_node_by_id(quadtree_t *tree, unsigned int id) {
+        if (id == 0 || id > tree->ids.length)
+                return NULL;
+        return tree->ids.nodes[id - 1];
+}
+
+/*
+ * quadtree_insert that hands back an id instead of a node. Replacing a point
+ * keeps the id it already had.
+ */
+int
+quadtree_insert_id(quadtree_t *tree, double x, double y, void *key, unsigned int *id) {
+        quadtree_node_t *node;
+        int ret;
+
+        if (!reserve_id_(tree))
+                return -1;
+        if ((ret = quadtree_insert(tree, x, y, key, &node)) > 0 && id != NULL)
+                *id = quadtree_node_id(tree, node);
         return ret;
 }
 
+int
+quadtree_move_id(quadtree_t *tree, unsigned int id, quadtree_point_t *point) {
+        quadtree_node_t *node = quadtree_node_by_id(tree, id);
+        if (node == NULL)
+                return -1;
+        return quadtree_move_leaf(tree, &node, point);
+}
+
+/* Removes the point and releases its id. Returns its key. */
+void *
+quadtree_remove_id(quadtree_t *tree, unsigned int id) {
+        quadtree_node_t *node = quadtree_node_by_id(tree, id);
+        if (node == NULL)
+                return NULL;
+        return quadtree_clear_leaf_with_condense(tree, node);
+}
+
+/* Forgets every id the tree handed out and frees the table. */
+void
+quadtree_drop_ids(quadtree_t *tree) {
+        quadtree_id_table_t *ids = &tree->ids;
+        unsigned int i;
+
+        if (ids->capacity == 0)
+                return;
+        for (i = 0; i < ids->length; i++) {
+                if (ids->nodes[i] != NULL)
+                        ids->nodes[i]->ext->id = 0;
+        }
+        quadtree_release(tree->allocator, ids->nodes, sizeof(*ids->nodes) * ids->capacity);
+        quadtree_release(tree->allocator, ids->free, sizeof(*ids->free) * ids->capacity);
+        ids->nodes = NULL;
+        ids->free = NULL;
+        ids->length = ids->capacity = ids->free_length = 0;
+}
+
 quadtree_node_t *
 quadtree_find_max_weight_child(quadtree_node_t *node) {
         quadtree_node_t *max_child = node->nw;
@@ -913,9 +2837,256 @@ quadtree_find_optimal_split_quad(quadtree_t *tree) {
         // Quad where child_weight / tree->root->weight ~= optimal_weight
 
         current = tree->root;
-        while ((double)current->weight / tree->root->weight > optimal_weight_ratio) {
+        sync_weight_(tree, current);
+        while (quadtree_node_ispointer(current) &&
+               (double)current->weight / tree->root->weight > optimal_weight_ratio) {
                 current = quadtree_find_max_weight_child(current);
         }
         return current;
 }
 
+/*
+ * Tidying. Removals can leave pointer nodes with nothing under them
+ * (quadtree_clear_leaf never condenses) or with one leaf that could sit a
+ * level up, where condensing stopped at a bucket, a box or a pointer that
+ * only later thinned out. Such a node is degraded: a pointer with at most
+ * one occupied child, no boxes on it or its children, and the survivor, if
+ * any, a plain leaf. Visiting bottom up, a dead chain folds one level per
+ * node until its last point sits where an insert would have put it. Chains
+ * over two or more points are the tree's shape for them and stay. Repairs
+ * keep the leaf structs, so node handles and ids stay valid.
+ */
+static int
+repair_(quadtree_t *tree, quadtree_node_t *node) {
+        quadtree_node_t *quads[4];
+        quadtree_node_t *survivor = NULL;
+        unsigned int i, occupied = 0;
+
+        if (!quadtree_node_ispointer(node))
+                return 0;
+        quads[0] = node->nw;
+        quads[1] = node->ne;
+        quads[2] = node->sw;
+        quads[3] = node->se;
+        for (i = 0; i < 4; i++) {
+                if (!quadtree_node_isempty(quads[i])) {
+                        occupied++;
+                        survivor = quads[i];
+                }
+        }
+        /* quadtree_clear_leaf leaves the count behind, set it right while here. */
+        node->children_cnt = occupied;
+        if (occupied > 1 || node_objects_(node) != NULL)
+                return 0;
+        for (i = 0; i < 4; i++) {
+                if (node_objects_(quads[i]) != NULL)
+                        return 0;
+        }
+
+        if (survivor == NULL) {
+                for (i = 0; i < 4; i++)
+                        quadtree_node_free(quads[i], elision_);
+                node->nw = node->ne = node->sw = node->se = NULL;
+                node->weight = 0;
+                node->weight_dirty = 0;
+                if (node->parent != NULL)
+                        dec_parent_cnt(node);
+                return 1;
+        }
+        if (quadtree_node_ispointer(survivor) || next_entry_(survivor) != NULL)
+                return 0;
+        lift_(tree, survivor);
+        return 1;
+}
+
+static unsigned long
+elapsed_us_(struct timespec *start) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) * 1000000ul + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Room for a walk need levels deep, in the saved path and the node stack. */
+static int
+tidy_reserve_(quadtree_t *tree, quadtree_node_t ***nodes, unsigned int need) {
+        quadtree_tidy_state_t *state = &tree->tidy;
+        unsigned int capacity = state->capacity ? state->capacity : 32;
+        quadtree_node_t **grown;
+        unsigned char *path;
+
+        if (need <= state->capacity)
+                return 1;
+        while (capacity < need)
+                capacity *= 2;
+        if (!(grown = realloc(*nodes, sizeof(*grown) * capacity)))
+                return 0;
+        *nodes = grown;
+        if (!(path = quadtree_alloc(tree->allocator, capacity)))
+                return 0;
+        if (state->capacity > 0)
+                memcpy(path, state->path, state->capacity);
+        quadtree_release(tree->allocator, state->path, state->capacity);
+        state->path = path;
+        state->capacity = capacity;
+        return 1;
+}
+
+/*
+ * One bounded step of an incremental tidy-up pass, folding degraded nodes
+ * bottom up. Stops after about budget_us microseconds and picks up where it
+ * left off on the next call, following the saved path through whatever the
+ * tree has become since. Returns 1 when the pass completed (the next call
+ * starts a new one), 0 when there is more to do, -1 when out of memory.
+ *
+ * This is a writer: repairs free nodes and move cells in place, so no query
+ * may run during a step. Each step leaves the tree whole, so interleave
+ * steps with queries, or run them from a background thread under the lock
+ * the writers take, with the budget sized to what readers can wait.
+ */
+int
+quadtree_tidy(quadtree_t *tree, unsigned int budget_us) {
+        quadtree_tidy_state_t *state = &tree->tidy;
+        quadtree_node_t **nodes = NULL;
+        quadtree_node_t *node;
+        struct timespec start;
+        unsigned int length, steps = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!tidy_reserve_(tree, &nodes, 1)) {
+                free(nodes);
+                return -1;
+        }
+        /* The node stack always matches the path's capacity. */
+        if (nodes == NULL && !(nodes = malloc(sizeof(*nodes) * state->capacity)))
+                return -1;
+        if (state->length == 0) {
+                state->path[0] = 0;
+                state->length = 1;
+        }
+
+        /* Back down the saved path, as far as the tree still has it. */
+        nodes[0] = tree->root;
+        for (length = 1; length < state->length; length++) {
+                if (!quadtree_node_ispointer(nodes[length - 1]) || state->path[length - 1] == 0)
+                        break;
+                nodes[length] = get_child_(nodes[length - 1], state->path[length - 1] - 1);
+        }
+
+        while (length > 0) {
+                node = nodes[length - 1];
+                if (quadtree_node_ispointer(node) && state->path[length - 1] < 4) {
+                        if (!tidy_reserve_(tree, &nodes, length + 1)) {
+                                state->length = length;
+                                free(nodes);
+                                return -1;
+                        }
+                        nodes[length] = get_child_(node, state->path[length - 1]++);
+                        state->path[length++] = 0;
+                        continue;
+                }
+                state->repaired += repair_(tree, node);
+                length--;
+                if (++steps % 64 == 0 && elapsed_us_(&start) >= budget_us)
+                        break;
+        }
+        free(nodes);
+        state->length = length;
+        if (length > 0)
+                return 0;
+        if (tree->auto_shrink)
+                shrink_root_(tree);
+        return 1;
+}
+
+/*
+ * Expiry. The time ranges let one pass skip subtrees with nothing older than
+ * the cut and take whole chains and cells that are all older. Counts,
+ * weights, aggregates and ranges are rebuilt on the way back up, and cells
+ * left degraded are folded as quadtree_tidy does, so no point costs a
+ * walk up its ancestors.
+ */
+static void
+drop_point_(quadtree_t *tree, quadtree_node_t *node) {
+        release_id_(tree, node_id_(node));
+        set_id_(node, 0);
+        reset_node_(tree, node);
+        node->point = NULL;
+        node->key = NULL;
+}
+
+static unsigned int
+expire_leaf_(quadtree_t *tree, quadtree_node_t *leaf, double before) {
+        quadtree_node_t **it = leaf->ext != NULL ? &leaf->ext->overflow : NULL;
+        quadtree_node_t *entry;
+        unsigned int removed = 0;
+
+        /* A plain leaf has no chain to walk. */
+        while (it != NULL && (entry = *it) != NULL) {
+                if (entry->ext->time < before) {
+                        *it = entry->ext->overflow;
+                        drop_point_(tree, entry);
+                        quadtree_node_release(entry);
+                        removed++;
+                } else {
+                        it = &entry->ext->overflow;
+                }
+        }
+        leaf->weight -= removed;
+        if (node_time_(leaf) < before) {
+                removed++;
+                if (next_entry_(leaf) != NULL) {
+                        /* Same as quadtree_clear_leaf_with_condense, the cell goes to the chain. */
+                        entry = promote_overflow_(tree, leaf);
+                        drop_point_(tree, leaf);
+                        quadtree_node_release(leaf);
+                        leaf = entry;
+                } else {
+                        drop_point_(tree, leaf);
+                }
+        }
+        retime_(leaf);
+        if (tree->aggregate != NULL)
+                leaf->ext->agg = recompute_aggregate_(tree, leaf);
+        return removed;
+}
+
+/* Returns the points removed at or below node; node itself may be freed. */
+static unsigned int
+expire_(quadtree_t *tree, quadtree_node_t *node, double before) {
+        unsigned int removed = 0;
+
+        if (quadtree_node_isempty(node) || node_tmin_(node) >= before)
+                return 0;
+        if (quadtree_node_isleaf(node))
+                return expire_leaf_(tree, node, before);
+        prefetch_children_(node);
+        removed += expire_(tree, node->nw, before);
+        removed += expire_(tree, node->ne, before);
+        removed += expire_(tree, node->sw, before);
+        removed += expire_(tree, node->se, before);
+        node->weight -= removed;
+        retime_(node);
+        if (tree->aggregate != NULL)
+                node->ext->agg = recompute_aggregate_(tree, node);
+        repair_(tree, node);
+        return removed;
+}
+
+/*
+ * Removes every point timed before time, see quadtree_insert_at, freeing
+ * keys with key_free and releasing ids. Returns how many went.
+ */
+unsigned int
+quadtree_expire_before(quadtree_t *tree, double time) {
+        unsigned int removed;
+
+        if (tree->lazy_weight)
+                sync_weight_(tree, tree->root);
+        removed = expire_(tree, tree->root, time);
+        tree->length -= removed;
+        if (recording_(tree))
+                record_(tree, QUADTREE_WAL_EXPIRE, &time, 1, NULL);
+        if (tree->auto_shrink)
+                shrink_root_(tree);
+        return removed;
+}
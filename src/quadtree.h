@@ -8,6 +8,7 @@ extern "C" {
 #define QUADTREE_VERSION "0.0.1"
 
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef enum coordinate {
@@ -30,10 +31,80 @@ typedef struct quadtree_bounds {
         double height;
 } quadtree_bounds_t;
 
+/*
+ * Where a tree's memory comes from. alloc returns memory aligned for any
+ * type, or NULL; release is told the size that was asked for. A tree takes
+ * its nodes, points, bounds, boxes, id table and frozen block from it.
+ * Query results (node and object lists) and cursors always come from
+ * malloc, so that concurrent readers never call the allocator; they record
+ * malloc as their allocator for the free functions.
+ */
+typedef struct quadtree_allocator {
+        void *(*alloc)(void *ctx, size_t size);
+        void (*release)(void *ctx, void *ptr, size_t size);
+        void *ctx;
+} quadtree_allocator_t;
+
+extern const quadtree_allocator_t quadtree_malloc_allocator;
+
+/* Levels the range traversals prefetch ahead, see quadtree_set_prefetch_distance. */
+#ifndef QUADTREE_PREFETCH_DISTANCE
+#define QUADTREE_PREFETCH_DISTANCE 2
+#endif
+
+/* Lookups quadtree_search_batch keeps in flight at once. */
+#ifndef QUADTREE_BATCH_GROUP
+#define QUADTREE_BATCH_GROUP 16
+#endif
+
+/* Boxes a node may hold before it splits, see quadtree_insert_box. */
+#ifndef QUADTREE_NODE_OBJECTS
+#define QUADTREE_NODE_OBJECTS 8
+#endif
+
+typedef struct quadtree_object {
+        quadtree_point_t nw;
+        quadtree_point_t se;
+        quadtree_bounds_t box; /* points at nw and se */
+        void *key;
+        struct quadtree_node *node; /* holding it */
+        struct quadtree_object *next;
+} quadtree_object_t;
+
+typedef struct quadtree_object_list {
+        quadtree_object_t *object;
+        struct quadtree_object_list *next;
+        const quadtree_allocator_t *allocator;
+} quadtree_object_list_t;
+
+/*
+ * What a node holds only once its tree uses buckets, timestamps, ids, boxes,
+ * an aggregate or an allocator other than malloc. Such a tree gives every
+ * node one, a plain tree none: a node without it reads as no chain, no
+ * boxes, no id, time 0 and malloc.
+ */
+typedef struct quadtree_node_ext {
+        double agg;  /* aggregate of the points below, see quadtree_new_with_aggregate */
+        double time; /* the point's timestamp, see quadtree_insert_at */
+        /* Every timestamp below lies in [tmin, tmax]. Removals may leave the
+         * range wider than needed, quadtree_expire_before narrows it. */
+        double tmin;
+        double tmax;
+        /* Extra entries of a leaf that hit the depth limit. Entries have no
+         * bounds and their parent is the leaf holding the chain. */
+        struct quadtree_node *overflow;
+        /* Boxes whose deepest loose fit is this cell. */
+        quadtree_object_t *objects;
+        const quadtree_allocator_t *allocator;
+        unsigned int id; /* handle in the tree's id table, 0 if it has none */
+} quadtree_node_ext_t;
+
+/* 88 bytes on LP64, weight_dirty sits in what was padding. */
 typedef struct quadtree_node {
         coordinate_t coord;
         unsigned int children_cnt;
         unsigned int weight;
+        int weight_dirty; /* weight needs recomputing, see quadtree_set_lazy_weight */
         struct quadtree_node *parent;
         struct quadtree_node *ne;
         struct quadtree_node *nw;
@@ -42,25 +113,119 @@ typedef struct quadtree_node {
         quadtree_bounds_t *bounds;
         quadtree_point_t *point;
         void *key;
+        quadtree_node_ext_t *ext; /* NULL in a plain tree */
 } quadtree_node_t;
 
 typedef struct quadtree_node_list {
         quadtree_node_t *node;
         struct quadtree_node_list *next;
+        const quadtree_allocator_t *allocator;
 } quadtree_node_list_t;
 
+/*
+ * Lazy range iteration. The cursor climbs back up through parent links, so
+ * its whole state is this struct no matter how deep the tree is. Any
+ * mutation of the tree invalidates open cursors.
+ */
+typedef struct quadtree_cursor {
+        quadtree_node_t *top;
+        quadtree_node_t *node;  /* next node to visit */
+        quadtree_node_t *entry; /* next overflow entry to yield */
+        quadtree_point_t nw;
+        quadtree_point_t se;
+        quadtree_bounds_t box;
+        int bounded;
+        const quadtree_allocator_t *allocator;
+} quadtree_cursor_t;
+
+typedef struct quadtree_aggregate {
+        double identity;
+        double (*init)(quadtree_node_t *leaf);
+        double (*combine)(double a, double b);
+        double (*inverse)(double total, double removed); /* optional */
+} quadtree_aggregate_t;
+
+/*
+ * Stable handles for points. Slot id - 1 holds the leaf or overflow entry
+ * currently carrying the point, whatever splits, condensing and moves did to
+ * the node structs. Released ids are reused.
+ */
+typedef struct quadtree_id_table {
+        quadtree_node_t **nodes;
+        unsigned int *free; /* released ids, a stack */
+        unsigned int length;
+        unsigned int capacity;
+        unsigned int free_length;
+} quadtree_id_table_t;
+
+/* What a tree is built with, see quadtree_new_with_options. NULL fields take the default. */
+typedef struct quadtree_options {
+        const quadtree_allocator_t *allocator; /* malloc */
+        const quadtree_aggregate_t *aggregate; /* none */
+} quadtree_options_t;
+
+/*
+ * Where quadtree_tidy stopped: for each level from the root, the child
+ * to enter next. A path, not node pointers, so the tree may change between
+ * steps.
+ */
+typedef struct quadtree_tidy_state {
+        unsigned char *path;
+        unsigned int length;
+        unsigned int capacity;
+        unsigned long repaired; /* nodes repaired so far */
+} quadtree_tidy_state_t;
+
+typedef struct quadtree_wal quadtree_wal_t;           /* see quadtree_wal_open */
+typedef struct quadtree_feed quadtree_feed_t;         /* see quadtree_feed_new */
+typedef struct quadtree_recorder quadtree_recorder_t; /* see quadtree_record_start */
+
 typedef struct quadtree {
         quadtree_node_t *root;
         void (*key_free)(void *key);
         unsigned int length;
+        unsigned int max_depth; /* 0 for no limit */
+        double min_cell_size;   /* 0 for no limit */
+        int auto_grow;
+        int auto_shrink;
+        int lazy_weight;
+        const quadtree_aggregate_t *aggregate;
+        quadtree_id_table_t ids;
+        double looseness; /* box cells reach this many times their size */
+        const quadtree_allocator_t *allocator;
+        quadtree_tidy_state_t tidy;
+        quadtree_wal_t *wal;           /* NULL when not logging */
+        quadtree_feed_t *feed;         /* NULL when not feeding replicas */
+        quadtree_recorder_t *recorder; /* NULL when not recording calls */
 } quadtree_t;
 
+void *
+quadtree_alloc(const quadtree_allocator_t *allocator, size_t size);
+
+void
+quadtree_release(const quadtree_allocator_t *allocator, void *ptr, size_t size);
+
+quadtree_allocator_t *
+quadtree_hugepage_arena_new(size_t capacity);
+
+quadtree_allocator_t *
+quadtree_numa_arena_new(size_t capacity, int numa_node);
+
+void
+quadtree_arena_free(quadtree_allocator_t *allocator);
+
 quadtree_point_t *
 quadtree_point_new(double x, double y);
 
+quadtree_point_t *
+quadtree_point_alloc(const quadtree_allocator_t *allocator, double x, double y);
+
 void
 quadtree_point_free(quadtree_point_t *point);
 
+void
+quadtree_point_release(const quadtree_allocator_t *allocator, quadtree_point_t *point);
+
 quadtree_bounds_t *
 quadtree_bounds_new();
 
@@ -70,12 +235,36 @@ quadtree_bounds_new_with_points(double xmin, double ymin, double xmax, double ym
 void
 quadtree_bounds_extend(quadtree_bounds_t *bounds, double x, double y);
 
+quadtree_bounds_t *
+quadtree_bounds_alloc(const quadtree_allocator_t *allocator, double xmin, double ymin, double xmax, double ymax);
+
 void
 quadtree_bounds_free(quadtree_bounds_t *bounds);
 
+void
+quadtree_bounds_release(const quadtree_allocator_t *allocator, quadtree_bounds_t *bounds);
+
 quadtree_node_t *
 quadtree_node_new();
 
+quadtree_node_t *
+quadtree_node_alloc(const quadtree_allocator_t *allocator);
+
+quadtree_node_t *
+quadtree_node_alloc_ext(const quadtree_allocator_t *allocator, int ext);
+
+int
+quadtree_node_extend(quadtree_node_t *node);
+
+void
+quadtree_node_release(quadtree_node_t *node);
+
+quadtree_node_t *
+quadtree_node_next(quadtree_node_t *node);
+
+double
+quadtree_node_time(quadtree_node_t *node);
+
 void
 quadtree_node_free(quadtree_node_t *node, void (*value_free)(void *));
 
@@ -100,12 +289,43 @@ quadtree_clear_leaf(quadtree_node_t *node);
 void *
 quadtree_clear_leaf_with_condense(quadtree_t *tree, quadtree_node_t *node);
 
+void
+quadtree_unlink_subtree(quadtree_t *tree, quadtree_node_t *subtree_root);
+
+void
+quadtree_move_subtree(quadtree_t *tree, quadtree_node_t *subtree_root);
+
 int
 quadtree_move_leaf(quadtree_t *tree, quadtree_node_t **node, quadtree_point_t *point);
 
+unsigned int
+quadtree_node_id(quadtree_t *tree, quadtree_node_t *node);
+
+quadtree_node_t *
+quadtree_node_by_id(quadtree_t *tree, unsigned int id);
+
+int
+quadtree_insert_id(quadtree_t *tree, double x, double y, void *key, unsigned int *id);
+
+int
+quadtree_move_id(quadtree_t *tree, unsigned int id, quadtree_point_t *point);
+
+void *
+quadtree_remove_id(quadtree_t *tree, unsigned int id);
+
+void
+quadtree_drop_ids(quadtree_t *tree);
+
 quadtree_node_t *
 quadtree_node_with_bounds(double minx, double miny, double maxx, double maxy);
 
+quadtree_node_t *
+quadtree_node_alloc_with_bounds(const quadtree_allocator_t *allocator, double minx, double miny, double maxx,
+                                double maxy);
+
+quadtree_node_t *
+quadtree_node_alloc_like(quadtree_node_t *like, double minx, double miny, double maxx, double maxy);
+
 quadtree_node_list_t *
 quadtree_node_list_new(quadtree_node_t *node);
 
@@ -118,30 +338,462 @@ quadtree_node_list_add(quadtree_node_list_t **list_p, quadtree_node_t *node);
 quadtree_t *
 quadtree_new(double minx, double miny, double maxx, double maxy);
 
+quadtree_t *
+quadtree_new_with_allocator(double minx, double miny, double maxx, double maxy,
+                            const quadtree_allocator_t *allocator);
+
+quadtree_t *
+quadtree_new_with_aggregate(double minx, double miny, double maxx, double maxy,
+                            const quadtree_aggregate_t *aggregate);
+
+quadtree_t *
+quadtree_new_with_options(double minx, double miny, double maxx, double maxy, const quadtree_options_t *options);
+
 void
 quadtree_free(quadtree_t *tree);
 
+void
+quadtree_set_depth_limit(quadtree_t *tree, unsigned int max_depth, double min_cell_size);
+
+void
+quadtree_set_auto_grow(quadtree_t *tree, int grow, int shrink);
+
+void
+quadtree_set_lazy_weight(quadtree_t *tree, int lazy);
+
+void
+quadtree_set_prefetch_distance(unsigned int levels);
+
+void
+quadtree_sync_weights(quadtree_t *tree);
+
+void
+quadtree_sync_weights_in(quadtree_t *tree, quadtree_bounds_t *box);
+
 quadtree_point_t *
 quadtree_search(quadtree_t *tree, double x, double y);
 
 quadtree_node_t *
 quadtree_node_search(quadtree_t *tree, double x, double y);
 
+quadtree_point_t *
+quadtree_search_from(quadtree_t *tree, quadtree_node_t *hint, double x, double y);
+
+quadtree_node_t *
+quadtree_node_search_from(quadtree_t *tree, quadtree_node_t *hint, double x, double y);
+
+size_t
+quadtree_search_batch(quadtree_t *tree, const double *xs, const double *ys, size_t n, quadtree_node_t **out);
+
 quadtree_node_list_t *
 quadtree_search_bounds(quadtree_t *tree, double x, double y, double radius);
 
 quadtree_node_list_t *
 quadtree_search_bounds_include_partial(quadtree_t *tree, double x, double y, double radius);
 
+int
+quadtree_search_bounds_multi(quadtree_t *tree, quadtree_bounds_t *boxes, size_t n, quadtree_node_list_t **results);
+
+unsigned int
+quadtree_count_bounds(quadtree_t *tree, quadtree_bounds_t *box);
+
+unsigned int
+quadtree_density_grid(quadtree_t *tree, quadtree_bounds_t *box, unsigned int width, unsigned int height,
+                      unsigned int *out_counts);
+
+unsigned int
+quadtree_aggregate_bounds(quadtree_t *tree, quadtree_bounds_t *box, double *out);
+
+void
+quadtree_aggregate_refresh(quadtree_t *tree, quadtree_node_t *node);
+
+void
+quadtree_set_looseness(quadtree_t *tree, double looseness);
+
+int
+quadtree_insert_box(quadtree_t *tree, double minx, double miny, double maxx, double maxy, void *key,
+                    quadtree_object_t **object_p);
+
+int
+quadtree_move_box(quadtree_t *tree, quadtree_object_t *object, double minx, double miny, double maxx, double maxy);
+
+void *
+quadtree_remove_box(quadtree_t *tree, quadtree_object_t *object);
+
+quadtree_object_list_t *
+quadtree_search_overlap(quadtree_t *tree, quadtree_bounds_t *box);
+
+void
+quadtree_object_list_free(quadtree_object_list_t *list);
+
+quadtree_node_list_t *
+quadtree_search_polygon(quadtree_t *tree, const quadtree_point_t *vertices, size_t n);
+
+quadtree_node_list_t *
+quadtree_search_polyline(quadtree_t *tree, const quadtree_point_t *vertices, size_t n, double d);
+
 int
 quadtree_insert(quadtree_t *tree, double x, double y, void *key, quadtree_node_t **node_p);
 
+int
+quadtree_insert_from(quadtree_t *tree, quadtree_node_t *hint, double x, double y, void *key,
+                     quadtree_node_t **node_p);
+
+int
+quadtree_insert_at(quadtree_t *tree, double x, double y, double time, void *key, quadtree_node_t **node_p);
+
+unsigned int
+quadtree_expire_before(quadtree_t *tree, double time);
+
+quadtree_node_list_t *
+quadtree_search_window(quadtree_t *tree, quadtree_bounds_t *box, double from, double to);
+
 void
 quadtree_walk(quadtree_node_t *root, void (*descent)(quadtree_node_t *node), void (*ascent)(quadtree_node_t *node));
 
 quadtree_node_t *
 quadtree_find_optimal_split_quad(quadtree_t *tree);
 
+int
+quadtree_tidy(quadtree_t *tree, unsigned int budget_us);
+
+void
+quadtree_cursor_init(quadtree_cursor_t *cursor, quadtree_t *tree, quadtree_bounds_t *box);
+
+quadtree_cursor_t *
+quadtree_cursor_open(quadtree_t *tree, quadtree_bounds_t *box);
+
+quadtree_node_t *
+quadtree_cursor_next(quadtree_cursor_t *cursor);
+
+void
+quadtree_cursor_close(quadtree_cursor_t *cursor);
+
+/* Calls back once for every pair of points no further apart than d. */
+void
+quadtree_self_join(quadtree_t *tree, double d,
+                   void (*callback)(quadtree_node_t *a, quadtree_node_t *b, void *ctx), void *ctx);
+
+int
+quadtree_self_join_parallel(quadtree_t *tree, double d,
+                            void (*callback)(quadtree_node_t *a, quadtree_node_t *b, void *ctx), void *ctx,
+                            unsigned int threads);
+
+void
+quadtree_join(quadtree_t *tree_a, quadtree_t *tree_b,
+              int (*predicate)(quadtree_node_t *a, quadtree_node_t *b, double d, void *ctx), double d,
+              void (*callback)(quadtree_node_t *a, quadtree_node_t *b, void *ctx), void *ctx);
+
+/*
+ * Frozen trees. quadtree_freeze moves a finished tree into one block: 64 byte
+ * nodes in breadth first blocks, the four quadrants of a node next to each
+ * other and found by index, and the points in depth first order so that
+ * every subtree's points are one run of the points array.
+ *
+ * A frozen tree answers point, box, polygon and polyline searches, counts,
+ * aggregates and density grids. It keeps no node structs, parent links,
+ * timestamps, ids or boxes, so the queries built on those (node lists with
+ * partial cells, cursors and walks, joins, time windows, box overlap) stay
+ * with the live tree.
+ */
+typedef struct quadtree_frozen_node {
+        double minx;
+        double miny;
+        double maxx;
+        double maxy;
+        double agg;
+        uint32_t first; /* points below are points[first] .. points[first + count - 1] */
+        uint32_t count;
+        uint32_t child; /* first of the four quadrants, 0 for a leaf or empty node */
+        uint32_t pad_[3];
+} quadtree_frozen_node_t;
+
+typedef struct quadtree_frozen_point {
+        quadtree_point_t point;
+        void *key;
+} quadtree_frozen_point_t;
+
+typedef struct quadtree_frozen {
+        quadtree_frozen_node_t *nodes; /* nodes[0] is the root */
+        quadtree_frozen_point_t *points;
+        double *values; /* aggregate init of each point, NULL without aggregate */
+        size_t node_count;
+        unsigned int length;
+        void (*key_free)(void *key);
+        const quadtree_aggregate_t *aggregate;
+        const quadtree_allocator_t *allocator;
+        void *block; /* as allocated, nodes is aligned up from it */
+        size_t block_size;
+} quadtree_frozen_t;
+
+quadtree_frozen_t *
+quadtree_freeze(quadtree_t *tree);
+
+void
+quadtree_frozen_free(quadtree_frozen_t *frozen);
+
+const quadtree_frozen_point_t *
+quadtree_frozen_search(quadtree_frozen_t *frozen, double x, double y);
+
+unsigned int
+quadtree_frozen_search_bounds(quadtree_frozen_t *frozen, quadtree_bounds_t *box,
+                              void (*callback)(const quadtree_frozen_point_t *point, void *ctx), void *ctx);
+
+unsigned int
+quadtree_frozen_count_bounds(quadtree_frozen_t *frozen, quadtree_bounds_t *box);
+
+unsigned int
+quadtree_frozen_aggregate_bounds(quadtree_frozen_t *frozen, quadtree_bounds_t *box, double *out);
+
+unsigned int
+quadtree_frozen_density_grid(quadtree_frozen_t *frozen, quadtree_bounds_t *box, unsigned int width,
+                             unsigned int height, unsigned int *out_counts);
+
+unsigned int
+quadtree_frozen_search_polygon(quadtree_frozen_t *frozen, const quadtree_point_t *vertices, size_t n,
+                               void (*callback)(const quadtree_frozen_point_t *point, void *ctx), void *ctx);
+
+unsigned int
+quadtree_frozen_search_polyline(quadtree_frozen_t *frozen, const quadtree_point_t *vertices, size_t n, double d,
+                                void (*callback)(const quadtree_frozen_point_t *point, void *ctx), void *ctx);
+
+/*
+ * Event tracing. Build with -DQUADTREE_TRACE (make TRACE=1) to record hot path
+ * events into a per-thread ring buffer; without it every hook compiles away.
+ * Each record carries the depth of the node involved and a count:
+ *   INSERT          tree length after the insert
+ *   SPLIT           nodes allocated by the split
+ *   SWAP            always 1
+ *   MOVE_INPLACE    always 1
+ *   MOVE_RELOCATE   always 1, depth is the one the leaf left from
+ *   CONDENSE        nodes freed
+ *   UNLINK_SUBTREE  weight of the unlinked subtree
+ */
+#ifndef QUADTREE_TRACE_RING_SIZE
+#define QUADTREE_TRACE_RING_SIZE 65536 /* records per thread, power of two */
+#endif
+
+#define QUADTREE_TRACE_MAGIC "QTTR"
+#define QUADTREE_TRACE_FORMAT 1
+
+typedef enum quadtree_trace_event {
+        QUADTREE_TRACE_INSERT,
+        QUADTREE_TRACE_SPLIT,
+        QUADTREE_TRACE_SWAP,
+        QUADTREE_TRACE_MOVE_INPLACE,
+        QUADTREE_TRACE_MOVE_RELOCATE,
+        QUADTREE_TRACE_CONDENSE,
+        QUADTREE_TRACE_UNLINK_SUBTREE,
+} quadtree_trace_event_t;
+
+typedef struct quadtree_trace_header {
+        char magic[4];
+        uint16_t version;
+        uint16_t record_size;
+        uint64_t count;
+        double ticks_per_sec;
+} quadtree_trace_header_t;
+
+typedef struct quadtree_trace_record {
+        uint64_t timestamp;
+        uint16_t event;
+        uint16_t depth;
+        uint32_t count;
+} quadtree_trace_record_t;
+
+void
+quadtree_trace_emit(quadtree_trace_event_t event, unsigned int depth, unsigned int count);
+
+void
+quadtree_trace_enable(int enable);
+
+/* Empties every thread's ring. */
+void
+quadtree_trace_reset(void);
+
+/*
+ * Writes every thread's ring to path, merged oldest first, and empties them.
+ * Threads may keep tracing meanwhile: records one of them overwrote while
+ * its ring was copied are left out. Returns records written or -1.
+ */
+long
+quadtree_trace_drain(const char *path);
+
+/*
+ * Write-ahead log. A tree with a log attached appends every successful
+ * insert, move, clear, expiry and subtree unlink to an in-memory buffer; a
+ * background thread writes the buffer out, so on the calling thread logging
+ * is a copy under a lock. quadtree_snapshot writes the points compactly and
+ * restarts the log, quadtree_recover loads the snapshot and replays the log
+ * past it. Boxes, ids, aggregates and lazy weights are not logged. Keys are
+ * opaque to the tree: without a codec they are logged empty and recover as
+ * NULL. Moves and clears name their point by coordinate alone, which is
+ * exact: inserting or moving onto a coordinate replaces whatever was there,
+ * so a tree never holds two entries at one coordinate.
+ */
+#ifndef QUADTREE_WAL_BUFFER
+#define QUADTREE_WAL_BUFFER (1u << 20) /* bytes buffered before the writer is woken early */
+#endif
+
+#define QUADTREE_SNAPSHOT_MAGIC "QTSN"
+#define QUADTREE_SNAPSHOT_FORMAT 1
+
+typedef enum quadtree_wal_sync {
+        QUADTREE_WAL_SYNC_NEVER,    /* written every interval, on disk whenever the OS gets to it */
+        QUADTREE_WAL_SYNC_INTERVAL, /* written and fdatasync'd every interval: group commit */
+        QUADTREE_WAL_SYNC_ALWAYS,   /* written and fdatasync'd before the logged call returns */
+} quadtree_wal_sync_t;
+
+typedef enum quadtree_wal_op {
+        QUADTREE_WAL_ROOT,       /* minx, miny, maxx, maxy, max_depth, min_cell_size, auto_grow, auto_shrink */
+        QUADTREE_WAL_INSERT,     /* x, y, time and the key */
+        QUADTREE_WAL_MOVE,       /* from x, y to x, y */
+        QUADTREE_WAL_CLEAR,      /* x, y */
+        QUADTREE_WAL_EXPIRE,     /* time */
+        QUADTREE_WAL_UNLINK,     /* x, y of every point cut out */
+        QUADTREE_WAL_REROOT,     /* new root minx, miny, maxx, maxy, then x, y of every point kept */
+        QUADTREE_WAL_CHECKPOINT, /* none, the log restarted after a snapshot */
+} quadtree_wal_op_t;
+
+typedef struct quadtree_key_codec {
+        size_t (*size)(void *key);
+        void (*encode)(void *key, void *buf); /* writes size(key) bytes */
+        void *(*decode)(const void *buf, size_t size);
+        void (*free)(void *key); /* the recovered tree's key_free */
+} quadtree_key_codec_t;
+
+quadtree_wal_t *
+quadtree_wal_open(const char *path, quadtree_wal_sync_t sync, unsigned int interval_ms,
+                  const quadtree_key_codec_t *codec);
+
+void
+quadtree_wal_log(quadtree_wal_t *wal, quadtree_wal_op_t op, const double *args, unsigned int argc, void *key);
+
+void
+quadtree_wal_log_subtree(quadtree_wal_t *wal, quadtree_wal_op_t op, const double *head, unsigned int head_n,
+                         quadtree_node_t *subtree);
+
+int
+quadtree_wal_sync(quadtree_wal_t *wal);
+
+int
+quadtree_wal_close(quadtree_wal_t *wal);
+
+void
+quadtree_set_wal(quadtree_t *tree, quadtree_wal_t *wal);
+
+int
+quadtree_snapshot(quadtree_t *tree, const char *path, const quadtree_key_codec_t *codec);
+
+quadtree_t *
+quadtree_recover(const char *snapshot_path, const char *wal_path, const quadtree_key_codec_t *codec);
+
+quadtree_t *
+quadtree_recover_with_options(const char *snapshot_path, const char *wal_path, const quadtree_key_codec_t *codec,
+                              const quadtree_options_t *options);
+
+/*
+ * Change feed for read replicas. The same records as the log, numbered by
+ * version and kept in memory up to a byte budget. A replica pulls what it
+ * has not seen with quadtree_changes_since and applies it in one batch;
+ * one that fell behind the budget starts over from quadtree_feed_snapshot.
+ */
+quadtree_feed_t *
+quadtree_feed_new(size_t retain, const quadtree_key_codec_t *codec);
+
+void
+quadtree_feed_free(quadtree_feed_t *feed);
+
+void
+quadtree_feed_log(quadtree_feed_t *feed, quadtree_wal_op_t op, const double *args, unsigned int argc, void *key);
+
+void
+quadtree_feed_log_subtree(quadtree_feed_t *feed, quadtree_wal_op_t op, const double *head, unsigned int head_n,
+                          quadtree_node_t *subtree);
+
+uint64_t
+quadtree_feed_version(quadtree_feed_t *feed);
+
+void
+quadtree_set_feed(quadtree_t *tree, quadtree_feed_t *feed);
+
+long
+quadtree_changes_since(quadtree_feed_t *feed, uint64_t version, void **data, size_t *size);
+
+long
+quadtree_feed_snapshot(quadtree_feed_t *feed, quadtree_t *tree, void **data, size_t *size);
+
+long
+quadtree_apply_changes(quadtree_t **replica, uint64_t *version, const void *data, size_t size,
+                       const quadtree_key_codec_t *codec);
+
+/*
+ * Call recording, for replaying a real workload with bin/replay. While a
+ * tree is recorded every insert, search, count, density grid, aggregate,
+ * leaf move, clear and subtree unlink or move made on it is written to a
+ * file with the time it was called and the calling thread, after the tree's
+ * shape and a PRELOAD record for each point it already held. A call with
+ * more than four arguments continues in MORE records right after its own.
+ * Keys and aggregate functions are not recorded. Stop recording before
+ * freeing the tree.
+ */
+#define QUADTREE_RECORDING_MAGIC "QTRC"
+#define QUADTREE_RECORDING_FORMAT 2
+
+typedef enum quadtree_call {
+        QUADTREE_CALL_PRELOAD,         /* x, y, time of a point there before recording */
+        QUADTREE_CALL_INSERT,          /* x, y, time */
+        QUADTREE_CALL_SEARCH,          /* x, y */
+        QUADTREE_CALL_SEARCH_BOUNDS,   /* x, y, radius */
+        QUADTREE_CALL_SEARCH_PARTIAL,  /* x, y, radius of quadtree_search_bounds_include_partial */
+        QUADTREE_CALL_MOVE_LEAF,       /* from x, y to x, y */
+        QUADTREE_CALL_CLEAR,           /* x, y */
+        QUADTREE_CALL_UNLINK_SUBTREE,  /* subtree minx, miny, maxx, maxy */
+        QUADTREE_CALL_MOVE_SUBTREE,    /* subtree minx, miny, maxx, maxy */
+        QUADTREE_CALL_SEARCH_BATCH,    /* n, then n points as x, y */
+        QUADTREE_CALL_SEARCH_WINDOW,   /* from, to, 0 without a box or 1 and minx, miny, maxx, maxy */
+        QUADTREE_CALL_SEARCH_MULTI,    /* n, then n boxes as minx, miny, maxx, maxy */
+        QUADTREE_CALL_COUNT_BOUNDS,    /* minx, miny, maxx, maxy */
+        QUADTREE_CALL_DENSITY_GRID,    /* minx, miny, maxx, maxy, width, height */
+        QUADTREE_CALL_AGGREGATE,       /* minx, miny, maxx, maxy of quadtree_aggregate_bounds */
+        QUADTREE_CALL_SEARCH_POLYGON,  /* n, then n vertices as x, y */
+        QUADTREE_CALL_SEARCH_POLYLINE, /* d, n, then n vertices as x, y */
+        QUADTREE_CALL_MORE,            /* four more arguments of the call before */
+} quadtree_call_t;
+
+typedef struct quadtree_recording_header {
+        char magic[4];
+        uint16_t version;
+        uint16_t record_size;
+        /* minx, miny, maxx, maxy, max_depth, min_cell_size, auto_grow, auto_shrink, has an aggregate */
+        double shape[9];
+} quadtree_recording_header_t;
+
+typedef struct quadtree_recording_record {
+        uint64_t ns; /* since recording started */
+        uint32_t call;
+        uint32_t thread; /* numbered from 1 in order of first call */
+        double args[4];
+} quadtree_recording_record_t;
+
+int
+quadtree_record_start(quadtree_t *tree, const char *path);
+
+int
+quadtree_record_stop(quadtree_t *tree);
+
+void
+quadtree_record_call(quadtree_recorder_t *recorder, quadtree_call_t call, double a, double b, double c, double d);
+
+void
+quadtree_record_begin(quadtree_recorder_t *recorder, quadtree_call_t call);
+
+void
+quadtree_record_arg(quadtree_recorder_t *recorder, double value);
+
+void
+quadtree_record_end(quadtree_recorder_t *recorder);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,404 @@
+#ifndef __QUADTREE_HPP__
+#define __QUADTREE_HPP__
+
+/*
+ * Header only C++ quadtree. Same shape as the C tree (nw, ne, sw, se cells,
+ * a point per coordinate pair, weights for counting) but typed: values live
+ * in the leaves instead of behind a void *, coordinates may be any arithmetic
+ * type, and visitors are template arguments so lambdas inline into the walk.
+ * Leaves hold up to LeafCapacity points before splitting; past max_depth
+ * they keep growing instead. The C API in quadtree.h is unaffected.
+ */
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace qt {
+
+template <typename T, typename Coord = double, std::size_t LeafCapacity = 8>
+class quadtree {
+        static_assert(std::is_arithmetic<Coord>::value, "Coord must be arithmetic");
+        static_assert(LeafCapacity > 0 && LeafCapacity < 256, "LeafCapacity must fit a leaf's count");
+
+    public:
+        struct entry {
+                Coord x;
+                Coord y;
+                T value;
+        };
+
+        struct box {
+                Coord minx;
+                Coord miny;
+                Coord maxx;
+                Coord maxy;
+
+                bool
+                contains(Coord x, Coord y) const {
+                        return minx <= x && x <= maxx && miny <= y && y <= maxy;
+                }
+
+                bool
+                contains(const box &other) const {
+                        return minx <= other.minx && other.maxx <= maxx && miny <= other.miny && other.maxy <= maxy;
+                }
+
+                bool
+                overlaps(const box &other) const {
+                        return minx <= other.maxx && other.minx <= maxx && miny <= other.maxy && other.miny <= maxy;
+                }
+        };
+
+        /* Same meaning as the C quadtree_insert return values. */
+        enum insert_status {
+                out_of_range = -2,
+                inserted = 1,
+                replaced = 2,
+        };
+
+        quadtree(Coord minx, Coord miny, Coord maxx, Coord maxy, unsigned int max_depth = 24)
+                : root_(new node(box{minx, miny, maxx, maxy})), length_(0), max_depth_(max_depth) {
+        }
+
+        quadtree(const quadtree &) = delete;
+        quadtree &
+        operator=(const quadtree &) = delete;
+
+        /* A moved from tree may only be assigned to or destroyed. */
+        quadtree(quadtree &&other) noexcept
+                : root_(std::move(other.root_)), length_(other.length_), max_depth_(other.max_depth_) {
+                other.length_ = 0;
+        }
+
+        quadtree &
+        operator=(quadtree &&other) noexcept {
+                root_ = std::move(other.root_);
+                length_ = other.length_;
+                max_depth_ = other.max_depth_;
+                other.length_ = 0;
+                return *this;
+        }
+
+        std::size_t
+        size() const {
+                return length_;
+        }
+
+        bool
+        empty() const {
+                return length_ == 0;
+        }
+
+        const box &
+        bounds() const {
+                return root_->bounds;
+        }
+
+        /* A point already at (x, y) gets its value replaced. */
+        template <typename V>
+        insert_status
+        insert(Coord x, Coord y, V &&value) {
+                if (!root_->bounds.contains(x, y))
+                        return out_of_range;
+                insert_status status = insert_(root_.get(), 0, x, y, std::forward<V>(value));
+                length_ += status == inserted;
+                return status;
+        }
+
+        T *
+        find(Coord x, Coord y) {
+                node *n = root_.get();
+                if (!n->bounds.contains(x, y))
+                        return nullptr;
+                while (n->children != nullptr)
+                        n = &n->children[n->quadrant(x, y)];
+                entry *e = n->find(x, y);
+                return e != nullptr ? &e->value : nullptr;
+        }
+
+        const T *
+        find(Coord x, Coord y) const {
+                return const_cast<quadtree *>(this)->find(x, y);
+        }
+
+        /* Returns whether there was a point at (x, y). */
+        bool
+        remove(Coord x, Coord y) {
+                if (!root_->bounds.contains(x, y) || !remove_(root_.get(), x, y))
+                        return false;
+                length_--;
+                return true;
+        }
+
+        void
+        clear() {
+                root_.reset(new node(root_->bounds));
+                length_ = 0;
+        }
+
+        /* Calls visit(x, y, value) for every point in query, edges included. */
+        template <typename Visitor>
+        void
+        search(const box &query, Visitor &&visit) {
+                search_(root_.get(), query, visit);
+        }
+
+        template <typename Visitor>
+        void
+        search(const box &query, Visitor &&visit) const {
+                search_(static_cast<const node *>(root_.get()), query, visit);
+        }
+
+        template <typename Visitor>
+        void
+        for_each(Visitor &&visit) {
+                all_(root_.get(), visit);
+        }
+
+        template <typename Visitor>
+        void
+        for_each(Visitor &&visit) const {
+                all_(static_cast<const node *>(root_.get()), visit);
+        }
+
+        /* Subtrees fully inside query are counted from their weight. */
+        std::size_t
+        count(const box &query) const {
+                return count_(root_.get(), query);
+        }
+
+    private:
+        struct node {
+                box bounds;
+                std::size_t weight; /* points below */
+                node *children;     /* nw, ne, sw, se side by side, or nullptr for a leaf */
+                unsigned char count;
+                alignas(entry) unsigned char slots[sizeof(entry) * LeafCapacity];
+                std::vector<entry> spill; /* past max_depth only */
+
+                node() : weight(0), children(nullptr), count(0) {
+                }
+
+                explicit node(const box &b) : bounds(b), weight(0), children(nullptr), count(0) {
+                }
+
+                ~node() {
+                        drop_entries();
+                        delete[] children;
+                }
+
+                node(const node &) = delete;
+                node &
+                operator=(const node &) = delete;
+
+                entry *
+                entries() {
+                        return reinterpret_cast<entry *>(slots);
+                }
+
+                const entry *
+                entries() const {
+                        return reinterpret_cast<const entry *>(slots);
+                }
+
+                template <typename V>
+                void
+                add(Coord x, Coord y, V &&value) {
+                        if (count < LeafCapacity)
+                                new (&entries()[count++]) entry{x, y, std::forward<V>(value)};
+                        else
+                                spill.push_back(entry{x, y, std::forward<V>(value)});
+                }
+
+                entry *
+                find(Coord x, Coord y) {
+                        for (unsigned int i = 0; i < count; i++) {
+                                if (entries()[i].x == x && entries()[i].y == y)
+                                        return &entries()[i];
+                        }
+                        for (entry &e : spill) {
+                                if (e.x == x && e.y == y)
+                                        return &e;
+                        }
+                        return nullptr;
+                }
+
+                /* Moves the last entry into the hole, order is not kept. */
+                void
+                erase(entry *e) {
+                        entry *last = spill.empty() ? &entries()[count - 1] : &spill.back();
+                        if (e != last)
+                                *e = std::move(*last);
+                        if (spill.empty())
+                                entries()[--count].~entry();
+                        else
+                                spill.pop_back();
+                }
+
+                void
+                drop_entries() {
+                        for (unsigned int i = 0; i < count; i++)
+                                entries()[i].~entry();
+                        count = 0;
+                        spill.clear();
+                }
+
+                unsigned int
+                quadrant(Coord x, Coord y) const {
+                        return (x >= midx()) + 2 * (y < midy());
+                }
+
+                Coord
+                midx() const {
+                        return bounds.minx + (bounds.maxx - bounds.minx) / 2;
+                }
+
+                Coord
+                midy() const {
+                        return bounds.miny + (bounds.maxy - bounds.miny) / 2;
+                }
+
+                void
+                subdivide() {
+                        Coord mx = midx(), my = midy();
+                        children = new node[4];
+                        children[0].bounds = box{bounds.minx, my, mx, bounds.maxy};
+                        children[1].bounds = box{mx, my, bounds.maxx, bounds.maxy};
+                        children[2].bounds = box{bounds.minx, bounds.miny, mx, my};
+                        children[3].bounds = box{mx, bounds.miny, bounds.maxx, my};
+                        for (unsigned int i = 0; i < count; i++) {
+                                entry &e = entries()[i];
+                                node &child = children[quadrant(e.x, e.y)];
+                                child.add(e.x, e.y, std::move(e.value));
+                                child.weight++;
+                        }
+                        drop_entries();
+                }
+
+                /* Pulls a subtree that fits a leaf back into this node. */
+                void
+                absorb(node *from) {
+                        if (from->children != nullptr) {
+                                for (unsigned int i = 0; i < 4; i++)
+                                        absorb(&from->children[i]);
+                                return;
+                        }
+                        for (unsigned int i = 0; i < from->count; i++)
+                                add(from->entries()[i].x, from->entries()[i].y, std::move(from->entries()[i].value));
+                        for (entry &e : from->spill)
+                                add(e.x, e.y, std::move(e.value));
+                }
+        };
+
+        template <typename V>
+        insert_status
+        insert_(node *n, unsigned int depth, Coord x, Coord y, V &&value) {
+                if (n->children == nullptr) {
+                        entry *e = n->find(x, y);
+                        if (e != nullptr) {
+                                e->value = std::forward<V>(value);
+                                return replaced;
+                        }
+                        if (n->count < LeafCapacity || depth >= max_depth_) {
+                                n->add(x, y, std::forward<V>(value));
+                                n->weight++;
+                                return inserted;
+                        }
+                        n->subdivide();
+                }
+                insert_status status = insert_(&n->children[n->quadrant(x, y)], depth + 1, x, y, std::forward<V>(value));
+                n->weight += status == inserted;
+                return status;
+        }
+
+        bool
+        remove_(node *n, Coord x, Coord y) {
+                if (n->children == nullptr) {
+                        entry *e = n->find(x, y);
+                        if (e == nullptr)
+                                return false;
+                        n->erase(e);
+                        n->weight--;
+                        return true;
+                }
+                if (!remove_(&n->children[n->quadrant(x, y)], x, y))
+                        return false;
+                if (--n->weight <= LeafCapacity) {
+                        node *children = n->children;
+                        n->children = nullptr;
+                        for (unsigned int i = 0; i < 4; i++)
+                                n->absorb(&children[i]);
+                        delete[] children;
+                }
+                return true;
+        }
+
+        template <typename Node, typename Visitor>
+        static void
+        leaf_(Node *n, const box *query, Visitor &visit) {
+                for (unsigned int i = 0; i < n->count; i++) {
+                        auto &e = n->entries()[i];
+                        if (query == nullptr || query->contains(e.x, e.y))
+                                visit(e.x, e.y, e.value);
+                }
+                for (auto &e : n->spill) {
+                        if (query == nullptr || query->contains(e.x, e.y))
+                                visit(e.x, e.y, e.value);
+                }
+        }
+
+        template <typename Node, typename Visitor>
+        static void
+        all_(Node *n, Visitor &visit) {
+                if (n->children == nullptr) {
+                        leaf_(n, nullptr, visit);
+                        return;
+                }
+                for (unsigned int i = 0; i < 4; i++)
+                        all_(&n->children[i], visit);
+        }
+
+        template <typename Node, typename Visitor>
+        static void
+        search_(Node *n, const box &query, Visitor &visit) {
+                if (n->weight == 0 || !query.overlaps(n->bounds))
+                        return;
+                if (query.contains(n->bounds)) {
+                        all_(n, visit);
+                } else if (n->children == nullptr) {
+                        leaf_(n, &query, visit);
+                } else {
+                        for (unsigned int i = 0; i < 4; i++)
+                                search_(&n->children[i], query, visit);
+                }
+        }
+
+        static std::size_t
+        count_(const node *n, const box &query) {
+                std::size_t total = 0;
+                if (n->weight == 0 || !query.overlaps(n->bounds))
+                        return 0;
+                if (query.contains(n->bounds))
+                        return n->weight;
+                if (n->children == nullptr) {
+                        auto tally = [&total](Coord, Coord, const T &) { total++; };
+                        leaf_(n, &query, tally);
+                        return total;
+                }
+                for (unsigned int i = 0; i < 4; i++)
+                        total += count_(&n->children[i], query);
+                return total;
+        }
+
+        std::unique_ptr<node> root_;
+        std::size_t length_;
+        unsigned int max_depth_;
+};
+
+} // namespace qt
+
+#endif
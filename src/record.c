@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "quadtree.h"
+#include "ext.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Records go through stdio under the recorder's lock, in the order the
+ * calls took it. A write error sticks and quadtree_record_stop reports it.
+ */
+struct quadtree_recorder {
+        FILE *fp;
+        struct timespec epoch;
+        pthread_mutex_t lock;
+        int failed;
+        quadtree_recording_record_t pending; /* between begin and end */
+        unsigned int filled;                 /* arguments in pending */
+};
+
+static pthread_mutex_t threads_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t threads_;
+static __thread uint32_t thread_;
+
+static uint32_t
+thread_id_(void) {
+        if (thread_ == 0) {
+                pthread_mutex_lock(&threads_lock_);
+                thread_ = ++threads_;
+                pthread_mutex_unlock(&threads_lock_);
+        }
+        return thread_;
+}
+
+static uint64_t
+since_(struct timespec *epoch) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)(ts.tv_sec - epoch->tv_sec) * 1000000000ull + ts.tv_nsec - epoch->tv_nsec;
+}
+
+static void
+put_(quadtree_recorder_t *recorder, uint64_t ns, quadtree_call_t call, double a, double b, double c, double d) {
+        quadtree_recording_record_t rec;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.ns = ns;
+        rec.call = call;
+        rec.thread = thread_id_();
+        rec.args[0] = a;
+        rec.args[1] = b;
+        rec.args[2] = c;
+        rec.args[3] = d;
+        recorder->failed |= fwrite(&rec, sizeof(rec), 1, recorder->fp) != 1;
+}
+
+static void
+preload_(quadtree_recorder_t *recorder, quadtree_node_t *node) {
+        quadtree_node_t *entry;
+        if (quadtree_node_ispointer(node)) {
+                preload_(recorder, node->nw);
+                preload_(recorder, node->ne);
+                preload_(recorder, node->sw);
+                preload_(recorder, node->se);
+                return;
+        }
+        for (entry = node; quadtree_node_isleaf(node) && entry != NULL; entry = next_entry_(entry))
+                put_(recorder, 0, QUADTREE_CALL_PRELOAD, entry->point->x, entry->point->y, node_time_(entry), 0);
+}
+
+/*
+ * Starts recording the calls made on tree to a new file at path. Returns 0,
+ * or -1 if the file cannot be written or tree is already recorded.
+ */
+int
+quadtree_record_start(quadtree_t *tree, const char *path) {
+        quadtree_recording_header_t header;
+        quadtree_recorder_t *recorder;
+        quadtree_bounds_t *b = tree->root->bounds;
+
+        if (tree->recorder != NULL || !(recorder = calloc(1, sizeof(*recorder))))
+                return -1;
+        if (!(recorder->fp = fopen(path, "wb"))) {
+                free(recorder);
+                return -1;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, QUADTREE_RECORDING_MAGIC, sizeof(header.magic));
+        header.version = QUADTREE_RECORDING_FORMAT;
+        header.record_size = sizeof(quadtree_recording_record_t);
+        header.shape[0] = b->nw->x;
+        header.shape[1] = b->se->y;
+        header.shape[2] = b->se->x;
+        header.shape[3] = b->nw->y;
+        header.shape[4] = tree->max_depth;
+        header.shape[5] = tree->min_cell_size;
+        header.shape[6] = tree->auto_grow;
+        header.shape[7] = tree->auto_shrink;
+        header.shape[8] = tree->aggregate != NULL;
+        recorder->failed = fwrite(&header, sizeof(header), 1, recorder->fp) != 1;
+        preload_(recorder, tree->root);
+        pthread_mutex_init(&recorder->lock, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &recorder->epoch);
+        tree->recorder = recorder;
+        return 0;
+}
+
+/* Stops recording and closes the file. Returns -1 if any of it was not written. */
+int
+quadtree_record_stop(quadtree_t *tree) {
+        quadtree_recorder_t *recorder = tree->recorder;
+        int failed;
+
+        if (recorder == NULL)
+                return -1;
+        tree->recorder = NULL;
+        failed = fclose(recorder->fp) != 0 || recorder->failed;
+        pthread_mutex_destroy(&recorder->lock);
+        free(recorder);
+        return failed ? -1 : 0;
+}
+
+void
+quadtree_record_call(quadtree_recorder_t *recorder, quadtree_call_t call, double a, double b, double c, double d) {
+        pthread_mutex_lock(&recorder->lock);
+        put_(recorder, since_(&recorder->epoch), call, a, b, c, d);
+        pthread_mutex_unlock(&recorder->lock);
+}
+
+/*
+ * Calls with more than four arguments: begin, one quadtree_record_arg per
+ * value, then end. Values past the fourth go to MORE records, and the lock
+ * is held throughout so that nothing lands between them.
+ */
+void
+quadtree_record_begin(quadtree_recorder_t *recorder, quadtree_call_t call) {
+        pthread_mutex_lock(&recorder->lock);
+        memset(&recorder->pending, 0, sizeof(recorder->pending));
+        recorder->pending.ns = since_(&recorder->epoch);
+        recorder->pending.call = call;
+        recorder->pending.thread = thread_id_();
+        recorder->filled = 0;
+}
+
+void
+quadtree_record_arg(quadtree_recorder_t *recorder, double value) {
+        quadtree_recording_record_t *rec = &recorder->pending;
+
+        if (recorder->filled == 4) {
+                recorder->failed |= fwrite(rec, sizeof(*rec), 1, recorder->fp) != 1;
+                memset(rec->args, 0, sizeof(rec->args));
+                rec->call = QUADTREE_CALL_MORE;
+                recorder->filled = 0;
+        }
+        rec->args[recorder->filled++] = value;
+}
+
+void
+quadtree_record_end(quadtree_recorder_t *recorder) {
+        recorder->failed |= fwrite(&recorder->pending, sizeof(recorder->pending), 1, recorder->fp) != 1;
+        pthread_mutex_unlock(&recorder->lock);
+}
@@ -0,0 +1,335 @@
+#include "quadtree.h"
+#include "ext.h"
+
+/* How a node's cell relates to the query region. */
+typedef enum region_class {
+        OUTSIDE,
+        INSIDE,
+        CROSSING,
+} region_class_t;
+
+typedef struct region {
+        const quadtree_point_t *vertices;
+        size_t n;
+        double d2; /* polyline only */
+        region_class_t (*classify)(struct region *region, quadtree_bounds_t *bounds);
+        int (*contains)(struct region *region, quadtree_point_t *point);
+} region_t;
+
+/* Liang-Barsky: does segment a-b touch the closed box? */
+static int
+segment_hits_bounds_(const quadtree_point_t *a, const quadtree_point_t *b, quadtree_bounds_t *bounds) {
+        double t0 = 0, t1 = 1;
+        double dx = b->x - a->x;
+        double dy = b->y - a->y;
+        double p[4] = {-dx, dx, -dy, dy};
+        double q[4] = {a->x - bounds->nw->x, bounds->se->x - a->x, a->y - bounds->se->y, bounds->nw->y - a->y};
+        int i;
+
+        for (i = 0; i < 4; i++) {
+                if (p[i] == 0) {
+                        if (q[i] < 0)
+                                return 0;
+                } else {
+                        double t = q[i] / p[i];
+                        if (p[i] < 0) {
+                                if (t > t1)
+                                        return 0;
+                                if (t > t0)
+                                        t0 = t;
+                        } else {
+                                if (t < t0)
+                                        return 0;
+                                if (t < t1)
+                                        t1 = t;
+                        }
+                }
+        }
+        return 1;
+}
+
+static double
+point_segment_dist2_(const quadtree_point_t *p, const quadtree_point_t *a, const quadtree_point_t *b) {
+        double dx = b->x - a->x;
+        double dy = b->y - a->y;
+        double len2 = dx * dx + dy * dy;
+        double t = len2 > 0 ? ((p->x - a->x) * dx + (p->y - a->y) * dy) / len2 : 0;
+        t = t < 0 ? 0 : t > 1 ? 1 : t;
+        dx = a->x + t * dx - p->x;
+        dy = a->y + t * dy - p->y;
+        return dx * dx + dy * dy;
+}
+
+static double
+point_bounds_dist2_(const quadtree_point_t *p, quadtree_bounds_t *bounds) {
+        double dx = fmax(0, fmax(bounds->nw->x - p->x, p->x - bounds->se->x));
+        double dy = fmax(0, fmax(bounds->se->y - p->y, p->y - bounds->nw->y));
+        return dx * dx + dy * dy;
+}
+
+static void
+corners_(quadtree_bounds_t *bounds, quadtree_point_t corners[4]) {
+        corners[0] = *bounds->nw;
+        corners[1].x = bounds->se->x;
+        corners[1].y = bounds->nw->y;
+        corners[2].x = bounds->nw->x;
+        corners[2].y = bounds->se->y;
+        corners[3] = *bounds->se;
+}
+
+/* polygon */
+
+/* Even-odd crossing test. */
+static int
+polygon_contains_(region_t *region, quadtree_point_t *point) {
+        const quadtree_point_t *v = region->vertices;
+        size_t i, j;
+        int inside = 0;
+
+        for (i = 0, j = region->n - 1; i < region->n; j = i++) {
+                if ((v[i].y > point->y) != (v[j].y > point->y) &&
+                    point->x < (v[j].x - v[i].x) * (point->y - v[i].y) / (v[j].y - v[i].y) + v[i].x)
+                        inside = !inside;
+        }
+        return inside;
+}
+
+static region_class_t
+polygon_classify_(region_t *region, quadtree_bounds_t *bounds) {
+        const quadtree_point_t *v = region->vertices;
+        quadtree_point_t center;
+        size_t i, j;
+
+        for (i = 0, j = region->n - 1; i < region->n; j = i++) {
+                if (segment_hits_bounds_(&v[j], &v[i], bounds))
+                        return CROSSING;
+        }
+        /* No edge touches the cell, so it is wholly on one side. */
+        center.x = bounds->nw->x + bounds->width / 2;
+        center.y = bounds->se->y + bounds->height / 2;
+        return polygon_contains_(region, &center) ? INSIDE : OUTSIDE;
+}
+
+/* polyline */
+
+static int
+polyline_contains_(region_t *region, quadtree_point_t *point) {
+        const quadtree_point_t *v = region->vertices;
+        size_t i;
+
+        if (region->n == 1)
+                return point_segment_dist2_(point, &v[0], &v[0]) <= region->d2;
+        for (i = 1; i < region->n; i++) {
+                if (point_segment_dist2_(point, &v[i - 1], &v[i]) <= region->d2)
+                        return 1;
+        }
+        return 0;
+}
+
+static region_class_t
+polyline_classify_(region_t *region, quadtree_bounds_t *bounds) {
+        const quadtree_point_t *v = region->vertices;
+        quadtree_point_t corners[4];
+        size_t i, last = region->n > 1 ? region->n - 1 : 1;
+        int c, near = 0;
+
+        corners_(bounds, corners);
+        for (i = 0; i < last; i++) {
+                const quadtree_point_t *a = &v[i];
+                const quadtree_point_t *b = &v[region->n > 1 ? i + 1 : i];
+                int corners_in = 0;
+                double d2;
+
+                /* Segment capsules are convex: all four corners in means the cell is in. */
+                for (c = 0; c < 4; c++)
+                        corners_in += point_segment_dist2_(&corners[c], a, b) <= region->d2;
+                if (corners_in == 4)
+                        return INSIDE;
+                if (near || corners_in > 0 || segment_hits_bounds_(a, b, bounds)) {
+                        near = 1;
+                        continue;
+                }
+                d2 = fmin(point_bounds_dist2_(a, bounds), point_bounds_dist2_(b, bounds));
+                for (c = 0; c < 4; c++)
+                        d2 = fmin(d2, point_segment_dist2_(&corners[c], a, b));
+                near = d2 <= region->d2;
+        }
+        return near ? CROSSING : OUTSIDE;
+}
+
+/* traversal */
+
+static void
+collect_all_(quadtree_node_t *root, quadtree_node_list_t **result) {
+        quadtree_node_t *entry;
+        if (quadtree_node_isleaf(root)) {
+                for (entry = root; entry != NULL; entry = next_entry_(entry))
+                        quadtree_node_list_add(result, entry);
+        } else if (quadtree_node_ispointer(root)) {
+                collect_all_(root->nw, result);
+                collect_all_(root->ne, result);
+                collect_all_(root->sw, result);
+                collect_all_(root->se, result);
+        }
+}
+
+static void
+search_region_(region_t *region, quadtree_node_t *root, quadtree_node_list_t **result) {
+        quadtree_node_t *entry;
+
+        if (quadtree_node_isempty(root))
+                return;
+        if (quadtree_node_isleaf(root)) {
+                for (entry = root; entry != NULL; entry = next_entry_(entry)) {
+                        if (region->contains(region, entry->point))
+                                quadtree_node_list_add(result, entry);
+                }
+                return;
+        }
+        switch (region->classify(region, root->bounds)) {
+                case INSIDE:
+                        collect_all_(root, result);
+                        break;
+                case CROSSING:
+                        search_region_(region, root->nw, result);
+                        search_region_(region, root->ne, result);
+                        search_region_(region, root->sw, result);
+                        search_region_(region, root->se, result);
+                        break;
+                case OUTSIDE:
+                        break;
+        }
+}
+
+static void
+polygon_region_(region_t *region, const quadtree_point_t *vertices, size_t n) {
+        region->vertices = vertices;
+        region->n = n;
+        region->d2 = 0;
+        region->classify = polygon_classify_;
+        region->contains = polygon_contains_;
+}
+
+static void
+polyline_region_(region_t *region, const quadtree_point_t *vertices, size_t n, double d) {
+        region->vertices = vertices;
+        region->n = n;
+        region->d2 = d * d;
+        region->classify = polyline_classify_;
+        region->contains = polyline_contains_;
+}
+
+static void
+record_vertices_(quadtree_recorder_t *recorder, const quadtree_point_t *vertices, size_t n) {
+        size_t i;
+
+        quadtree_record_arg(recorder, n);
+        for (i = 0; i < n; i++) {
+                quadtree_record_arg(recorder, vertices[i].x);
+                quadtree_record_arg(recorder, vertices[i].y);
+        }
+        quadtree_record_end(recorder);
+}
+
+/*
+ * Points inside the simple polygon given by its n vertices (closing edge
+ * implied). Cells wholly inside are taken without testing their points.
+ */
+quadtree_node_list_t *
+quadtree_search_polygon(quadtree_t *tree, const quadtree_point_t *vertices, size_t n) {
+        quadtree_node_list_t *result = NULL;
+        region_t region;
+
+        if (tree->recorder != NULL) {
+                quadtree_record_begin(tree->recorder, QUADTREE_CALL_SEARCH_POLYGON);
+                record_vertices_(tree->recorder, vertices, n);
+        }
+        if (n < 3)
+                return NULL;
+        polygon_region_(&region, vertices, n);
+        search_region_(&region, tree->root, &result);
+        return result;
+}
+
+/* Points within d of the polyline through the n vertices. */
+quadtree_node_list_t *
+quadtree_search_polyline(quadtree_t *tree, const quadtree_point_t *vertices, size_t n, double d) {
+        quadtree_node_list_t *result = NULL;
+        region_t region;
+
+        if (tree->recorder != NULL) {
+                quadtree_record_begin(tree->recorder, QUADTREE_CALL_SEARCH_POLYLINE);
+                quadtree_record_arg(tree->recorder, d);
+                record_vertices_(tree->recorder, vertices, n);
+        }
+        if (n < 1)
+                return NULL;
+        polyline_region_(&region, vertices, n, d);
+        search_region_(&region, tree->root, &result);
+        return result;
+}
+
+/* frozen */
+
+/* search_region_ over a frozen tree: a cell wholly inside is one run of points. */
+static unsigned int
+search_frozen_(region_t *region, quadtree_frozen_t *frozen, quadtree_frozen_node_t *node,
+               void (*callback)(const quadtree_frozen_point_t *point, void *ctx), void *ctx) {
+        region_class_t where = CROSSING;
+        quadtree_point_t nw, se;
+        quadtree_bounds_t bounds;
+        unsigned int count = 0;
+        uint32_t i;
+
+        if (node->count == 0)
+                return 0;
+        if (node->child != 0) {
+                nw.x = node->minx;
+                nw.y = node->maxy;
+                se.x = node->maxx;
+                se.y = node->miny;
+                bounds.nw = &nw;
+                bounds.se = &se;
+                bounds.width = node->maxx - node->minx;
+                bounds.height = node->maxy - node->miny;
+                where = region->classify(region, &bounds);
+        }
+        if (where == OUTSIDE)
+                return 0;
+        if (where == INSIDE || node->child == 0) {
+                for (i = node->first; i < node->first + node->count; i++) {
+                        if (where == INSIDE || region->contains(region, &frozen->points[i].point)) {
+                                callback(&frozen->points[i], ctx);
+                                count++;
+                        }
+                }
+                return count;
+        }
+        for (i = 0; i < 4; i++)
+                count += search_frozen_(region, frozen, &frozen->nodes[node->child + i], callback, ctx);
+        return count;
+}
+
+/* As quadtree_search_polygon, calling back for each point. Returns how many there were. */
+unsigned int
+quadtree_frozen_search_polygon(quadtree_frozen_t *frozen, const quadtree_point_t *vertices, size_t n,
+                               void (*callback)(const quadtree_frozen_point_t *point, void *ctx), void *ctx) {
+        region_t region;
+
+        if (n < 3)
+                return 0;
+        polygon_region_(&region, vertices, n);
+        return search_frozen_(&region, frozen, frozen->nodes, callback, ctx);
+}
+
+/* As quadtree_search_polyline, calling back for each point. Returns how many there were. */
+unsigned int
+quadtree_frozen_search_polyline(quadtree_frozen_t *frozen, const quadtree_point_t *vertices, size_t n, double d,
+                                void (*callback)(const quadtree_frozen_point_t *point, void *ctx), void *ctx) {
+        region_t region;
+
+        if (n < 1)
+                return 0;
+        polyline_region_(&region, vertices, n, d);
+        return search_frozen_(&region, frozen, frozen->nodes, callback, ctx);
+}
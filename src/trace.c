@@ -0,0 +1,239 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "quadtree.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef QUADTREE_TRACE
+
+/*
+ * One ring per thread. The owning thread is the only writer, so emitting an
+ * event is a store into thread local memory and a release store of the head:
+ * no locks, no read-modify-write. When the ring wraps the oldest records are
+ * overwritten. Only the owner moves the head, and it never goes back; drains
+ * and resets move base, under rings_lock_. Rings are linked up on first use
+ * and outlive their threads, so a drain reaches every thread that traced
+ * anything; a new thread takes over a drained one.
+ */
+typedef struct trace_ring {
+        quadtree_trace_record_t *records;
+        uint64_t head;
+        uint64_t base;                 /* records before it are drained */
+        quadtree_trace_record_t *copy; /* drain's snapshot of the ring */
+        size_t copied, next;           /* records in copy, and the merge cursor */
+        int orphan;                    /* its thread has exited */
+        struct trace_ring *link;
+} trace_ring_t;
+
+static __thread trace_ring_t *ring_;
+static pthread_mutex_t rings_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings_;
+static pthread_once_t exit_once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key_;
+static volatile int enabled_ = 1;
+
+static void
+orphan_(void *ring) {
+        pthread_mutex_lock(&rings_lock_);
+        ((trace_ring_t *)ring)->orphan = 1;
+        pthread_mutex_unlock(&rings_lock_);
+}
+
+static void
+exit_key_new_(void) {
+        pthread_key_create(&exit_key_, orphan_);
+}
+
+static trace_ring_t *
+ring_new_(void) {
+        trace_ring_t *ring;
+
+        pthread_once(&exit_once_, exit_key_new_);
+        pthread_mutex_lock(&rings_lock_);
+        for (ring = rings_; ring != NULL && !(ring->orphan && ring->base == ring->head); ring = ring->link)
+                ;
+        if (ring != NULL)
+                ring->orphan = 0;
+        pthread_mutex_unlock(&rings_lock_);
+        if (ring == NULL) {
+                if (!(ring = calloc(1, sizeof(*ring))))
+                        return NULL;
+                if (!(ring->records = malloc(sizeof(*ring->records) * QUADTREE_TRACE_RING_SIZE))) {
+                        free(ring);
+                        return NULL;
+                }
+                pthread_mutex_lock(&rings_lock_);
+                ring->link = rings_;
+                rings_ = ring;
+                pthread_mutex_unlock(&rings_lock_);
+        }
+        pthread_setspecific(exit_key_, ring);
+        return ring;
+}
+
+static inline uint64_t
+now_(void) {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static double
+ticks_per_sec_(void) {
+#if defined(__x86_64__) || defined(__i386__)
+        struct timespec a, b, pause = {0, 2000000};
+        uint64_t ta, tb;
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        ta = now_();
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        tb = now_();
+        return (double)(tb - ta) / ((b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9);
+#else
+        return 1e9;
+#endif
+}
+
+void
+quadtree_trace_emit(quadtree_trace_event_t event, unsigned int depth, unsigned int count) {
+        quadtree_trace_record_t *rec;
+        uint64_t head;
+        if (!enabled_)
+                return;
+        if (ring_ == NULL && !(ring_ = ring_new_()))
+                return;
+        head = __atomic_load_n(&ring_->head, __ATOMIC_RELAXED);
+        /* A drain that sees this record's stores also sees the head they overwrite under. */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        rec = &ring_->records[head & (QUADTREE_TRACE_RING_SIZE - 1)];
+        rec->timestamp = now_();
+        rec->event = (uint16_t)event;
+        rec->depth = (uint16_t)depth;
+        rec->count = count;
+        __atomic_store_n(&ring_->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void
+quadtree_trace_enable(int enable) {
+        enabled_ = enable;
+}
+
+void
+quadtree_trace_reset(void) {
+        trace_ring_t *ring;
+        pthread_mutex_lock(&rings_lock_);
+        for (ring = rings_; ring != NULL; ring = ring->link)
+                ring->base = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&rings_lock_);
+}
+
+/*
+ * Copies the undrained part of ring, then drops the records its thread may
+ * have overwritten meanwhile: writing record i + QUADTREE_TRACE_RING_SIZE
+ * starts only once the head has reached it. Marks the copied part drained.
+ */
+static int
+snapshot_(trace_ring_t *ring) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head - ring->base > QUADTREE_TRACE_RING_SIZE ? head - QUADTREE_TRACE_RING_SIZE : ring->base;
+        uint64_t i, now, lost;
+
+        ring->copied = ring->next = 0;
+        ring->copy = NULL;
+        if (first == head)
+                return 1;
+        if (!(ring->copy = malloc(sizeof(*ring->copy) * (head - first))))
+                return 0;
+        for (i = first; i < head; i++)
+                ring->copy[i - first] = ring->records[i & (QUADTREE_TRACE_RING_SIZE - 1)];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        lost = now - first >= QUADTREE_TRACE_RING_SIZE ? now - first - QUADTREE_TRACE_RING_SIZE + 1 : 0;
+        ring->next = lost < head - first ? lost : head - first;
+        ring->copied = head - first;
+        ring->base = head;
+        return 1;
+}
+
+/* The ring whose oldest unmerged record is oldest, NULL once all are merged. */
+static trace_ring_t *
+oldest_(void) {
+        trace_ring_t *ring, *oldest = NULL;
+        uint64_t t, best = 0;
+        for (ring = rings_; ring != NULL; ring = ring->link) {
+                if (ring->next == ring->copied)
+                        continue;
+                t = ring->copy[ring->next].timestamp;
+                if (oldest == NULL || t < best) {
+                        oldest = ring;
+                        best = t;
+                }
+        }
+        return oldest;
+}
+
+long
+quadtree_trace_drain(const char *path) {
+        quadtree_trace_header_t header;
+        trace_ring_t *ring;
+        uint64_t n = 0;
+        int failed = 0;
+        FILE *fp;
+
+        if (!(fp = fopen(path, "wb")))
+                return -1;
+        /* Calibrating sleeps, so do it before holding up new threads. */
+        header.ticks_per_sec = ticks_per_sec_();
+
+        pthread_mutex_lock(&rings_lock_);
+        for (ring = rings_; ring != NULL; ring = ring->link) {
+                failed |= !snapshot_(ring);
+                n += ring->copied - ring->next;
+        }
+
+        memcpy(header.magic, QUADTREE_TRACE_MAGIC, sizeof(header.magic));
+        header.version = QUADTREE_TRACE_FORMAT;
+        header.record_size = sizeof(quadtree_trace_record_t);
+        header.count = n;
+        failed = failed || fwrite(&header, sizeof(header), 1, fp) != 1;
+
+        /* Merge the rings oldest to newest. */
+        while (!failed && (ring = oldest_()) != NULL)
+                failed = fwrite(&ring->copy[ring->next++], sizeof(quadtree_trace_record_t), 1, fp) != 1;
+        for (ring = rings_; ring != NULL; ring = ring->link) {
+                free(ring->copy);
+                ring->copy = NULL;
+        }
+        pthread_mutex_unlock(&rings_lock_);
+
+        if (fclose(fp) != 0 || failed)
+                return -1;
+        return (long)n;
+}
+
+#else
+
+void
+quadtree_trace_emit(quadtree_trace_event_t event, unsigned int depth, unsigned int count) {
+}
+
+void
+quadtree_trace_enable(int enable) {
+}
+
+void
+quadtree_trace_reset(void) {
+}
+
+long
+quadtree_trace_drain(const char *path) {
+        return -1;
+}
+
+#endif
@@ -0,0 +1,1124 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "quadtree.h"
+#include "ext.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Log records, in native byte order:
+ *   uint32 size  of the body, everything after the crc
+ *   uint32 crc   of the body
+ *   uint64 lsn
+ *   uint32 op
+ *   uint32 argc
+ *   double args[argc]
+ *   uint32 key size, then the key bytes
+ * Reading stops at the first short or corrupt record, which is a write torn
+ * by a crash. One tree per log.
+ */
+#define RECORD_HEAD 8
+#define RECORD_FIXED 20 /* body without args and key */
+#define RECORD_MAX (1u << 30)
+
+typedef struct wal_buffer {
+        unsigned char *data;
+        size_t length;
+        size_t capacity;
+} wal_buffer_t;
+
+struct quadtree_wal {
+        char *path;
+        int fd;
+        quadtree_wal_sync_t sync;
+        unsigned int interval_ms;
+        const quadtree_key_codec_t *codec;
+        pthread_mutex_t lock; /* active, lsn and the flags */
+        pthread_mutex_t io;   /* fd and spare: one writer at a time */
+        pthread_cond_t wake;
+        pthread_t writer;
+        int running;
+        int closing;
+        int kicked;
+        int failed;
+        wal_buffer_t active; /* appended to */
+        wal_buffer_t spare;  /* being written out */
+        uint64_t lsn;        /* of the last record appended */
+};
+
+typedef struct wal_record {
+        uint64_t lsn;
+        uint32_t op;
+        uint32_t argc;
+        const double *args;
+        const unsigned char *key;
+        uint32_t key_size;
+} wal_record_t;
+
+static uint32_t crc_table_[256];
+static pthread_once_t crc_once_ = PTHREAD_ONCE_INIT;
+
+static void
+crc_init_(void) {
+        uint32_t c;
+        unsigned int i, k;
+        for (i = 0; i < 256; i++) {
+                for (c = i, k = 0; k < 8; k++)
+                        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                crc_table_[i] = c;
+        }
+}
+
+static uint32_t
+crc32_(const unsigned char *p, size_t n) {
+        uint32_t c = 0xffffffffu;
+        while (n--)
+                c = crc_table_[(c ^ *p++) & 0xff] ^ (c >> 8);
+        return c ^ 0xffffffffu;
+}
+
+static int
+reserve_(wal_buffer_t *buffer, size_t more) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+        unsigned char *data;
+
+        if (buffer->length + more <= buffer->capacity)
+                return 1;
+        while (capacity < buffer->length + more)
+                capacity *= 2;
+        if (!(data = realloc(buffer->data, capacity)))
+                return 0;
+        buffer->data = data;
+        buffer->capacity = capacity;
+        return 1;
+}
+
+/* Room for a record at the end of buffer with its fixed fields filled in. */
+static unsigned char *
+begin_(wal_buffer_t *buffer, uint64_t lsn, quadtree_wal_op_t op, size_t argc, size_t key_size) {
+        size_t size = RECORD_FIXED + argc * sizeof(double) + key_size;
+        unsigned char *p;
+        uint32_t u;
+
+        if (size > RECORD_MAX || !reserve_(buffer, RECORD_HEAD + size))
+                return NULL;
+        p = buffer->data + buffer->length;
+        u = (uint32_t)size;
+        memcpy(p, &u, 4);
+        memcpy(p + 8, &lsn, 8);
+        u = op;
+        memcpy(p + 16, &u, 4);
+        u = (uint32_t)argc;
+        memcpy(p + 20, &u, 4);
+        u = (uint32_t)key_size;
+        memcpy(p + 24 + argc * sizeof(double), &u, 4);
+        return p;
+}
+
+/* Seal the record begun at p once its args and key are in. */
+static void
+end_(wal_buffer_t *buffer, unsigned char *p) {
+        uint32_t size, crc;
+        memcpy(&size, p, 4);
+        crc = crc32_(p + RECORD_HEAD, size);
+        memcpy(p + 4, &crc, 4);
+        buffer->length += RECORD_HEAD + size;
+}
+
+static int
+write_all_(int fd, const unsigned char *data, size_t length) {
+        ssize_t n;
+        while (length > 0) {
+                if ((n = write(fd, data, length)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return 0;
+                }
+                data += n;
+                length -= (size_t)n;
+        }
+        return 1;
+}
+
+/* fsync the directory holding path, making a rename there durable. */
+static int
+sync_dir_(const char *path) {
+        const char *slash = strrchr(path, '/');
+        size_t n = slash != NULL ? (size_t)(slash - path) + 1 : 0;
+        char *dir;
+        int fd, ok;
+
+        if (!(dir = malloc(n + 2)))
+                return 0;
+        memcpy(dir, n > 0 ? path : ".", n > 0 ? n : 1);
+        dir[n > 0 ? n : 1] = '\0';
+        fd = open(dir, O_RDONLY);
+        free(dir);
+        if (fd < 0)
+                return 0;
+        ok = fsync(fd) == 0;
+        return close(fd) == 0 && ok;
+}
+
+static char *
+tmp_path_(const char *path) {
+        size_t n = strlen(path);
+        char *tmp = malloc(n + 5);
+        if (tmp != NULL) {
+                memcpy(tmp, path, n);
+                memcpy(tmp + n, ".tmp", 5);
+        }
+        return tmp;
+}
+
+/*
+ * Write out everything appended so far, then fdatasync if asked. Appends
+ * carry on into the other buffer meanwhile.
+ */
+static int
+flush_(quadtree_wal_t *wal, int sync) {
+        wal_buffer_t swap;
+        int ok;
+
+        pthread_mutex_lock(&wal->io);
+        pthread_mutex_lock(&wal->lock);
+        swap = wal->active;
+        wal->active = wal->spare;
+        wal->spare = swap;
+        pthread_mutex_unlock(&wal->lock);
+
+        ok = write_all_(wal->fd, wal->spare.data, wal->spare.length);
+        wal->spare.length = 0;
+        if (ok && sync)
+                ok = fdatasync(wal->fd) == 0;
+
+        pthread_mutex_lock(&wal->lock);
+        wal->failed |= !ok;
+        ok = !wal->failed;
+        pthread_mutex_unlock(&wal->lock);
+        pthread_mutex_unlock(&wal->io);
+        return ok ? 0 : -1;
+}
+
+/* Group commit: one write, and one fdatasync per policy, per interval. */
+static void *
+writer_(void *arg) {
+        quadtree_wal_t *wal = arg;
+        struct timespec deadline;
+
+        pthread_mutex_lock(&wal->lock);
+        while (!wal->closing) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += wal->interval_ms / 1000;
+                deadline.tv_nsec += (long)(wal->interval_ms % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+                while (!wal->closing && !wal->kicked &&
+                       pthread_cond_timedwait(&wal->wake, &wal->lock, &deadline) == 0)
+                        ;
+                wal->kicked = 0;
+                if (wal->active.length == 0)
+                        continue;
+                pthread_mutex_unlock(&wal->lock);
+                flush_(wal, wal->sync == QUADTREE_WAL_SYNC_INTERVAL);
+                pthread_mutex_lock(&wal->lock);
+        }
+        pthread_mutex_unlock(&wal->lock);
+        return NULL;
+}
+
+/* Releases the lock taken for an append. */
+static void
+appended_(quadtree_wal_t *wal) {
+        if (wal->running && !wal->kicked && wal->active.length >= QUADTREE_WAL_BUFFER) {
+                wal->kicked = 1;
+                pthread_cond_signal(&wal->wake);
+        }
+        pthread_mutex_unlock(&wal->lock);
+        if (wal->sync == QUADTREE_WAL_SYNC_ALWAYS)
+                flush_(wal, 1);
+}
+
+/* Checks a record body read into malloc'd memory and points record into it. */
+static int
+parse_(const unsigned char *body, uint32_t size, uint32_t crc, wal_record_t *record) {
+        if (crc32_(body, size) != crc)
+                return 0;
+        memcpy(&record->lsn, body, 8);
+        memcpy(&record->op, body + 8, 4);
+        memcpy(&record->argc, body + 12, 4);
+        if ((size - RECORD_FIXED) / sizeof(double) < record->argc)
+                return 0;
+        memcpy(&record->key_size, body + 16 + record->argc * sizeof(double), 4);
+        if (RECORD_FIXED + record->argc * sizeof(double) + record->key_size != size)
+                return 0;
+        /* Bodies start malloc aligned, so the args are aligned too. */
+        record->args = (const double *)(body + 16);
+        record->key = body + 20 + record->argc * sizeof(double);
+        return 1;
+}
+
+/*
+ * Calls visit for every whole record of the log at fd, sets *last to the lsn
+ * of the last one. Returns the offset just past it, or -1 on a read error.
+ */
+static off_t
+scan_(int fd, void (*visit)(void *ctx, const wal_record_t *record), void *ctx, uint64_t *last) {
+        unsigned char head[RECORD_HEAD];
+        unsigned char *body = NULL, *grown;
+        size_t capacity = 0;
+        uint32_t size, crc;
+        wal_record_t record;
+        off_t offset = 0;
+        ssize_t n;
+
+        for (;;) {
+                if ((n = pread(fd, head, RECORD_HEAD, offset)) != RECORD_HEAD) {
+                        if (n < 0)
+                                offset = -1;
+                        break;
+                }
+                memcpy(&size, head, 4);
+                memcpy(&crc, head + 4, 4);
+                if (size < RECORD_FIXED || size > RECORD_MAX)
+                        break;
+                if (size > capacity) {
+                        if (!(grown = realloc(body, size))) {
+                                offset = -1;
+                                break;
+                        }
+                        body = grown;
+                        capacity = size;
+                }
+                if ((n = pread(fd, body, size, offset + RECORD_HEAD)) != (ssize_t)size) {
+                        if (n < 0)
+                                offset = -1;
+                        break;
+                }
+                if (!parse_(body, size, crc, &record))
+                        break;
+                *last = record.lsn;
+                if (visit != NULL)
+                        visit(ctx, &record);
+                offset += RECORD_HEAD + size;
+        }
+        free(body);
+        return offset;
+}
+
+/*
+ * Opens or creates the log at path, continuing after its last whole record.
+ * interval_ms is how often the writer thread wakes, see quadtree_wal_sync_t;
+ * ALWAYS runs without one. codec encodes inserted keys and may be NULL.
+ */
+quadtree_wal_t *
+quadtree_wal_open(const char *path, quadtree_wal_sync_t sync, unsigned int interval_ms,
+                  const quadtree_key_codec_t *codec) {
+        quadtree_wal_t *wal;
+        off_t end;
+
+        pthread_once(&crc_once_, crc_init_);
+        if (!(wal = calloc(1, sizeof(*wal))))
+                return NULL;
+        wal->sync = sync;
+        wal->interval_ms = interval_ms > 0 ? interval_ms : 1;
+        wal->codec = codec;
+        if (!(wal->path = strdup(path)) || (wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+                free(wal->path);
+                free(wal);
+                return NULL;
+        }
+        /* Drop a torn tail, new records have to follow whole ones. */
+        if ((end = scan_(wal->fd, NULL, NULL, &wal->lsn)) < 0 || ftruncate(wal->fd, end) != 0) {
+                close(wal->fd);
+                free(wal->path);
+                free(wal);
+                return NULL;
+        }
+        pthread_mutex_init(&wal->lock, NULL);
+        pthread_mutex_init(&wal->io, NULL);
+        pthread_cond_init(&wal->wake, NULL);
+        if (sync != QUADTREE_WAL_SYNC_ALWAYS)
+                wal->running = pthread_create(&wal->writer, NULL, writer_, wal) == 0;
+        if (sync != QUADTREE_WAL_SYNC_ALWAYS && !wal->running) {
+                quadtree_wal_close(wal);
+                return NULL;
+        }
+        return wal;
+}
+
+static int
+put_record_(wal_buffer_t *buffer, uint64_t lsn, quadtree_wal_op_t op, const double *args, unsigned int argc,
+            void *key, const quadtree_key_codec_t *codec) {
+        size_t key_size = key != NULL && codec != NULL ? codec->size(key) : 0;
+        unsigned char *p;
+
+        if (!(p = begin_(buffer, lsn, op, argc, key_size)))
+                return 0;
+        if (argc > 0)
+                memcpy(p + 24, args, argc * sizeof(double));
+        if (key_size > 0)
+                codec->encode(key, p + 28 + argc * sizeof(double));
+        end_(buffer, p);
+        return 1;
+}
+
+/*
+ * Appends a record. Logging cannot fail the operation it records: a failed
+ * append or write marks the log failed, and quadtree_wal_sync says so.
+ */
+void
+quadtree_wal_log(quadtree_wal_t *wal, quadtree_wal_op_t op, const double *args, unsigned int argc, void *key) {
+        pthread_mutex_lock(&wal->lock);
+        if (put_record_(&wal->active, wal->lsn + 1, op, args, argc, key, wal->codec))
+                wal->lsn++;
+        else
+                wal->failed = 1;
+        appended_(wal);
+}
+
+static size_t
+count_points_(quadtree_node_t *node) {
+        quadtree_node_t *entry;
+        size_t n = 0;
+        if (quadtree_node_ispointer(node))
+                return count_points_(node->nw) + count_points_(node->ne) + count_points_(node->sw) +
+                       count_points_(node->se);
+        for (entry = node; quadtree_node_isleaf(node) && entry != NULL; entry = next_entry_(entry))
+                n++;
+        return n;
+}
+
+static unsigned char *
+put_points_(quadtree_node_t *node, unsigned char *out) {
+        quadtree_node_t *entry;
+        if (quadtree_node_ispointer(node)) {
+                out = put_points_(node->nw, out);
+                out = put_points_(node->ne, out);
+                out = put_points_(node->sw, out);
+                return put_points_(node->se, out);
+        }
+        for (entry = node; quadtree_node_isleaf(node) && entry != NULL; entry = next_entry_(entry)) {
+                memcpy(out, &entry->point->x, sizeof(double));
+                memcpy(out + sizeof(double), &entry->point->y, sizeof(double));
+                out += 2 * sizeof(double);
+        }
+        return out;
+}
+
+static int
+put_subtree_(wal_buffer_t *buffer, uint64_t lsn, quadtree_wal_op_t op, const double *head, unsigned int head_n,
+             quadtree_node_t *subtree) {
+        size_t argc = head_n + 2 * count_points_(subtree);
+        unsigned char *p;
+
+        if (argc > UINT32_MAX || !(p = begin_(buffer, lsn, op, argc, 0)))
+                return 0;
+        if (head_n > 0)
+                memcpy(p + 24, head, head_n * sizeof(double));
+        put_points_(subtree, p + 24 + head_n * sizeof(double));
+        end_(buffer, p);
+        return 1;
+}
+
+/* quadtree_wal_log with head followed by the coordinates of every point in subtree. */
+void
+quadtree_wal_log_subtree(quadtree_wal_t *wal, quadtree_wal_op_t op, const double *head, unsigned int head_n,
+                         quadtree_node_t *subtree) {
+        pthread_mutex_lock(&wal->lock);
+        if (put_subtree_(&wal->active, wal->lsn + 1, op, head, head_n, subtree))
+                wal->lsn++;
+        else
+                wal->failed = 1;
+        appended_(wal);
+}
+
+/* Makes everything logged so far durable. Returns -1 if any of it is lost. */
+int
+quadtree_wal_sync(quadtree_wal_t *wal) {
+        return flush_(wal, 1);
+}
+
+/* Stops the writer, writes out the rest and closes. Returns as quadtree_wal_sync. */
+int
+quadtree_wal_close(quadtree_wal_t *wal) {
+        int status;
+
+        if (wal->running) {
+                pthread_mutex_lock(&wal->lock);
+                wal->closing = 1;
+                pthread_cond_signal(&wal->wake);
+                pthread_mutex_unlock(&wal->lock);
+                pthread_join(wal->writer, NULL);
+        }
+        status = flush_(wal, wal->sync != QUADTREE_WAL_SYNC_NEVER);
+        if (close(wal->fd) != 0)
+                status = -1;
+        pthread_cond_destroy(&wal->wake);
+        pthread_mutex_destroy(&wal->io);
+        pthread_mutex_destroy(&wal->lock);
+        free(wal->active.data);
+        free(wal->spare.data);
+        free(wal->path);
+        free(wal);
+        return status;
+}
+
+/*
+ * The snapshot at lsn holds everything logged so far: swap in a log with
+ * just a checkpoint at lsn, so numbering carries on past the snapshot. The
+ * swap is a rename, a crash leaves either the old log or the new one.
+ */
+static int
+restart_(quadtree_wal_t *wal, uint64_t lsn) {
+        wal_buffer_t fresh = {NULL, 0, 0};
+        char *tmp = tmp_path_(wal->path);
+        unsigned char *p = NULL;
+        int fd = -1, ok;
+
+        pthread_mutex_lock(&wal->io);
+        ok = tmp != NULL && (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644)) >= 0 &&
+             (p = begin_(&fresh, lsn, QUADTREE_WAL_CHECKPOINT, 0, 0)) != NULL;
+        if (ok) {
+                end_(&fresh, p);
+                ok = write_all_(fd, fresh.data, fresh.length) && fdatasync(fd) == 0 && rename(tmp, wal->path) == 0 &&
+                     sync_dir_(wal->path);
+        }
+        if (ok) {
+                pthread_mutex_lock(&wal->lock);
+                wal->active.length = 0;
+                pthread_mutex_unlock(&wal->lock);
+                close(wal->fd);
+                wal->fd = fd;
+        } else if (fd >= 0) {
+                close(fd);
+                unlink(tmp);
+        }
+        pthread_mutex_unlock(&wal->io);
+        free(fresh.data);
+        free(tmp);
+        return ok ? 0 : -1;
+}
+
+static void
+shape_(quadtree_t *tree, double *shape) {
+        quadtree_bounds_t *b = tree->root->bounds;
+        shape[0] = b->nw->x;
+        shape[1] = b->se->y;
+        shape[2] = b->se->x;
+        shape[3] = b->nw->y;
+        shape[4] = tree->max_depth;
+        shape[5] = tree->min_cell_size;
+        shape[6] = tree->auto_grow;
+        shape[7] = tree->auto_shrink;
+}
+
+static quadtree_t *
+tree_from_shape_(const double *shape, const quadtree_key_codec_t *codec, const quadtree_options_t *options) {
+        quadtree_t *tree = quadtree_new_with_options(shape[0], shape[1], shape[2], shape[3], options);
+        if (tree == NULL)
+                return NULL;
+        quadtree_set_depth_limit(tree, (unsigned int)shape[4], shape[5]);
+        quadtree_set_auto_grow(tree, (int)shape[6], (int)shape[7]);
+        tree->key_free = codec != NULL ? codec->free : NULL;
+        return tree;
+}
+
+/*
+ * Log tree's changes to wal from now on, or stop with NULL. An empty tree
+ * logs its shape first so that the log alone can bring it back; one that
+ * already has points needs a quadtree_snapshot to be recoverable.
+ */
+void
+quadtree_set_wal(quadtree_t *tree, quadtree_wal_t *wal) {
+        double shape[8];
+
+        tree->wal = wal;
+        if (wal != NULL && tree->length == 0) {
+                shape_(tree, shape);
+                quadtree_wal_log(wal, QUADTREE_WAL_ROOT, shape, 8, NULL);
+        }
+}
+
+/*
+ * Snapshots are a header and then x, y, time, key size and key of every
+ * point, written next to path and renamed over it.
+ */
+typedef struct snapshot_header {
+        char magic[4];
+        uint16_t version;
+        uint16_t pad_;
+        uint64_t count;
+        uint64_t lsn; /* last log record the snapshot holds */
+        double shape[8];
+} snapshot_header_t;
+
+typedef struct snapshot_io {
+        FILE *fp;
+        const quadtree_key_codec_t *codec;
+        unsigned char *scratch;
+        size_t capacity;
+        uint64_t count; /* points written */
+        int failed;
+} snapshot_io_t;
+
+static unsigned char *
+scratch_(snapshot_io_t *io, size_t size) {
+        unsigned char *grown;
+        if (size > io->capacity) {
+                if (!(grown = realloc(io->scratch, size)))
+                        return NULL;
+                io->scratch = grown;
+                io->capacity = size;
+        }
+        return io->scratch;
+}
+
+static void
+write_points_(snapshot_io_t *io, quadtree_node_t *node) {
+        quadtree_node_t *entry;
+        uint32_t key_size;
+        double v[3];
+
+        if (quadtree_node_ispointer(node)) {
+                write_points_(io, node->nw);
+                write_points_(io, node->ne);
+                write_points_(io, node->sw);
+                write_points_(io, node->se);
+                return;
+        }
+        for (entry = node; quadtree_node_isleaf(node) && entry != NULL && !io->failed; entry = next_entry_(entry)) {
+                v[0] = entry->point->x;
+                v[1] = entry->point->y;
+                v[2] = node_time_(entry);
+                key_size = entry->key != NULL && io->codec != NULL ? (uint32_t)io->codec->size(entry->key) : 0;
+                if (key_size > 0 && scratch_(io, key_size) == NULL) {
+                        io->failed = 1;
+                        return;
+                }
+                if (key_size > 0)
+                        io->codec->encode(entry->key, io->scratch);
+                io->failed |= fwrite(v, sizeof(v), 1, io->fp) != 1 || fwrite(&key_size, 4, 1, io->fp) != 1 ||
+                              (key_size > 0 && fwrite(io->scratch, key_size, 1, io->fp) != 1);
+                io->count++;
+        }
+}
+
+/*
+ * Writes every point of tree to path. With a log attached, the log then
+ * restarts after the snapshot. Returns 0, or -1 leaving any old snapshot
+ * and the log as they were.
+ */
+int
+quadtree_snapshot(quadtree_t *tree, const char *path, const quadtree_key_codec_t *codec) {
+        snapshot_io_t io = {NULL, codec, NULL, 0, 0, 0};
+        snapshot_header_t header;
+        char *tmp;
+
+        if (!(tmp = tmp_path_(path)))
+                return -1;
+        if (!(io.fp = fopen(tmp, "wb"))) {
+                free(tmp);
+                return -1;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, QUADTREE_SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = QUADTREE_SNAPSHOT_FORMAT;
+        if (tree->wal != NULL) {
+                pthread_mutex_lock(&tree->wal->lock);
+                header.lsn = tree->wal->lsn;
+                pthread_mutex_unlock(&tree->wal->lock);
+        }
+        shape_(tree, header.shape);
+
+        /* The count is what load reads back, so it is the points written,
+         * patched in once they are all out. */
+        io.failed = fwrite(&header, sizeof(header), 1, io.fp) != 1;
+        if (!io.failed)
+                write_points_(&io, tree->root);
+        header.count = io.count;
+        io.failed = io.failed || fseek(io.fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, io.fp) != 1;
+        io.failed |= fflush(io.fp) != 0 || fsync(fileno(io.fp)) != 0;
+        io.failed |= fclose(io.fp) != 0;
+        io.failed = io.failed || rename(tmp, path) != 0 || !sync_dir_(path);
+        if (io.failed)
+                unlink(tmp);
+        free(io.scratch);
+        free(tmp);
+        if (io.failed)
+                return -1;
+        return tree->wal != NULL ? restart_(tree->wal, header.lsn) : 0;
+}
+
+static void *
+decode_(const quadtree_key_codec_t *codec, const unsigned char *key, size_t size) {
+        return codec != NULL && codec->decode != NULL && size > 0 ? codec->decode(key, size) : NULL;
+}
+
+static void
+drop_key_(quadtree_t *tree, void *key) {
+        if (key != NULL && tree->key_free != NULL)
+                tree->key_free(key);
+}
+
+static quadtree_t *
+load_snapshot_(FILE *fp, const quadtree_key_codec_t *codec, const quadtree_options_t *options, uint64_t *lsn) {
+        snapshot_io_t io = {fp, codec, NULL, 0, 0, 0};
+        snapshot_header_t header;
+        quadtree_t *tree;
+        uint32_t key_size;
+        uint64_t i;
+        double v[3];
+        void *key;
+
+        if (fread(&header, sizeof(header), 1, fp) != 1 ||
+            memcmp(header.magic, QUADTREE_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != QUADTREE_SNAPSHOT_FORMAT || !(tree = tree_from_shape_(header.shape, codec, options)))
+                return NULL;
+        for (i = 0; i < header.count && !io.failed; i++) {
+                io.failed = fread(v, sizeof(v), 1, fp) != 1 || fread(&key_size, 4, 1, fp) != 1;
+                if (!io.failed && key_size > 0)
+                        io.failed = scratch_(&io, key_size) == NULL || fread(io.scratch, key_size, 1, fp) != 1;
+                if (io.failed)
+                        break;
+                key = decode_(codec, io.scratch, key_size);
+                if (quadtree_insert_at(tree, v[0], v[1], v[2], key, NULL) <= 0)
+                        drop_key_(tree, key);
+        }
+        free(io.scratch);
+        if (io.failed) {
+                quadtree_free(tree);
+                return NULL;
+        }
+        *lsn = header.lsn;
+        return tree;
+}
+
+typedef struct replay {
+        quadtree_t *tree;
+        const quadtree_key_codec_t *codec;
+        uint64_t after; /* lsn the snapshot covers */
+        const quadtree_options_t *options; /* for a tree built from scratch */
+} replay_t;
+
+/* A tree replacing tree is built the same way. */
+static void
+options_of_(quadtree_t *tree, quadtree_options_t *options) {
+        options->allocator = tree->allocator;
+        options->aggregate = tree->aggregate;
+}
+
+static void
+clear_point_(quadtree_t *tree, double x, double y) {
+        quadtree_node_t *node = quadtree_node_search(tree, x, y);
+        if (node != NULL)
+                drop_key_(tree, quadtree_clear_leaf_with_condense(tree, node));
+}
+
+/* The live tree kept one subtree as its root; carry its points over. */
+static void
+reroot_(replay_t *replay, const double *args, uint32_t argc) {
+        quadtree_t *old = replay->tree;
+        quadtree_options_t options;
+        quadtree_node_t *node;
+        quadtree_t *tree;
+        uint32_t i;
+
+        options_of_(old, &options);
+        if (!(tree = quadtree_new_with_options(args[0], args[1], args[2], args[3], &options)))
+                return;
+        quadtree_set_depth_limit(tree, old->max_depth, old->min_cell_size);
+        quadtree_set_auto_grow(tree, old->auto_grow, old->auto_shrink);
+        tree->key_free = old->key_free;
+        for (i = 4; i + 1 < argc; i += 2) {
+                node = quadtree_node_search(old, args[i], args[i + 1]);
+                if (node == NULL)
+                        continue;
+                if (quadtree_insert_at(tree, args[i], args[i + 1], node_time_(node), node->key, NULL) > 0)
+                        node->key = NULL;
+        }
+        quadtree_free(old);
+        replay->tree = tree;
+}
+
+static const uint32_t min_args_[] = {8, 3, 4, 2, 1, 0, 4, 0};
+
+static void
+apply_(replay_t *replay, const wal_record_t *record) {
+        quadtree_t *tree = replay->tree;
+        const double *a = record->args;
+        quadtree_point_t point;
+        quadtree_node_t *node;
+        void *key;
+        uint32_t i;
+
+        if (record->op > QUADTREE_WAL_CHECKPOINT || record->argc < min_args_[record->op])
+                return;
+        if (record->op == QUADTREE_WAL_ROOT) {
+                quadtree_options_t options;
+                if (tree != NULL) {
+                        options_of_(tree, &options);
+                        quadtree_free(tree);
+                }
+                replay->tree = tree_from_shape_(a, replay->codec, tree != NULL ? &options : replay->options);
+                return;
+        }
+        if (tree == NULL)
+                return;
+        switch (record->op) {
+                case QUADTREE_WAL_INSERT:
+                        key = decode_(replay->codec, record->key, record->key_size);
+                        if (quadtree_insert_at(tree, a[0], a[1], a[2], key, NULL) <= 0)
+                                drop_key_(tree, key);
+                        break;
+                case QUADTREE_WAL_MOVE:
+                        if ((node = quadtree_node_search(tree, a[0], a[1])) != NULL) {
+                                point.x = a[2];
+                                point.y = a[3];
+                                quadtree_move_leaf(tree, &node, &point);
+                        }
+                        break;
+                case QUADTREE_WAL_CLEAR:
+                        clear_point_(tree, a[0], a[1]);
+                        break;
+                case QUADTREE_WAL_EXPIRE:
+                        quadtree_expire_before(tree, a[0]);
+                        break;
+                case QUADTREE_WAL_UNLINK:
+                        for (i = 0; i + 1 < record->argc; i += 2)
+                                clear_point_(tree, a[i], a[i + 1]);
+                        break;
+                case QUADTREE_WAL_REROOT:
+                        reroot_(replay, a, record->argc);
+                        break;
+                default:
+                        break;
+        }
+}
+
+static void
+replay_(void *ctx, const wal_record_t *record) {
+        replay_t *replay = ctx;
+        if (record->lsn > replay->after)
+                apply_(replay, record);
+}
+
+/*
+ * Rebuilds a tree from the snapshot at snapshot_path, then replays the log
+ * at wal_path past it. Either may be NULL or not exist yet. Keys come back
+ * through codec, whose free becomes the tree's key_free. Returns NULL when
+ * neither holds a tree or on a read error.
+ */
+quadtree_t *
+quadtree_recover(const char *snapshot_path, const char *wal_path, const quadtree_key_codec_t *codec) {
+        return quadtree_recover_with_options(snapshot_path, wal_path, codec, NULL);
+}
+
+/* quadtree_recover building the tree with options, as quadtree_new_with_options. */
+quadtree_t *
+quadtree_recover_with_options(const char *snapshot_path, const char *wal_path, const quadtree_key_codec_t *codec,
+                              const quadtree_options_t *options) {
+        replay_t replay = {NULL, codec, 0, options};
+        uint64_t last = 0;
+        FILE *fp;
+        off_t end;
+        int fd;
+
+        pthread_once(&crc_once_, crc_init_);
+        if (snapshot_path != NULL) {
+                if ((fp = fopen(snapshot_path, "rb")) != NULL) {
+                        replay.tree = load_snapshot_(fp, codec, options, &replay.after);
+                        fclose(fp);
+                        if (replay.tree == NULL)
+                                return NULL;
+                } else if (errno != ENOENT) {
+                        return NULL;
+                }
+        }
+        if (wal_path != NULL) {
+                if ((fd = open(wal_path, O_RDONLY)) >= 0) {
+                        end = scan_(fd, replay_, &replay, &last);
+                        close(fd);
+                        if (end < 0) {
+                                if (replay.tree != NULL)
+                                        quadtree_free(replay.tree);
+                                return NULL;
+                        }
+                } else if (errno != ENOENT) {
+                        if (replay.tree != NULL)
+                                quadtree_free(replay.tree);
+                        return NULL;
+                }
+        }
+        return replay.tree;
+}
+
+/*
+ * The feed keeps records back to back in one buffer with the offset of
+ * each, oldest first. Versions run on from 1 with no gaps; when an append
+ * fails the kept records are dropped so replicas resync rather than miss it.
+ */
+struct quadtree_feed {
+        const quadtree_key_codec_t *codec;
+        size_t retain;        /* bytes of records kept after a trim */
+        pthread_mutex_t lock; /* everything below */
+        wal_buffer_t records;
+        size_t *offsets;
+        size_t count;
+        size_t capacity;
+        uint64_t first;   /* version of offsets[0] */
+        uint64_t version; /* of the last change */
+};
+
+quadtree_feed_t *
+quadtree_feed_new(size_t retain, const quadtree_key_codec_t *codec) {
+        quadtree_feed_t *feed;
+
+        pthread_once(&crc_once_, crc_init_);
+        if (!(feed = calloc(1, sizeof(*feed))))
+                return NULL;
+        feed->codec = codec;
+        feed->retain = retain;
+        feed->first = 1;
+        pthread_mutex_init(&feed->lock, NULL);
+        return feed;
+}
+
+void
+quadtree_feed_free(quadtree_feed_t *feed) {
+        pthread_mutex_destroy(&feed->lock);
+        free(feed->records.data);
+        free(feed->offsets);
+        free(feed);
+}
+
+/* Drops the oldest records once past twice the budget, keeping the newest. */
+static void
+trim_(quadtree_feed_t *feed) {
+        size_t k = 0, i;
+
+        if (feed->records.length <= 2 * feed->retain)
+                return;
+        while (k + 1 < feed->count && feed->records.length - feed->offsets[k] > feed->retain)
+                k++;
+        memmove(feed->records.data, feed->records.data + feed->offsets[k], feed->records.length - feed->offsets[k]);
+        feed->records.length -= feed->offsets[k];
+        for (i = k; i < feed->count; i++)
+                feed->offsets[i - k] = feed->offsets[i] - feed->offsets[k];
+        feed->count -= k;
+        feed->first += k;
+}
+
+/* Called under the lock once a record was put at start, or failed to be. */
+static void
+pushed_(quadtree_feed_t *feed, size_t start, int ok) {
+        size_t capacity = feed->capacity > 0 ? 2 * feed->capacity : 64;
+        size_t *offsets;
+
+        if (ok && feed->count == feed->capacity) {
+                if ((offsets = realloc(feed->offsets, capacity * sizeof(*offsets))) != NULL) {
+                        feed->offsets = offsets;
+                        feed->capacity = capacity;
+                } else {
+                        ok = 0;
+                }
+        }
+        feed->version++;
+        if (ok) {
+                feed->offsets[feed->count++] = start;
+                trim_(feed);
+        } else {
+                feed->records.length = 0;
+                feed->count = 0;
+                feed->first = feed->version + 1;
+        }
+        pthread_mutex_unlock(&feed->lock);
+}
+
+/* As quadtree_wal_log, numbering the record with the next version. */
+void
+quadtree_feed_log(quadtree_feed_t *feed, quadtree_wal_op_t op, const double *args, unsigned int argc, void *key) {
+        size_t start;
+        int ok;
+
+        pthread_mutex_lock(&feed->lock);
+        start = feed->records.length;
+        ok = put_record_(&feed->records, feed->version + 1, op, args, argc, key, feed->codec);
+        pushed_(feed, start, ok);
+}
+
+void
+quadtree_feed_log_subtree(quadtree_feed_t *feed, quadtree_wal_op_t op, const double *head, unsigned int head_n,
+                          quadtree_node_t *subtree) {
+        size_t start;
+        int ok;
+
+        pthread_mutex_lock(&feed->lock);
+        start = feed->records.length;
+        ok = put_subtree_(&feed->records, feed->version + 1, op, head, head_n, subtree);
+        pushed_(feed, start, ok);
+}
+
+uint64_t
+quadtree_feed_version(quadtree_feed_t *feed) {
+        uint64_t version;
+        pthread_mutex_lock(&feed->lock);
+        version = feed->version;
+        pthread_mutex_unlock(&feed->lock);
+        return version;
+}
+
+/* As quadtree_set_wal: an empty tree sends its shape first. */
+void
+quadtree_set_feed(quadtree_t *tree, quadtree_feed_t *feed) {
+        double shape[8];
+
+        tree->feed = feed;
+        if (feed != NULL && tree->length == 0) {
+                shape_(tree, shape);
+                quadtree_feed_log(feed, QUADTREE_WAL_ROOT, shape, 8, NULL);
+        }
+}
+
+/*
+ * Copies the changes after version into *data, malloc'd for the caller to
+ * free, with their byte count in *size. Returns how many there are, 0 with
+ * *data NULL when version is current, or -1 when they are no longer kept
+ * (or never were, or memory ran out): the replica has to resync.
+ */
+long
+quadtree_changes_since(quadtree_feed_t *feed, uint64_t version, void **data, size_t *size) {
+        long n = -1;
+        size_t at;
+
+        *data = NULL;
+        *size = 0;
+        pthread_mutex_lock(&feed->lock);
+        if (version == feed->version) {
+                n = 0;
+        } else if (version < feed->version && version + 1 >= feed->first) {
+                at = feed->offsets[version + 1 - feed->first];
+                if ((*data = malloc(feed->records.length - at)) != NULL) {
+                        memcpy(*data, feed->records.data + at, feed->records.length - at);
+                        *size = feed->records.length - at;
+                        n = (long)(feed->count - (version + 1 - feed->first));
+                }
+        }
+        pthread_mutex_unlock(&feed->lock);
+        return n;
+}
+
+static int
+put_entries_(wal_buffer_t *buffer, uint64_t lsn, quadtree_node_t *node, const quadtree_key_codec_t *codec,
+             long *n) {
+        quadtree_node_t *entry;
+        double v[3];
+
+        if (quadtree_node_ispointer(node))
+                return put_entries_(buffer, lsn, node->nw, codec, n) && put_entries_(buffer, lsn, node->ne, codec, n) &&
+                       put_entries_(buffer, lsn, node->sw, codec, n) && put_entries_(buffer, lsn, node->se, codec, n);
+        for (entry = node; quadtree_node_isleaf(node) && entry != NULL; entry = next_entry_(entry)) {
+                v[0] = entry->point->x;
+                v[1] = entry->point->y;
+                v[2] = node_time_(entry);
+                if (!put_record_(buffer, lsn, QUADTREE_WAL_INSERT, v, 3, entry->key, codec))
+                        return 0;
+                ++*n;
+        }
+        return 1;
+}
+
+/*
+ * The whole of tree as changes at the feed's current version, for a new
+ * replica or one that fell behind: its shape, then every point. Returned
+ * as quadtree_changes_since. Call it between changes to tree, as with any
+ * read of the tree.
+ */
+long
+quadtree_feed_snapshot(quadtree_feed_t *feed, quadtree_t *tree, void **data, size_t *size) {
+        wal_buffer_t buffer = {NULL, 0, 0};
+        double shape[8];
+        uint64_t version;
+        long n = 1;
+
+        *data = NULL;
+        *size = 0;
+        version = quadtree_feed_version(feed);
+        shape_(tree, shape);
+        if (!put_record_(&buffer, version, QUADTREE_WAL_ROOT, shape, 8, NULL, NULL) ||
+            !put_entries_(&buffer, version, tree->root, feed->codec, &n)) {
+                free(buffer.data);
+                return -1;
+        }
+        *data = buffer.data;
+        *size = buffer.length;
+        return n;
+}
+
+/*
+ * Applies changes from quadtree_changes_since or quadtree_feed_snapshot to
+ * *replica, which is at *version, in order. Changes it already has are
+ * skipped and a snapshot replaces it, as does a shape when *replica is
+ * NULL. Keys are decoded with codec. Returns how many changes were applied,
+ * or -1 on a gap or a corrupt record, after which *replica and *version
+ * still match each other as far as it got.
+ */
+long
+quadtree_apply_changes(quadtree_t **replica, uint64_t *version, const void *data, size_t size,
+                       const quadtree_key_codec_t *codec) {
+        replay_t replay = {*replica, codec, *version, NULL};
+        const unsigned char *in = data;
+        unsigned char *body = NULL, *grown;
+        size_t at = 0, capacity = 0;
+        uint32_t length, crc;
+        wal_record_t record;
+        int base = 0; /* inside a snapshot, whose records share one version */
+        int failed = 0;
+        long n = 0;
+
+        pthread_once(&crc_once_, crc_init_);
+        while (at < size && !failed) {
+                failed = 1;
+                if (size - at < RECORD_HEAD)
+                        break;
+                memcpy(&length, in + at, 4);
+                memcpy(&crc, in + at + 4, 4);
+                if (length < RECORD_FIXED || length > RECORD_MAX || length > size - at - RECORD_HEAD)
+                        break;
+                if (length > capacity) {
+                        if (!(grown = realloc(body, length)))
+                                break;
+                        body = grown;
+                        capacity = length;
+                }
+                memcpy(body, in + at + RECORD_HEAD, length);
+                if (!parse_(body, length, crc, &record))
+                        break;
+                at += RECORD_HEAD + length;
+                failed = 0;
+                if (record.op == QUADTREE_WAL_ROOT && (record.lsn > replay.after || replay.tree == NULL))
+                        base = 1;
+                else if (record.lsn == replay.after + 1 && replay.tree != NULL)
+                        base = 0;
+                else if (!base || record.lsn != replay.after) {
+                        /* older than *version is already applied, newer is a gap */
+                        if ((failed = record.lsn > replay.after || replay.tree == NULL))
+                                break;
+                        continue;
+                }
+                apply_(&replay, &record);
+                replay.after = record.lsn;
+                n++;
+        }
+        free(body);
+        *replica = replay.tree;
+        *version = replay.after;
+        return failed ? -1 : n;
+}
@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include "src/quadtree.h"
@@ -585,6 +587,1815 @@ test_leaf_move_stable(void) {
         }
 }
 
+static void *
+trace_worker(void *arg) {
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+        assert(quadtree_insert(tree, 1, 1, arg, NULL) == 1);
+        assert(quadtree_insert(tree, 9, 9, arg, NULL) == 1);
+        quadtree_free(tree);
+        return NULL;
+}
+
+#ifdef QUADTREE_TRACE
+static int tracing_;
+
+/* Emits numbered events until told to stop, depth repeating the number's low bits. */
+static void *
+trace_spinner(void *arg) {
+        unsigned int i;
+        for (i = 0; !__atomic_load_n(&tracing_, __ATOMIC_ACQUIRE); i++)
+                quadtree_trace_emit(QUADTREE_TRACE_INSERT, i & 0xffff, i);
+        return NULL;
+}
+#endif
+
+static void
+test_trace(void) {
+        int val = 10;
+        const char *path = "/tmp/quadtree_test_trace.bin";
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+        pthread_t worker;
+
+        quadtree_trace_reset();
+        assert(quadtree_insert(tree, 1, 1, &val, NULL) == 1);
+        assert(quadtree_insert(tree, 9, 9, &val, NULL) == 1);
+        /* Events of other threads, finished ones included, drain too. */
+        assert(pthread_create(&worker, NULL, trace_worker, &val) == 0);
+        pthread_join(worker, NULL);
+#ifdef QUADTREE_TRACE
+        /* insert, then split + swap + insert, on each thread */
+        assert(quadtree_trace_drain(path) == 8);
+        assert(quadtree_trace_drain(path) == 0);
+
+        /* Draining under a live writer: no torn records, none twice, none out of order. */
+        {
+                quadtree_trace_header_t header;
+                quadtree_trace_record_t rec;
+                long drained, last = -1;
+                FILE *fp;
+                int round;
+
+                assert(pthread_create(&worker, NULL, trace_spinner, NULL) == 0);
+                for (round = 0; round < 20; round++) {
+                        assert((drained = quadtree_trace_drain(path)) >= 0);
+                        assert((fp = fopen(path, "rb")) != NULL);
+                        assert(fread(&header, sizeof(header), 1, fp) == 1 && header.count == (uint64_t)drained);
+                        while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+                                assert(rec.depth == (rec.count & 0xffff) && (long)rec.count > last);
+                                last = rec.count;
+                                drained--;
+                        }
+                        assert(drained == 0);
+                        fclose(fp);
+                }
+                __atomic_store_n(&tracing_, 1, __ATOMIC_RELEASE);
+                pthread_join(worker, NULL);
+                quadtree_trace_reset();
+        }
+        remove(path);
+#else
+        assert(quadtree_trace_drain(path) == -1);
+#endif
+        quadtree_free(tree);
+}
+
+static unsigned int
+count_list(quadtree_node_list_t *list) {
+        unsigned int n = 0;
+        for (; list != NULL; list = list->next)
+                n++;
+        return n;
+}
+
+static void
+test_overflow_bucket(void) {
+        int val = 10;
+        int val2 = 42;
+        unsigned int depth;
+        quadtree_node_t *node;
+        quadtree_node_t *first;
+        quadtree_node_list_t *query_result;
+        quadtree_point_t near = {1.01, 1.01}, far = {9, 9};
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+
+        quadtree_set_depth_limit(tree, 4, 0);
+
+        assert(quadtree_insert(tree, 1, 1, &val, &first) == 1);
+        assert(quadtree_insert(tree, 1 + 1e-12, 1, &val, NULL) == 1);
+        assert(quadtree_insert(tree, 1, 1 + 2e-12, &val2, &node) == 1);
+        assert(quadtree_insert(tree, 1, 1 + 2e-12, &val2, NULL) == 2);
+        assert(tree->length == 3);
+        assert(tree->root->weight == 3);
+
+        /* Leaf sits at the depth limit and chains the rest. */
+        for (depth = 0, first = quadtree_node_search(tree, 1, 1); first->parent != NULL; first = first->parent)
+                depth++;
+        assert(depth == 4);
+        assert(*(int *)quadtree_node_search(tree, 1, 1 + 2e-12)->key == 42);
+
+        query_result = quadtree_search_bounds_include_partial(tree, 1, 1, 0.5);
+        assert(count_list(query_result) == 3);
+        quadtree_node_list_free(query_result);
+
+        /* Entries move in place within their cell and relocate out of it. */
+        assert(quadtree_move_leaf(tree, &node, &near) == 1);
+        assert(quadtree_node_search(tree, 1.01, 1.01) == node);
+        assert(quadtree_move_leaf(tree, &node, &far) == 1);
+        assert(*(int *)node->key == 42);
+        assert(tree->length == 3);
+        assert(tree->root->weight == 3);
+
+        /* Clearing the leaf hands its cell to the next entry. */
+        assert(quadtree_clear_leaf_with_condense(tree, quadtree_node_search(tree, 1, 1)) == &val);
+        assert(quadtree_node_search(tree, 1, 1) == NULL);
+        assert(quadtree_node_search(tree, 1 + 1e-12, 1) != NULL);
+        assert(tree->length == 2);
+        assert(tree->root->weight == 2);
+
+        quadtree_free(tree);
+}
+
+static void
+test_auto_grow(void) {
+        int val = 10;
+        quadtree_node_t *node;
+        quadtree_node_t *far;
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+
+        assert(quadtree_insert(tree, 1, 1, &val, &node) == 1);
+        assert(quadtree_insert(tree, 2, 2, &val, NULL) == 1);
+        assert(quadtree_insert(tree, 25, -7, &val, NULL) == -2);
+
+        quadtree_set_auto_grow(tree, 1, 1);
+        assert(quadtree_insert(tree, 25, -7, &val, &far) == 1);
+        assert(quadtree_insert(tree, NAN, 1, &val, NULL) == -2);
+        assert(tree->root->bounds->nw->x <= 0 && tree->root->bounds->se->x >= 25);
+        assert(tree->root->bounds->se->y <= -7 && tree->root->bounds->nw->y >= 10);
+        assert(tree->root->weight == 3);
+        assert(quadtree_node_isleaf(node));
+        assert(quadtree_node_search(tree, 1, 1) == node);
+        assert(quadtree_node_search(tree, 25, -7) == far);
+
+        /* Dropping the far point shrinks back to the smallest quad holding both. */
+        quadtree_clear_leaf_with_condense(tree, far);
+        assert(tree->root->bounds->nw->x == 0 && tree->root->bounds->se->y == 0);
+        assert(tree->root->bounds->se->x == 2.5 && tree->root->bounds->nw->y == 2.5);
+        assert(tree->root->weight == 2);
+        assert(quadtree_node_search(tree, 1, 1) == node);
+        assert(quadtree_node_search(tree, 2, 2) != NULL);
+
+        quadtree_free(tree);
+}
+
+static void
+test_cursor(void) {
+        int val = 10;
+        unsigned int i, expected, seen = 0;
+        quadtree_node_t *node;
+        quadtree_node_t *prev = NULL;
+        quadtree_cursor_t *cursor;
+        quadtree_node_list_t *query_result;
+        quadtree_bounds_t *box = quadtree_bounds_new_with_points(2, 3, 6, 7);
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+
+        quadtree_set_depth_limit(tree, 6, 0);
+        for (i = 0; i < 2000; i++)
+                quadtree_insert(tree, (double)rand() / RAND_MAX * 10.0, (double)rand() / RAND_MAX * 10.0, &val, NULL);
+        quadtree_insert(tree, 4, 4, &val, NULL);
+        quadtree_insert(tree, 4, 4 + 1e-9, &val, NULL);
+
+        query_result = quadtree_search_bounds_include_partial(tree, 4, 5, 2);
+        expected = count_list(query_result);
+        quadtree_node_list_free(query_result);
+
+        /* Suspended between calls, no node comes back twice. */
+        cursor = quadtree_cursor_open(tree, box);
+        while ((node = quadtree_cursor_next(cursor)) != NULL) {
+                assert(node != prev);
+                assert(node->point->x >= 2 && node->point->x <= 6);
+                assert(node->point->y >= 3 && node->point->y <= 7);
+                prev = node;
+                seen++;
+        }
+        assert(quadtree_cursor_next(cursor) == NULL);
+        quadtree_cursor_close(cursor);
+        assert(seen == expected);
+
+        cursor = quadtree_cursor_open(tree, NULL);
+        for (seen = 0; quadtree_cursor_next(cursor) != NULL; seen++)
+                ;
+        quadtree_cursor_close(cursor);
+        assert(seen == tree->length);
+
+        quadtree_bounds_free(box);
+        quadtree_free(tree);
+}
+
+static unsigned int
+count_points(quadtree_node_t *node) {
+        unsigned int n = 0;
+        quadtree_node_t *entry;
+        if (node == NULL)
+                return 0;
+        for (entry = node; quadtree_node_isleaf(node) && entry != NULL; entry = quadtree_node_next(entry))
+                n++;
+        return n + count_points(node->nw) + count_points(node->ne) + count_points(node->sw) + count_points(node->se);
+}
+
+static void
+test_lazy_weight(void) {
+        int val = 10;
+        unsigned int i;
+        double x, y;
+        quadtree_t *eager = quadtree_new(0, 0, 10, 10);
+        quadtree_t *lazy = quadtree_new(0, 0, 10, 10);
+        quadtree_bounds_t *west;
+
+        quadtree_set_lazy_weight(lazy, 1);
+        for (i = 0; i < 1000; i++) {
+                x = (double)rand() / RAND_MAX * 10.0;
+                y = (double)rand() / RAND_MAX * 10.0;
+                quadtree_insert(eager, x, y, &val, NULL);
+                quadtree_insert(lazy, x, y, &val, NULL);
+        }
+        /* Inserts only flagged the path. */
+        assert(lazy->root->weight_dirty);
+        assert(lazy->root->weight < lazy->length);
+
+        /* Queries count around the stale weights without writing them. */
+        assert(quadtree_count_bounds(lazy, lazy->root->bounds) == lazy->length);
+        assert(quadtree_count_bounds(lazy, lazy->root->bounds) == quadtree_count_bounds(eager, eager->root->bounds));
+        assert(lazy->root->weight_dirty && lazy->root->weight < lazy->length);
+
+        /* A writer can sync just the box it is about to count. */
+        west = quadtree_bounds_new_with_points(0, 0, 5, 10);
+        quadtree_sync_weights_in(lazy, west);
+        assert(!lazy->root->nw->weight_dirty && !lazy->root->sw->weight_dirty);
+        assert(lazy->root->ne->weight_dirty && lazy->root->se->weight_dirty && lazy->root->weight_dirty);
+        assert(quadtree_count_bounds(lazy, west) == quadtree_count_bounds(eager, west));
+        assert(lazy->root->nw->weight + lazy->root->sw->weight == quadtree_count_bounds(lazy, west));
+        quadtree_bounds_free(west);
+
+        assert(quadtree_find_optimal_split_quad(lazy)->bounds->nw->x ==
+               quadtree_find_optimal_split_quad(eager)->bounds->nw->x);
+        assert(lazy->root->weight == lazy->length);
+        assert(!lazy->root->weight_dirty);
+
+        for (i = 0; i < 300; i++) {
+                quadtree_node_list_t *query_result = quadtree_search_bounds_include_partial(eager, 5, 5, 5);
+                x = query_result->node->point->x;
+                y = query_result->node->point->y;
+                quadtree_node_list_free(query_result);
+                quadtree_clear_leaf_with_condense(eager, quadtree_node_search(eager, x, y));
+                quadtree_clear_leaf_with_condense(lazy, quadtree_node_search(lazy, x, y));
+        }
+        assert(eager->root->weight == eager->length);
+        assert(count_points(eager->root) == eager->length);
+
+        quadtree_set_lazy_weight(lazy, 0);
+        assert(lazy->root->weight == lazy->length);
+        assert(count_points(lazy->root) == lazy->length);
+
+        quadtree_free(eager);
+        quadtree_free(lazy);
+}
+
+static void
+count_pair(quadtree_node_t *a, quadtree_node_t *b, void *ctx) {
+        assert(a != b);
+        __sync_fetch_and_add((unsigned long *)ctx, 1);
+}
+
+static void
+test_self_join(void) {
+        int val = 10;
+        unsigned int i, j, n = 0;
+        unsigned long brute = 0, pairs = 0;
+        double d = 0.3, dx, dy;
+        quadtree_point_t points[1500];
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+
+        quadtree_set_depth_limit(tree, 5, 0);
+        for (i = 0; i < 1500; i++) {
+                points[n].x = (double)rand() / RAND_MAX * 10.0;
+                points[n].y = (double)rand() / RAND_MAX * 10.0;
+                if (i % 100 == 0) {
+                        points[n].x = 3;
+                        points[n].y = 3 + i * 1e-9;
+                }
+                if (quadtree_insert(tree, points[n].x, points[n].y, &val, NULL) == 1)
+                        n++;
+        }
+        for (i = 0; i < n; i++) {
+                for (j = i + 1; j < n; j++) {
+                        dx = points[i].x - points[j].x;
+                        dy = points[i].y - points[j].y;
+                        brute += dx * dx + dy * dy <= d * d;
+                }
+        }
+
+        quadtree_self_join(tree, d, count_pair, &pairs);
+        assert(pairs == brute);
+
+        pairs = 0;
+        assert(quadtree_self_join_parallel(tree, d, count_pair, &pairs, 4) == 0);
+        assert(pairs == brute);
+
+        quadtree_free(tree);
+}
+
+static int
+west_of(quadtree_node_t *a, quadtree_node_t *b, double d, void *ctx) {
+        double dx = a->point->x - b->point->x;
+        double dy = a->point->y - b->point->y;
+        return dx < 0 && dx * dx + dy * dy <= d * d;
+}
+
+static void
+count_ordered_pair(quadtree_node_t *a, quadtree_node_t *b, void *ctx) {
+        assert(a->point->x >= 0 && a->point->x <= 10);
+        assert(b->point->x >= -5 && b->point->x <= 7);
+        (*(unsigned long *)ctx)++;
+}
+
+static void
+test_join(void) {
+        int val = 10;
+        unsigned int i, j;
+        unsigned long brute = 0, brute_west = 0, pairs = 0;
+        double d = 0.4, dx, dy;
+        quadtree_point_t points_a[800];
+        quadtree_point_t points_b[600];
+        /* Different roots on purpose. */
+        quadtree_t *tree_a = quadtree_new(0, 0, 10, 10);
+        quadtree_t *tree_b = quadtree_new(-5, -5, 7, 7);
+
+        for (i = 0; i < 800; i++) {
+                points_a[i].x = (double)rand() / RAND_MAX * 10.0;
+                points_a[i].y = (double)rand() / RAND_MAX * 10.0;
+                assert(quadtree_insert(tree_a, points_a[i].x, points_a[i].y, &val, NULL) == 1);
+        }
+        for (i = 0; i < 600; i++) {
+                points_b[i].x = (double)rand() / RAND_MAX * 12.0 - 5;
+                points_b[i].y = (double)rand() / RAND_MAX * 12.0 - 5;
+                assert(quadtree_insert(tree_b, points_b[i].x, points_b[i].y, &val, NULL) == 1);
+        }
+        for (i = 0; i < 800; i++) {
+                for (j = 0; j < 600; j++) {
+                        dx = points_a[i].x - points_b[j].x;
+                        dy = points_a[i].y - points_b[j].y;
+                        brute += dx * dx + dy * dy <= d * d;
+                        brute_west += dx < 0 && dx * dx + dy * dy <= d * d;
+                }
+        }
+
+        quadtree_join(tree_a, tree_b, NULL, d, count_ordered_pair, &pairs);
+        assert(pairs == brute);
+
+        pairs = 0;
+        quadtree_join(tree_a, tree_b, west_of, d, count_ordered_pair, &pairs);
+        assert(pairs == brute_west);
+
+        quadtree_free(tree_a);
+        quadtree_free(tree_b);
+}
+
+static void
+test_count_bounds(void) {
+        int val = 10;
+        unsigned int i;
+        double x, y, r;
+        quadtree_bounds_t *box;
+        quadtree_node_list_t *query_result;
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+
+        quadtree_set_depth_limit(tree, 5, 0);
+        quadtree_set_lazy_weight(tree, 1);
+        for (i = 0; i < 3000; i++)
+                quadtree_insert(tree, (double)rand() / RAND_MAX * 10.0, (double)rand() / RAND_MAX * 10.0, &val, NULL);
+        for (i = 0; i < 20; i++)
+                quadtree_insert(tree, 7, 7 + i * 1e-9, &val, NULL);
+
+        for (i = 0; i < 50; i++) {
+                x = (double)rand() / RAND_MAX * 10.0;
+                y = (double)rand() / RAND_MAX * 10.0;
+                r = (double)rand() / RAND_MAX * 5.0;
+                query_result = quadtree_search_bounds_include_partial(tree, x, y, r);
+                box = quadtree_bounds_new_with_points(x - r, y - r, x + r, y + r);
+                assert(quadtree_count_bounds(tree, box) == count_list(query_result));
+                quadtree_bounds_free(box);
+                quadtree_node_list_free(query_result);
+        }
+
+        box = quadtree_bounds_new_with_points(-1, -1, 11, 11);
+        assert(quadtree_count_bounds(tree, box) == tree->length);
+        quadtree_bounds_free(box);
+
+        quadtree_free(tree);
+}
+
+static double
+speed_of(quadtree_node_t *leaf) {
+        return *(double *)leaf->key;
+}
+
+static double
+sum(double a, double b) {
+        return a + b;
+}
+
+static double
+unsum(double total, double removed) {
+        return total - removed;
+}
+
+static double
+max(double a, double b) {
+        return a > b ? a : b;
+}
+
+static void
+check_aggregates(quadtree_t *sum_tree, quadtree_t *max_tree, double x, double y, double r) {
+        double total = 0, top = -INFINITY, got;
+        unsigned int n = 0;
+        quadtree_bounds_t *box = quadtree_bounds_new_with_points(x - r, y - r, x + r, y + r);
+        quadtree_node_list_t *query_result = quadtree_search_bounds_include_partial(sum_tree, x, y, r);
+        quadtree_node_list_t *curr;
+
+        for (curr = query_result; curr != NULL; curr = curr->next) {
+                total += speed_of(curr->node);
+                top = max(top, speed_of(curr->node));
+                n++;
+        }
+        assert(quadtree_aggregate_bounds(sum_tree, box, &got) == n);
+        assert(fabs(got - total) < 1e-6);
+        assert(quadtree_aggregate_bounds(max_tree, box, &got) == n);
+        assert(got == top);
+
+        quadtree_node_list_free(query_result);
+        quadtree_bounds_free(box);
+}
+
+static void
+test_aggregate(void) {
+        unsigned int i;
+        double speeds[2000];
+        quadtree_node_t *sum_nodes[2000];
+        quadtree_node_t *max_nodes[2000];
+        quadtree_aggregate_t sum_of_speed = {0, speed_of, sum, unsum};
+        quadtree_aggregate_t max_speed = {-INFINITY, speed_of, max, NULL};
+        quadtree_t *sum_tree = quadtree_new_with_aggregate(0, 0, 10, 10, &sum_of_speed);
+        quadtree_t *max_tree = quadtree_new_with_aggregate(0, 0, 10, 10, &max_speed);
+
+        quadtree_set_depth_limit(sum_tree, 5, 0);
+        quadtree_set_depth_limit(max_tree, 5, 0);
+        quadtree_set_lazy_weight(max_tree, 1);
+        for (i = 0; i < 2000; i++) {
+                double x = (double)rand() / RAND_MAX * 10.0;
+                double y = i % 10 ? (double)rand() / RAND_MAX * 10.0 : 3 + i * 1e-9;
+                speeds[i] = (double)rand() / RAND_MAX * 100.0;
+                assert(quadtree_insert(sum_tree, x, y, &speeds[i], &sum_nodes[i]) == 1);
+                assert(quadtree_insert(max_tree, x, y, &speeds[i], &max_nodes[i]) == 1);
+        }
+        check_aggregates(sum_tree, max_tree, 5, 5, 10);
+        check_aggregates(sum_tree, max_tree, 2, 3, 1.5);
+
+        /* Deletes and moves keep the cached aggregates in step. */
+        for (i = 0; i < 2000; i += 3) {
+                quadtree_clear_leaf_with_condense(sum_tree, sum_nodes[i]);
+                quadtree_clear_leaf_with_condense(max_tree, max_nodes[i]);
+        }
+        for (i = 1; i < 2000; i += 3) {
+                quadtree_point_t point = {(double)rand() / RAND_MAX * 10.0, (double)rand() / RAND_MAX * 10.0};
+                assert(quadtree_move_leaf(sum_tree, &sum_nodes[i], &point) == 1);
+                assert(quadtree_move_leaf(max_tree, &max_nodes[i], &point) == 1);
+        }
+        check_aggregates(sum_tree, max_tree, 5, 5, 10);
+        check_aggregates(sum_tree, max_tree, 6, 3, 2.5);
+        check_aggregates(sum_tree, max_tree, 3, 3, 0.5);
+
+        /* Changing a value in place needs a refresh. */
+        speeds[2] = 1000;
+        quadtree_aggregate_refresh(sum_tree, sum_nodes[2]);
+        quadtree_aggregate_refresh(max_tree, max_nodes[2]);
+        check_aggregates(sum_tree, max_tree, 5, 5, 10);
+
+        quadtree_free(sum_tree);
+        quadtree_free(max_tree);
+}
+
+static int
+in_polygon(const quadtree_point_t *v, size_t n, quadtree_point_t *p) {
+        size_t i, j;
+        int inside = 0;
+        for (i = 0, j = n - 1; i < n; j = i++) {
+                if ((v[i].y > p->y) != (v[j].y > p->y) &&
+                    p->x < (v[j].x - v[i].x) * (p->y - v[i].y) / (v[j].y - v[i].y) + v[i].x)
+                        inside = !inside;
+        }
+        return inside;
+}
+
+static int
+near_polyline(const quadtree_point_t *v, size_t n, quadtree_point_t *p, double d) {
+        size_t i;
+        for (i = 0; i + 1 < n; i++) {
+                double dx = v[i + 1].x - v[i].x, dy = v[i + 1].y - v[i].y;
+                double t = ((p->x - v[i].x) * dx + (p->y - v[i].y) * dy) / (dx * dx + dy * dy);
+                t = t < 0 ? 0 : t > 1 ? 1 : t;
+                dx = v[i].x + t * dx - p->x;
+                dy = v[i].y + t * dy - p->y;
+                if (dx * dx + dy * dy <= d * d)
+                        return 1;
+        }
+        return 0;
+}
+
+static void
+test_polygon(void) {
+        unsigned int i, expected_polygon = 0, expected_polyline = 0;
+        /* A concave "C" shape and a zig-zag road. */
+        quadtree_point_t shape[] = {{1, 1}, {9, 1}, {9, 3}, {3, 3}, {3, 7}, {9, 7}, {9, 9}, {1, 9}};
+        quadtree_point_t road[] = {{0.5, 0.5}, {5, 8}, {6, 2}, {9.5, 9.5}};
+        quadtree_node_list_t *result;
+        quadtree_node_list_t *iter;
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+
+        quadtree_set_depth_limit(tree, 6, 0);
+        for (i = 0; i < 5000; i++) {
+                quadtree_point_t p = {(double)rand() / RAND_MAX * 10.0, (double)rand() / RAND_MAX * 10.0};
+                /* Some stacked duplicates to exercise overflow buckets. */
+                if (i % 50 == 0)
+                        p.x = p.y = 2 + i * 1e-9;
+                assert(quadtree_insert(tree, p.x, p.y, NULL, NULL) == 1);
+                expected_polygon += in_polygon(shape, 8, &p);
+                expected_polyline += near_polyline(road, 4, &p, 0.4);
+        }
+
+        result = quadtree_search_polygon(tree, shape, 8);
+        assert(count_list(result) == expected_polygon);
+        for (iter = result; iter != NULL; iter = iter->next)
+                assert(in_polygon(shape, 8, iter->node->point));
+        quadtree_node_list_free(result);
+
+        result = quadtree_search_polyline(tree, road, 4, 0.4);
+        assert(count_list(result) == expected_polyline);
+        for (iter = result; iter != NULL; iter = iter->next)
+                assert(near_polyline(road, 4, iter->node->point, 0.4));
+        quadtree_node_list_free(result);
+
+        assert(quadtree_search_polygon(tree, shape, 2) == NULL);
+        quadtree_free(tree);
+}
+
+static void
+test_ids(void) {
+        unsigned int i, id, ids[3000];
+        int keys[3000];
+        quadtree_point_t points[3000];
+        quadtree_node_t *node;
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+
+        quadtree_set_depth_limit(tree, 5, 0);
+        for (i = 0; i < 3000; i++) {
+                keys[i] = i;
+                points[i].x = (double)rand() / RAND_MAX * 10.0;
+                points[i].y = i % 7 ? (double)rand() / RAND_MAX * 10.0 : 4 + i * 1e-9;
+                assert(quadtree_insert_id(tree, points[i].x, points[i].y, &keys[i], &ids[i]) == 1);
+                assert(ids[i] == i + 1);
+        }
+
+        /* Handles survive the splits, promotions and condensing below. */
+        for (i = 0; i < 3000; i += 4) {
+                assert(*(int *)quadtree_remove_id(tree, ids[i]) == (int)i);
+                assert(quadtree_node_by_id(tree, ids[i]) == NULL);
+        }
+        for (i = 1; i < 3000; i += 2) {
+                points[i].x = (double)rand() / RAND_MAX * 10.0;
+                points[i].y = (double)rand() / RAND_MAX * 10.0;
+                assert(quadtree_move_id(tree, ids[i], &points[i]) == 1);
+        }
+        for (i = 0; i < 3000; i++) {
+                node = quadtree_node_by_id(tree, ids[i]);
+                if (i % 4 == 0)
+                        continue;
+                assert(node != NULL && node->ext->id == ids[i]);
+                assert(*(int *)node->key == (int)i);
+                assert(node->point->x == points[i].x && node->point->y == points[i].y);
+                assert(quadtree_node_search(tree, points[i].x, points[i].y) == node);
+        }
+
+        /* Released ids are handed out again. */
+        assert(quadtree_insert_id(tree, 9.99, 9.99, NULL, &id) == 1);
+        assert(id % 4 == 1 && id <= 3000);
+        assert(quadtree_node_by_id(tree, id)->point->x == 9.99);
+        assert(quadtree_move_id(tree, 0, &points[1]) == -1);
+        assert(quadtree_node_by_id(tree, 100000) == NULL);
+
+        quadtree_free(tree);
+}
+
+/* Clearing a chained point keeps every id slot on its point. */
+static void
+test_clear_leaf_ids(void) {
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+        quadtree_node_t *node;
+        unsigned int ids[3];
+        int keys[3] = {0, 1, 2};
+        int i, refill, other;
+
+        quadtree_set_depth_limit(tree, 0, 100);
+        for (i = 0; i < 3; i++) {
+                assert(quadtree_insert_at(tree, i + 1, i + 1, i * 10, &keys[i], &node) == 1);
+                ids[i] = quadtree_node_id(tree, node);
+        }
+        node = quadtree_node_by_id(tree, ids[0]);
+        assert(node == tree->root && quadtree_node_next(node) != NULL);
+        refill = *(int *)quadtree_node_next(node)->key;
+        other = 3 - refill;
+
+        /* The root's cell goes to its chain. */
+        assert(quadtree_clear_leaf_with_condense(tree, node) == &keys[0]);
+        assert(quadtree_node_by_id(tree, ids[0]) == NULL);
+        node = quadtree_node_by_id(tree, ids[refill]);
+        assert(node == tree->root && node->ext->id == ids[refill]);
+        assert(node->key == &keys[refill] && quadtree_node_time(node) == refill * 10);
+
+        /* An overflow entry goes on its own. */
+        node = quadtree_node_by_id(tree, ids[other]);
+        assert(node->bounds == NULL);
+        assert(quadtree_clear_leaf_with_condense(tree, node) == &keys[other]);
+        assert(quadtree_node_by_id(tree, ids[other]) == NULL);
+        assert(quadtree_node_next(tree->root) == NULL);
+
+        /* Released ids are handed out again. */
+        assert(quadtree_insert_id(tree, 5, 5, NULL, &ids[0]) == 1);
+        assert(quadtree_node_by_id(tree, ids[0])->point->x == 5);
+        assert(quadtree_node_by_id(tree, ids[refill]) == tree->root);
+
+        quadtree_free(tree);
+}
+
+/* Moving a point onto another replaces it, as inserting there would. */
+static void
+test_move_onto_point(void) {
+        quadtree_t *tree = quadtree_new(0, 0, 10, 10);
+        quadtree_point_t to = {9, 9};
+        quadtree_node_t *node;
+        unsigned int from_id, onto_id;
+        int *key;
+
+        tree->key_free = free;
+        key = malloc(sizeof(int));
+        *key = 1;
+        assert(quadtree_insert_id(tree, 1, 1, key, &from_id) == 1);
+        key = malloc(sizeof(int));
+        *key = 9;
+        assert(quadtree_insert_id(tree, 9, 9, key, &onto_id) == 1);
+        key = malloc(sizeof(int));
+        *key = 5;
+        assert(quadtree_insert(tree, 4, 6, key, NULL) == 1);
+
+        node = quadtree_node_search(tree, 1, 1);
+        assert(quadtree_move_leaf(tree, &node, &to) == 2);
+        assert(tree->length == 2 && count_points(tree->root) == 2);
+        assert(quadtree_node_search(tree, 1, 1) == NULL);
+        assert(quadtree_node_search(tree, 9, 9) == node && *(int *)node->key == 1);
+        assert(quadtree_node_by_id(tree, from_id) == node && quadtree_node_by_id(tree, onto_id) == NULL);
+        quadtree_free(tree);
+
+        /* Within one bucket too: the neighbour is replaced, not duplicated. */
+        tree = quadtree_new(0, 0, 10, 10);
+        tree->key_free = free;
+        quadtree_set_depth_limit(tree, 2, 0);
+        key = malloc(sizeof(int));
+        *key = 1;
+        assert(quadtree_insert(tree, 1, 1, key, NULL) == 1);
+        key = malloc(sizeof(int));
+        *key = 2;
+        assert(quadtree_insert(tree, 1.5, 1.5, key, &node) == 1);
+        assert(node->bounds == NULL);
+        to.x = to.y = 1;
+        assert(quadtree_move_leaf(tree, &node, &to) == 2);
+        assert(tree->length == 1 && count_points(tree->root) == 1);
+        assert(quadtree_node_search(tree, 1, 1) == node && *(int *)node->key == 2);
+        assert(quadtree_node_next(node) == NULL && quadtree_node_search(tree, 1.5, 1.5) == NULL);
+        quadtree_free(tree);
+}
+
+static void
+test_finger_search(void) {
+        unsigned int i, j;
+        quadtree_node_t *nodes[2000];
+        quadtree_node_t *node;
+        quadtree_point_t point;
+        quadtree_t *tree = quadtree_new(0, 0, 16, 16);
+
+        quadtree_set_depth_limit(tree, 6, 0);
+        for (i = 0; i < 2000; i++) {
+                /* Every tenth point sits on a cell edge, where siblings overlap. */
+                double x = i % 10 ? (double)rand() / RAND_MAX * 16.0 : (double)(i / 10 % 17);
+                double y = i % 10 ? (double)rand() / RAND_MAX * 16.0 : (double)(i / 170);
+                node = i > 0 ? nodes[rand() % i] : NULL;
+                assert(quadtree_insert_from(tree, node, x, y, NULL, &nodes[i]) == 1);
+        }
+        assert(quadtree_insert_from(tree, nodes[0], 17, 1, NULL, NULL) == -2);
+
+        /* Any hint finds what a search from the root finds. */
+        for (i = 0; i < 2000; i++) {
+                j = rand() % 2000;
+                point = *nodes[i]->point;
+                assert(quadtree_node_search(tree, point.x, point.y) == nodes[i]);
+                assert(quadtree_node_search_from(tree, nodes[j], point.x, point.y) == nodes[i]);
+                assert(quadtree_node_search_from(tree, nodes[i], point.x, point.y) == nodes[i]);
+                assert(quadtree_search_from(tree, tree->root, point.x, point.y) == nodes[i]->point);
+        }
+        assert(quadtree_node_search_from(tree, nodes[0], -1, -1) == NULL);
+
+        /* Small steps, mostly staying near the old cell. */
+        for (i = 0; i < 2000; i++) {
+                node = nodes[i];
+                point.x = fmin(16, fmax(0, node->point->x + ((double)rand() / RAND_MAX - 0.5)));
+                point.y = fmin(16, fmax(0, node->point->y + ((double)rand() / RAND_MAX - 0.5)));
+                if (quadtree_search(tree, point.x, point.y) != NULL)
+                        continue;
+                assert(quadtree_move_leaf(tree, &nodes[i], &point) == 1);
+                assert(quadtree_node_search(tree, point.x, point.y) == nodes[i]);
+        }
+        assert(count_points(tree->root) == tree->length);
+
+        quadtree_free(tree);
+}
+
+static unsigned int
+node_depth(quadtree_node_t *node) {
+        unsigned int depth = 0;
+        while ((node = node->parent) != NULL)
+                depth++;
+        return depth;
+}
+
+/* Every pointer counts its non-empty quadrants, every box sits in its node. */
+static unsigned int
+check_boxes(quadtree_node_t *node) {
+        quadtree_object_t *object;
+        unsigned int n = 0;
+        for (object = node->ext != NULL ? node->ext->objects : NULL; object != NULL; object = object->next) {
+                assert(object->node == node);
+                n++;
+        }
+        if (quadtree_node_ispointer(node)) {
+                assert(node->children_cnt == !quadtree_node_isempty(node->nw) + !quadtree_node_isempty(node->ne) +
+                                                 !quadtree_node_isempty(node->sw) + !quadtree_node_isempty(node->se));
+                n += check_boxes(node->nw) + check_boxes(node->ne) + check_boxes(node->sw) + check_boxes(node->se);
+        }
+        return n;
+}
+
+static int
+boxes_overlap(double *a, double *b) {
+        return !(a[2] < b[0] || b[2] < a[0] || a[3] < b[1] || b[3] < a[1]);
+}
+
+static void
+test_loose(void) {
+        unsigned int i, j, expected, live = 1500;
+        double boxes[1500][4];
+        quadtree_object_t *objects[1500];
+        quadtree_node_t *points[500];
+        quadtree_object_list_t *result;
+        quadtree_object_list_t *iter;
+        quadtree_t *tree = quadtree_new(0, 0, 100, 100);
+
+        for (i = 0; i < 500; i++)
+                assert(quadtree_insert(tree, (double)rand() / RAND_MAX * 100, (double)rand() / RAND_MAX * 100, NULL,
+                                       &points[i]) == 1);
+        for (i = 0; i < 1500; i++) {
+                double w = i % 50 ? (double)rand() / RAND_MAX * 3 : 40;
+                double h = (double)rand() / RAND_MAX * 3;
+                boxes[i][0] = (double)rand() / RAND_MAX * (100 - w);
+                boxes[i][1] = (double)rand() / RAND_MAX * (100 - h);
+                boxes[i][2] = boxes[i][0] + w;
+                boxes[i][3] = boxes[i][1] + h;
+                assert(quadtree_insert_box(tree, boxes[i][0], boxes[i][1], boxes[i][2], boxes[i][3], boxes[i],
+                                           &objects[i]) == 1);
+        }
+        assert(check_boxes(tree->root) == 1500);
+        /* Small boxes sink well below the root. */
+        assert(node_depth(objects[1]->node) > 2);
+        assert(quadtree_insert_box(tree, 10, 10, 5, 20, NULL, NULL) == -2);
+        assert(quadtree_insert_box(tree, -80, 10, 5, 20, NULL, NULL) == -2);
+
+        for (i = 0; i < 1500; i += 3) {
+                boxes[i][0] = fmax(0, boxes[i][0] + (double)rand() / RAND_MAX * 4 - 2);
+                boxes[i][1] = fmax(0, boxes[i][1] + (double)rand() / RAND_MAX * 4 - 2);
+                boxes[i][2] = boxes[i][0] + 1;
+                boxes[i][3] = boxes[i][1] + 1;
+                assert(quadtree_move_box(tree, objects[i], boxes[i][0], boxes[i][1], boxes[i][2], boxes[i][3]) == 1);
+        }
+        for (i = 1; i < 1500; i += 5) {
+                assert(quadtree_remove_box(tree, objects[i]) == boxes[i]);
+                objects[i] = NULL;
+                live--;
+        }
+        /* Points come and go under the boxes. */
+        for (i = 0; i < 500; i += 2)
+                quadtree_clear_leaf_with_condense(tree, points[i]);
+        assert(check_boxes(tree->root) == live);
+        assert(count_points(tree->root) == tree->length);
+
+        for (j = 0; j < 50; j++) {
+                double q[4];
+                quadtree_bounds_t *box;
+                q[0] = (double)rand() / RAND_MAX * 90;
+                q[1] = (double)rand() / RAND_MAX * 90;
+                q[2] = q[0] + (double)rand() / RAND_MAX * 10;
+                q[3] = q[1] + (double)rand() / RAND_MAX * 10;
+                box = quadtree_bounds_new_with_points(q[0], q[1], q[2], q[3]);
+                for (i = 0, expected = 0; i < 1500; i++)
+                        expected += objects[i] != NULL && boxes_overlap(boxes[i], q);
+                result = quadtree_search_overlap(tree, box);
+                for (iter = result, i = 0; iter != NULL; iter = iter->next, i++)
+                        assert(boxes_overlap(iter->object->key, q));
+                assert(i == expected);
+                quadtree_object_list_free(result);
+                quadtree_bounds_free(box);
+        }
+
+        /* Without boxes the quadrants they needed fold away again. */
+        for (i = 0; i < 1500; i++) {
+                if (objects[i] != NULL)
+                        quadtree_remove_box(tree, objects[i]);
+        }
+        for (i = 1; i < 500; i += 2)
+                quadtree_clear_leaf_with_condense(tree, points[i]);
+        assert(check_boxes(tree->root) == 0);
+        assert(quadtree_node_isempty(tree->root));
+
+        quadtree_free(tree);
+}
+
+static void
+check_density(quadtree_t *tree, double (*points)[2], unsigned int n, double minx, double miny, double maxx,
+              double maxy, unsigned int width, unsigned int height) {
+        unsigned int i, col, row, total = 0;
+        unsigned int *got = malloc(sizeof(*got) * width * height);
+        unsigned int *want = calloc(width * height, sizeof(*want));
+        quadtree_bounds_t *box = quadtree_bounds_new_with_points(minx, miny, maxx, maxy);
+
+        for (i = 0; i < n; i++) {
+                if (points[i][0] < minx || points[i][0] > maxx || points[i][1] < miny || points[i][1] > maxy)
+                        continue;
+                col = (unsigned int)((points[i][0] - minx) / (maxx - minx) * width);
+                row = (unsigned int)((maxy - points[i][1]) / (maxy - miny) * height);
+                want[(row < height ? row : height - 1) * width + (col < width ? col : width - 1)]++;
+                total++;
+        }
+        assert(quadtree_density_grid(tree, box, width, height, got) == total);
+        for (i = 0; i < width * height; i++)
+                assert(got[i] == want[i]);
+
+        quadtree_bounds_free(box);
+        free(got);
+        free(want);
+}
+
+static void
+test_density_grid(void) {
+        unsigned int i;
+        double points[3000][2];
+        quadtree_t *tree = quadtree_new(0, 0, 64, 64);
+
+        quadtree_set_depth_limit(tree, 7, 0);
+        quadtree_set_lazy_weight(tree, 1);
+        for (i = 0; i < 3000; i++) {
+                /* Some on exact cell edges. */
+                points[i][0] = i % 9 ? (double)rand() / RAND_MAX * 64 : (double)(i % 65);
+                points[i][1] = i % 7 ? (double)rand() / RAND_MAX * 64 : (double)(i % 33) * 2;
+                assert(quadtree_insert(tree, points[i][0], points[i][1], NULL, NULL) >= 1);
+        }
+        /* Replaced duplicates would be counted twice below. */
+        assert(tree->length == 3000);
+
+        check_density(tree, points, 3000, 0, 0, 64, 64, 8, 8);
+        check_density(tree, points, 3000, 0, 0, 64, 64, 256, 256);
+        check_density(tree, points, 3000, 5.5, 3.25, 40.1, 61, 13, 7);
+        check_density(tree, points, 3000, 10, 10, 20, 20, 1, 1);
+
+        quadtree_free(tree);
+}
+
+static void
+count_frozen(const quadtree_frozen_point_t *point, void *ctx) {
+        (*(unsigned int *)ctx)++;
+}
+
+static void
+test_freeze(void) {
+        unsigned int i, j, seen, counts[5][2], tree_grid[48], frozen_grid[48], in_shape, near_road;
+        double speeds[4000], sums[5];
+        quadtree_point_t shape[] = {{10, 10}, {90, 10}, {90, 30}, {30, 30}, {30, 70}, {90, 70}, {90, 90}, {10, 90}};
+        quadtree_point_t road[] = {{5, 5}, {50, 80}, {60, 20}, {95, 95}};
+        quadtree_node_list_t *list;
+        quadtree_point_t points[4000];
+        quadtree_bounds_t *boxes[5];
+        quadtree_aggregate_t sum_of_speed = {0, speed_of, sum, unsum};
+        quadtree_t *tree = quadtree_new_with_aggregate(0, 0, 100, 100, &sum_of_speed);
+        quadtree_frozen_t *frozen;
+        const quadtree_frozen_point_t *found;
+
+        quadtree_set_depth_limit(tree, 6, 0);
+        quadtree_set_lazy_weight(tree, 1);
+        for (i = 0; i < 4000; i++) {
+                points[i].x = (double)rand() / RAND_MAX * 100;
+                points[i].y = i % 8 ? (double)rand() / RAND_MAX * 100 : 50 + i * 1e-9;
+                speeds[i] = i;
+                assert(quadtree_insert(tree, points[i].x, points[i].y, &speeds[i], NULL) == 1);
+        }
+        assert(quadtree_insert_box(tree, 1, 1, 2, 2, NULL, NULL) == 1);
+
+        /* Answers from the live tree to hold the frozen one to. */
+        for (i = 0; i < 5; i++) {
+                double x = (double)rand() / RAND_MAX * 80, y = (double)rand() / RAND_MAX * 80;
+                boxes[i] = quadtree_bounds_new_with_points(x, y, x + i * 5 + 1, y + 20);
+                counts[i][0] = quadtree_count_bounds(tree, boxes[i]);
+                counts[i][1] = quadtree_aggregate_bounds(tree, boxes[i], &sums[i]);
+        }
+        assert(quadtree_density_grid(tree, boxes[4], 8, 6, tree_grid) == counts[4][0]);
+        list = quadtree_search_polygon(tree, shape, 8);
+        in_shape = count_list(list);
+        quadtree_node_list_free(list);
+        list = quadtree_search_polyline(tree, road, 4, 4);
+        near_road = count_list(list);
+        quadtree_node_list_free(list);
+
+        assert((frozen = quadtree_freeze(tree)) != NULL);
+        assert(frozen->length == 4000);
+        assert(frozen->nodes[0].count == 4000 && frozen->nodes[0].first == 0);
+        assert((uintptr_t)frozen->nodes % 64 == 0 && sizeof(quadtree_frozen_node_t) == 64);
+
+        for (i = 0; i < 4000; i++) {
+                found = quadtree_frozen_search(frozen, points[i].x, points[i].y);
+                assert(found != NULL && found->key == &speeds[i]);
+        }
+        assert(quadtree_frozen_search(frozen, 101, 5) == NULL);
+
+        for (i = 0; i < 5; i++) {
+                double got;
+                seen = 0;
+                assert(quadtree_frozen_count_bounds(frozen, boxes[i]) == counts[i][0]);
+                assert(quadtree_frozen_search_bounds(frozen, boxes[i], count_frozen, &seen) == counts[i][0]);
+                assert(seen == counts[i][0]);
+                assert(quadtree_frozen_aggregate_bounds(frozen, boxes[i], &got) == counts[i][1]);
+                assert(fabs(got - sums[i]) < 1e-6);
+        }
+        assert(quadtree_frozen_density_grid(frozen, boxes[4], 8, 6, frozen_grid) == counts[4][0]);
+        for (j = 0; j < 48; j++)
+                assert(frozen_grid[j] == tree_grid[j]);
+        seen = 0;
+        assert(quadtree_frozen_search_polygon(frozen, shape, 8, count_frozen, &seen) == in_shape);
+        assert(seen == in_shape && in_shape > 0);
+        seen = 0;
+        assert(quadtree_frozen_search_polyline(frozen, road, 4, 4, count_frozen, &seen) == near_road);
+        assert(seen == near_road && near_road > 0);
+
+        for (i = 0; i < 5; i++)
+                quadtree_bounds_free(boxes[i]);
+        quadtree_frozen_free(frozen);
+}
+
+/* Tallies what is still out, to catch anything that skips the allocator. */
+typedef struct counting {
+        long blocks;
+        long bytes;
+} counting_t;
+
+static void *
+counting_alloc(void *ctx, size_t size) {
+        counting_t *c = ctx;
+        c->blocks++;
+        c->bytes += size;
+        return malloc(size);
+}
+
+static void
+counting_release(void *ctx, void *ptr, size_t size) {
+        counting_t *c = ctx;
+        c->blocks--;
+        c->bytes -= size;
+        free(ptr);
+}
+
+static void
+fill_and_check(quadtree_t *tree) {
+        unsigned int i, ids[2000];
+        quadtree_bounds_t *box = quadtree_bounds_new_with_points(30, 30, 70, 70);
+        quadtree_node_list_t *list;
+
+        quadtree_set_depth_limit(tree, 5, 0);
+        for (i = 0; i < 2000; i++) {
+                double x = (double)rand() / RAND_MAX * 100, y = (double)rand() / RAND_MAX * 100;
+                assert(quadtree_insert_id(tree, x, y, NULL, &ids[i]) == 1);
+        }
+        for (i = 0; i < 2000; i += 3)
+                quadtree_remove_id(tree, ids[i]);
+        assert(tree->length == 2000 - 667 && count_points(tree->root) == tree->length);
+        list = quadtree_search_bounds_include_partial(tree, 50, 50, 20);
+        assert(count_list(list) == quadtree_count_bounds(tree, box));
+        quadtree_node_list_free(list);
+        quadtree_bounds_free(box);
+}
+
+static void
+test_allocator(void) {
+        counting_t counts = {0, 0};
+        quadtree_allocator_t counting = {counting_alloc, counting_release, &counts};
+        quadtree_allocator_t *arena;
+        quadtree_aggregate_t sum_of_speed = {0, speed_of, sum, unsum};
+        quadtree_options_t options;
+        quadtree_object_list_t *objects;
+        quadtree_node_list_t *list;
+        double speed = 3, total;
+        long blocks;
+        void *big[3];
+        quadtree_bounds_t *box = quadtree_bounds_new_with_points(0, 0, 10, 10);
+        quadtree_cursor_t *cursor;
+        quadtree_t *tree;
+
+        assert((tree = quadtree_new_with_allocator(0, 0, 100, 100, &counting)) != NULL);
+        fill_and_check(tree);
+        assert(quadtree_insert_box(tree, 1, 1, 2, 2, NULL, NULL) == 1);
+        /* Readers may run at once, so results and cursors stay off the tree's allocator. */
+        blocks = counts.blocks;
+        objects = quadtree_search_overlap(tree, box);
+        assert(objects != NULL && objects->next == NULL);
+        list = quadtree_search_bounds_include_partial(tree, 50, 50, 20);
+        assert(list != NULL);
+        assert((cursor = quadtree_cursor_open(tree, box)) != NULL);
+        assert(counts.blocks == blocks);
+        quadtree_object_list_free(objects);
+        quadtree_node_list_free(list);
+        quadtree_cursor_close(cursor);
+        quadtree_free(tree);
+        assert(counts.blocks == 0 && counts.bytes == 0);
+
+        options.allocator = &counting;
+        options.aggregate = &sum_of_speed;
+        assert((tree = quadtree_new_with_options(0, 0, 100, 100, &options)) != NULL);
+        assert(quadtree_insert(tree, 10, 10, &speed, NULL) == 1);
+        assert(quadtree_insert(tree, 90, 90, &speed, NULL) == 1);
+        assert(quadtree_aggregate_bounds(tree, tree->root->bounds, &total) == 2 && total == 6);
+        assert(counts.blocks > 0);
+        quadtree_free(tree);
+        assert(counts.blocks == 0 && counts.bytes == 0);
+
+        /* Frozen trees hand their block back to the same allocator. */
+        assert((tree = quadtree_new_with_allocator(0, 0, 100, 100, &counting)) != NULL);
+        fill_and_check(tree);
+        quadtree_frozen_free(quadtree_freeze(tree));
+        assert(counts.blocks == 0 && counts.bytes == 0);
+
+        assert((arena = quadtree_hugepage_arena_new(4 << 20)) != NULL);
+        assert((tree = quadtree_new_with_allocator(0, 0, 100, 100, arena)) != NULL);
+        fill_and_check(tree);
+        quadtree_free(tree);
+        quadtree_arena_free(arena);
+
+        /* Big blocks are reused: merged with their neighbours, split on demand. */
+        assert((arena = quadtree_hugepage_arena_new(4 << 20)) != NULL);
+        big[0] = quadtree_alloc(arena, 1000);
+        big[1] = quadtree_alloc(arena, 1000);
+        big[2] = quadtree_alloc(arena, 300);
+        quadtree_release(arena, big[0], 1000);
+        quadtree_release(arena, big[1], 1000);
+        assert(quadtree_alloc(arena, 2000) == big[0]);
+        quadtree_release(arena, big[0], 2000);
+        assert(quadtree_alloc(arena, 500) == big[0]);
+        assert(quadtree_alloc(arena, 500) == (char *)big[0] + 512);
+        /* The last block, merged with the free space before it, goes back to the bump pointer. */
+        quadtree_release(arena, big[2], 300);
+        assert(quadtree_alloc(arena, 1500) == (char *)big[0] + 1024);
+        quadtree_arena_free(arena);
+
+        /* No NUMA policy support in this kernel or container is not a failure. */
+        if ((arena = quadtree_numa_arena_new(4 << 20, 0)) != NULL) {
+                assert((tree = quadtree_new_with_allocator(0, 0, 100, 100, arena)) != NULL);
+                fill_and_check(tree);
+                quadtree_free(tree);
+                quadtree_arena_free(arena);
+        }
+        quadtree_bounds_free(box);
+}
+
+/* Passes calls on to an arena, counting them from any thread. */
+typedef struct tripwire {
+        quadtree_allocator_t *arena;
+        long calls;
+} tripwire_t;
+
+static void *
+tripwire_alloc(void *ctx, size_t size) {
+        tripwire_t *t = ctx;
+        __sync_fetch_and_add(&t->calls, 1);
+        return quadtree_alloc(t->arena, size);
+}
+
+static void
+tripwire_release(void *ctx, void *ptr, size_t size) {
+        tripwire_t *t = ctx;
+        __sync_fetch_and_add(&t->calls, 1);
+        quadtree_release(t->arena, ptr, size);
+}
+
+static void *
+arena_reader(void *arg) {
+        quadtree_t *tree = arg;
+        quadtree_bounds_t *box = quadtree_bounds_new_with_points(20, 20, 60, 60);
+        quadtree_cursor_t *cursor;
+        unsigned int i, counts[16];
+
+        for (i = 0; i < 200; i++) {
+                quadtree_node_list_free(quadtree_search_bounds_include_partial(tree, 50, 50, 10 + i % 30));
+                quadtree_node_list_free(quadtree_search_window(tree, box, -HUGE_VAL, HUGE_VAL));
+                quadtree_object_list_free(quadtree_search_overlap(tree, box));
+                assert((cursor = quadtree_cursor_open(tree, box)) != NULL);
+                while (quadtree_cursor_next(cursor) != NULL)
+                        ;
+                quadtree_cursor_close(cursor);
+                quadtree_count_bounds(tree, box);
+                quadtree_density_grid(tree, box, 4, 4, counts);
+        }
+        quadtree_bounds_free(box);
+        return NULL;
+}
+
+/* Arenas are not thread safe: concurrent readers must leave them alone. */
+static void
+test_allocator_readers(void) {
+        tripwire_t tripwire = {quadtree_hugepage_arena_new(4 << 20), 0};
+        quadtree_allocator_t allocator = {tripwire_alloc, tripwire_release, &tripwire};
+        pthread_t readers[4];
+        quadtree_t *tree;
+        long calls;
+        int i;
+
+        assert(tripwire.arena != NULL);
+        assert((tree = quadtree_new_with_allocator(0, 0, 100, 100, &allocator)) != NULL);
+        fill_and_check(tree);
+        for (i = 0; i < 20; i++)
+                assert(quadtree_insert_box(tree, i * 4, i * 4, i * 4 + 3, i * 4 + 3, NULL, NULL) == 1);
+        calls = tripwire.calls;
+        for (i = 0; i < 4; i++)
+                assert(pthread_create(&readers[i], NULL, arena_reader, tree) == 0);
+        for (i = 0; i < 4; i++)
+                pthread_join(readers[i], NULL);
+        assert(tripwire.calls == calls);
+        quadtree_free(tree);
+        quadtree_arena_free(tripwire.arena);
+}
+
+static unsigned int walked;
+
+static void
+count_walk(quadtree_node_t *node) {
+        walked++;
+}
+
+static void
+test_prefetch(void) {
+        unsigned int i, d, found[3], visits[3];
+        quadtree_t *tree = quadtree_new(0, 0, 100, 100);
+        quadtree_node_list_t *list;
+
+        for (i = 0; i < 3000; i++)
+                quadtree_insert(tree, (double)rand() / RAND_MAX * 100, (double)rand() / RAND_MAX * 100, NULL, NULL);
+        /* Prefetching only hints the cache, every distance sees the same tree. */
+        for (d = 0; d < 3; d++) {
+                quadtree_set_prefetch_distance(d * 2);
+                list = quadtree_search_bounds_include_partial(tree, 40, 60, 25);
+                found[d] = count_list(list);
+                quadtree_node_list_free(list);
+                walked = 0;
+                quadtree_walk(tree->root, count_walk, count_walk);
+                visits[d] = walked;
+        }
+        assert(found[0] > 0 && found[0] == found[1] && found[1] == found[2]);
+        assert(visits[0] == visits[1] && visits[1] == visits[2]);
+        quadtree_set_prefetch_distance(QUADTREE_PREFETCH_DISTANCE);
+        quadtree_free(tree);
+}
+
+static void
+test_search_batch(void) {
+        unsigned int i;
+        size_t expect = 0;
+        double xs[3000], ys[3000];
+        quadtree_node_t *out[3000];
+        quadtree_t *tree = quadtree_new(0, 0, 64, 64);
+
+        /* Grid points sit on cell edges, and the depth limit adds overflow chains. */
+        quadtree_set_depth_limit(tree, 4, 0);
+        for (i = 0; i < 1000; i++)
+                assert(quadtree_insert(tree, i % 33 * 2, i / 33 * 2, NULL, NULL) == 1);
+        for (i = 0; i < 1000; i++)
+                quadtree_insert(tree, (double)rand() / RAND_MAX * 64, (double)rand() / RAND_MAX * 64, NULL, NULL);
+        assert(quadtree_insert(tree, 10, 10, NULL, NULL) == 2);
+        for (i = 0; i < 3000; i++) {
+                if (i % 3 == 0) {
+                        xs[i] = i / 3 % 33 * 2;
+                        ys[i] = i / 3 / 33 * 2;
+                } else if (i % 3 == 1) {
+                        xs[i] = (double)rand() / RAND_MAX * 70;
+                        ys[i] = (double)rand() / RAND_MAX * 64;
+                } else {
+                        xs[i] = i % 65;
+                        ys[i] = i / 3 % 66 - 1;
+                }
+                expect += quadtree_node_search(tree, xs[i], ys[i]) != NULL;
+        }
+        assert(quadtree_search_batch(tree, xs, ys, 3000, out) == expect && expect >= 1000);
+        for (i = 0; i < 3000; i++)
+                assert(out[i] == quadtree_node_search(tree, xs[i], ys[i]));
+        assert(quadtree_search_batch(tree, xs, ys, 0, out) == 0);
+        quadtree_free(tree);
+}
+
+static void
+test_search_bounds_multi(void) {
+        unsigned int i;
+        quadtree_point_t corners[64][2];
+        quadtree_bounds_t boxes[64];
+        quadtree_node_list_t *results[64], *single, *a, *b;
+        quadtree_t *tree = quadtree_new(0, 0, 100, 100);
+
+        quadtree_set_depth_limit(tree, 5, 0);
+        for (i = 0; i < 4000; i++)
+                quadtree_insert(tree, (double)rand() / RAND_MAX * 100, (double)rand() / RAND_MAX * 100, NULL, NULL);
+        for (i = 0; i < 400; i++)
+                quadtree_insert(tree, i % 20 * 5, i / 20 * 5, NULL, NULL);
+
+        /* Tiles of an 8 x 8 grid, each query box the one the single call builds. */
+        for (i = 0; i < 64; i++) {
+                double x = 6.25 + i % 8 * 12.5, y = 6.25 + i / 8 * 12.5, r = i % 5 == 0 ? 20 : 6.25;
+                corners[i][0].x = x - r;
+                corners[i][0].y = y + r;
+                corners[i][1].x = x + r;
+                corners[i][1].y = y - r;
+                boxes[i].nw = &corners[i][0];
+                boxes[i].se = &corners[i][1];
+                boxes[i].width = boxes[i].height = r * 2;
+        }
+        assert(quadtree_search_bounds_multi(tree, boxes, 64, results) == 1);
+        for (i = 0; i < 64; i++) {
+                double r = i % 5 == 0 ? 20 : 6.25;
+                single = quadtree_search_bounds_include_partial(tree, corners[i][0].x + r, corners[i][0].y - r, r);
+                assert(single != NULL);
+                /* Same nodes, same order. */
+                for (a = single, b = results[i]; a != NULL && b != NULL; a = a->next, b = b->next)
+                        assert(a->node == b->node);
+                assert(a == NULL && b == NULL);
+                quadtree_node_list_free(single);
+                quadtree_node_list_free(results[i]);
+        }
+        assert(quadtree_search_bounds_multi(tree, boxes, 0, results) == 1);
+        quadtree_free(tree);
+}
+
+/* Pointers quadtree_tidy would still collapse. */
+static unsigned int
+count_degraded(quadtree_node_t *node) {
+        quadtree_node_t *quads[4], *survivor = NULL;
+        unsigned int i, occupied = 0, n = 0;
+
+        if (!quadtree_node_ispointer(node))
+                return 0;
+        quads[0] = node->nw;
+        quads[1] = node->ne;
+        quads[2] = node->sw;
+        quads[3] = node->se;
+        for (i = 0; i < 4; i++) {
+                n += count_degraded(quads[i]);
+                if (!quadtree_node_isempty(quads[i]) && ++occupied)
+                        survivor = quads[i];
+        }
+        return n + (occupied == 0 || (occupied == 1 && !quadtree_node_ispointer(survivor)));
+}
+
+static void
+test_tidy(void) {
+        unsigned int i, steps = 0;
+        quadtree_node_t *nodes[3000];
+        double xs[3000], ys[3000];
+        quadtree_t *tree = quadtree_new(0, 0, 100, 100);
+        int status;
+
+        for (i = 0; i < 3000; i++) {
+                xs[i] = (double)rand() / RAND_MAX * 100;
+                ys[i] = (double)rand() / RAND_MAX * 100;
+                assert(quadtree_insert(tree, xs[i], ys[i], NULL, NULL) == 1);
+        }
+        for (i = 0; i < 3000; i++)
+                nodes[i] = quadtree_node_search(tree, xs[i], ys[i]);
+        /* Plain clears never condense, leaving dead branches behind. */
+        for (i = 0; i < 3000; i++) {
+                if (i % 3 != 0 || xs[i] < 50)
+                        quadtree_clear_leaf(nodes[i]);
+        }
+        assert(count_degraded(tree->root) > 100);
+
+        /*
+         * Zero budget: every call stops after its first batch of nodes, and
+         * the tree answers in between. Inserting has to wait for the counts
+         * the plain clears left behind to be put right.
+         */
+        while ((status = quadtree_tidy(tree, 0)) == 0) {
+                i = steps++ * 3 % 3000;
+                assert(quadtree_node_search(tree, xs[i], ys[i]) == (xs[i] >= 50 ? nodes[i] : NULL));
+        }
+        assert(status == 1 && steps > 1 && tree->tidy.repaired > 100);
+        assert(count_degraded(tree->root) == 0);
+        check_boxes(tree->root);
+        assert(quadtree_insert(tree, 25, 25, NULL, NULL) == 1);
+        assert(quadtree_tidy(tree, 1000000) == 1 && count_degraded(tree->root) == 0);
+
+        /* Survivors kept their node structs. */
+        assert(quadtree_node_search(tree, 25, 25) != NULL);
+        for (i = 0; i < 3000; i++) {
+                if (i % 3 == 0 && xs[i] >= 50)
+                        assert(quadtree_node_search(tree, xs[i], ys[i]) == nodes[i] && nodes[i]->point->x == xs[i]);
+                else
+                        assert(quadtree_node_search(tree, xs[i], ys[i]) == NULL);
+        }
+        quadtree_free(tree);
+}
+
+static unsigned int expired_keys;
+
+static void
+count_expired_key(void *key) {
+        expired_keys += key != NULL;
+}
+
+/* Every point below node lies in its time range. */
+static void
+check_times(quadtree_node_t *node, double tmin, double tmax) {
+        quadtree_node_t *entry;
+        if (quadtree_node_isempty(node))
+                return;
+        assert(tmin <= node->ext->tmin && node->ext->tmax <= tmax);
+        for (entry = node; quadtree_node_isleaf(node) && entry != NULL; entry = quadtree_node_next(entry))
+                assert(node->ext->tmin <= quadtree_node_time(entry) && quadtree_node_time(entry) <= node->ext->tmax);
+        if (quadtree_node_ispointer(node)) {
+                check_times(node->nw, node->ext->tmin, node->ext->tmax);
+                check_times(node->ne, node->ext->tmin, node->ext->tmax);
+                check_times(node->sw, node->ext->tmin, node->ext->tmax);
+                check_times(node->se, node->ext->tmin, node->ext->tmax);
+        }
+}
+
+static void
+test_expire(void) {
+        unsigned int i, want, ids[3000];
+        double xs[3000], ys[3000];
+        quadtree_node_t *node;
+        quadtree_node_list_t *list, *it;
+        quadtree_bounds_t *box = quadtree_bounds_new_with_points(20, 20, 60, 70);
+        quadtree_t *tree = quadtree_new(0, 0, 100, 100);
+        int val = 1;
+
+        /* Shallow, so the clusters below land in overflow chains. */
+        quadtree_set_depth_limit(tree, 5, 0);
+        tree->key_free = count_expired_key;
+        for (i = 0; i < 3000; i++) {
+                xs[i] = i % 4 == 0 ? 10 + i * 1e-6 : (double)rand() / RAND_MAX * 100;
+                ys[i] = i % 4 == 0 ? 10 : (double)rand() / RAND_MAX * 100;
+                assert(quadtree_insert_at(tree, xs[i], ys[i], i, &val, &node) == 1);
+                ids[i] = quadtree_node_id(tree, node);
+        }
+        check_times(tree->root, -HUGE_VAL, HUGE_VAL);
+
+        /* Time windows, with and without a box. */
+        list = quadtree_search_window(tree, NULL, 1000, 1999.5);
+        assert(count_list(list) == 1000);
+        quadtree_node_list_free(list);
+        list = quadtree_search_window(tree, box, 500, 2500);
+        for (it = list; it != NULL; it = it->next)
+                assert(quadtree_node_time(it->node) >= 500 && quadtree_node_time(it->node) <= 2500);
+        for (i = 500, want = 0; i <= 2500; i++)
+                want += xs[i] >= 20 && xs[i] <= 60 && ys[i] >= 20 && ys[i] <= 70;
+        assert(count_list(list) == want);
+        quadtree_node_list_free(list);
+
+        /* A replaced point takes the new time. */
+        assert(quadtree_insert_at(tree, xs[0], ys[0], 5000, &val, NULL) == 2);
+        expired_keys = 0;
+        assert(quadtree_expire_before(tree, 0) == 0);
+        assert(quadtree_expire_before(tree, 1500) == 1499);
+        assert(expired_keys == 1499);
+        assert(tree->length == 1501 && tree->root->weight == 1501 && count_points(tree->root) == 1501);
+        check_boxes(tree->root);
+        check_times(tree->root, 1500, 5000);
+        for (i = 1; i < 3000; i++) {
+                node = quadtree_node_by_id(tree, ids[i]);
+                assert(i < 1500 ? node == NULL : quadtree_node_time(node) == i && node->point->x == xs[i]);
+                assert((quadtree_search(tree, xs[i], ys[i]) != NULL) == (i >= 1500));
+        }
+        assert(quadtree_search(tree, xs[0], ys[0]) != NULL);
+
+        /* Nothing fresh is touched, and the ranges came back exact. */
+        assert(quadtree_expire_before(tree, 1500) == 0);
+        assert(tree->root->ext->tmin == 1500 && tree->root->ext->tmax == 5000);
+        assert(quadtree_expire_before(tree, HUGE_VAL) == 1501);
+        assert(tree->length == 0 && quadtree_node_isempty(tree->root));
+        assert(quadtree_insert_at(tree, 50, 50, 7, &val, NULL) == 1 && tree->root->ext->tmin == 7);
+        quadtree_bounds_free(box);
+        quadtree_free(tree);
+}
+
+/* A plain tree gets its ext blocks the first time it needs them. */
+static void
+test_extend(void) {
+        quadtree_t *tree = quadtree_new(0, 0, 100, 100);
+        quadtree_node_list_t *list;
+        quadtree_node_t *node;
+        unsigned int i, id;
+        int val = 1;
+
+        for (i = 0; i < 500; i++)
+                assert(quadtree_insert(tree, i % 25 * 4 + 1, i / 25 * 4 + 1, &val, NULL) == 1);
+        assert(tree->root->ext == NULL && tree->root->nw->ext == NULL);
+        list = quadtree_search_window(tree, NULL, 0, 0);
+        assert(count_list(list) == 500);
+        quadtree_node_list_free(list);
+
+        /* The untimed points read as timed 0 once the tree has ranges. */
+        assert(quadtree_insert_at(tree, 50.5, 50.5, 10, &val, &node) == 1);
+        check_times(tree->root, -HUGE_VAL, HUGE_VAL);
+        assert(tree->root->ext->tmin == 0 && tree->root->ext->tmax == 10);
+        list = quadtree_search_window(tree, NULL, 0, 0);
+        assert(count_list(list) == 500);
+        quadtree_node_list_free(list);
+        id = quadtree_node_id(tree, node);
+        assert(quadtree_node_by_id(tree, id) == node);
+        assert(quadtree_expire_before(tree, 5) == 500 && tree->length == 1);
+        quadtree_free(tree);
+
+        /* So does the first bucket. */
+        tree = quadtree_new(0, 0, 100, 100);
+        quadtree_set_depth_limit(tree, 2, 0);
+        for (i = 0; i < 50; i++)
+                assert(quadtree_insert(tree, 1 + i * 1e-3, 1, &val, NULL) == 1);
+        assert(tree->root->ext != NULL && count_points(tree->root) == 50);
+        node = quadtree_node_search(tree, 1, 1);
+        assert(quadtree_node_next(node) != NULL);
+        quadtree_free(tree);
+}
+
+static size_t
+int_key_size(void *key) {
+        return sizeof(int);
+}
+
+static void
+int_key_encode(void *key, void *buf) {
+        memcpy(buf, key, sizeof(int));
+}
+
+static void *
+int_key_decode(const void *buf, size_t size) {
+        int *key = malloc(sizeof(int));
+        memcpy(key, buf, sizeof(int));
+        return key;
+}
+
+static const quadtree_key_codec_t int_codec = {int_key_size, int_key_encode, int_key_decode, free};
+
+/* Same points with the same times and keys. */
+static void
+check_same_points(quadtree_t *a, quadtree_t *b) {
+        quadtree_node_list_t *list = quadtree_search_window(a, NULL, -HUGE_VAL, HUGE_VAL), *it;
+        quadtree_node_t *node;
+
+        assert(b != NULL && a->length == b->length && count_list(list) == a->length);
+        for (it = list; it != NULL; it = it->next) {
+                node = quadtree_node_search(b, it->node->point->x, it->node->point->y);
+                assert(node != NULL && quadtree_node_time(node) == quadtree_node_time(it->node));
+                assert(*(int *)node->key == *(int *)it->node->key);
+        }
+        quadtree_node_list_free(list);
+}
+
+static void
+test_wal(void) {
+        const char *log = "/tmp/quadtree_test.wal", *snap = "/tmp/quadtree_test.snap";
+        unsigned int i;
+        int *key;
+        double xs[2500], ys[2500];
+        quadtree_point_t to;
+        quadtree_node_t *node, *cut;
+        quadtree_t *copy, *tree = quadtree_new(0, 0, 100, 100);
+        quadtree_wal_t *wal;
+        FILE *fp;
+
+        remove(log);
+        remove(snap);
+        assert((wal = quadtree_wal_open(log, QUADTREE_WAL_SYNC_INTERVAL, 2, &int_codec)) != NULL);
+        tree->key_free = free;
+        quadtree_set_depth_limit(tree, 6, 0);
+        quadtree_set_wal(tree, wal);
+        for (i = 0; i < 2500; i++) {
+                xs[i] = (double)rand() / RAND_MAX * 100;
+                ys[i] = (double)rand() / RAND_MAX * 100;
+                /* Clusters for the overflow chains. */
+                if (i % 10 == 0)
+                        xs[i] = 5 + i * 1e-9, ys[i] = 5;
+        }
+        for (i = 0; i < 2000; i++) {
+                key = malloc(sizeof(int));
+                *key = i;
+                assert(quadtree_insert_at(tree, xs[i], ys[i], i, key, NULL) == 1);
+        }
+        for (i = 1; i < 2000; i += 5) {
+                node = quadtree_node_search(tree, xs[i], ys[i]);
+                to.x = xs[i] = (double)rand() / RAND_MAX * 100;
+                to.y = ys[i] = (double)rand() / RAND_MAX * 100;
+                assert(quadtree_move_leaf(tree, &node, &to) == 1);
+        }
+        for (i = 2; i < 2000; i += 7)
+                free(quadtree_clear_leaf_with_condense(tree, quadtree_node_search(tree, xs[i], ys[i])));
+        assert(quadtree_expire_before(tree, 300) > 0);
+        assert(quadtree_wal_sync(wal) == 0);
+
+        /* The log alone rebuilds the tree. */
+        copy = quadtree_recover(NULL, log, &int_codec);
+        check_same_points(tree, copy);
+        check_same_points(copy, tree);
+        quadtree_free(copy);
+
+        /* A snapshot, then a tail: inserts and a cut out subtree. */
+        assert(quadtree_snapshot(tree, snap, &int_codec) == 0);
+        for (i = 2000; i < 2500; i++) {
+                key = malloc(sizeof(int));
+                *key = i;
+                assert(quadtree_insert_at(tree, xs[i], ys[i], i, key, NULL) == 1);
+        }
+        assert(quadtree_node_ispointer(tree->root));
+        cut = tree->root->ne;
+        quadtree_unlink_subtree(tree, cut);
+        quadtree_node_free(cut, free);
+        assert(quadtree_wal_close(wal) == 0);
+        copy = quadtree_recover(snap, log, &int_codec);
+        check_same_points(tree, copy);
+        quadtree_free(copy);
+
+        /* A torn last record is dropped, and reopening carries on after it. */
+        fp = fopen(log, "ab");
+        fwrite("torn!", 5, 1, fp);
+        fclose(fp);
+        copy = quadtree_recover(snap, log, &int_codec);
+        check_same_points(tree, copy);
+        quadtree_free(copy);
+        assert((wal = quadtree_wal_open(log, QUADTREE_WAL_SYNC_ALWAYS, 0, &int_codec)) != NULL);
+        quadtree_set_wal(tree, wal);
+        key = malloc(sizeof(int));
+        *key = -1;
+        assert(quadtree_insert_at(tree, 99, 99, 5000, key, NULL) == 1);
+        copy = quadtree_recover(snap, log, &int_codec);
+        check_same_points(tree, copy);
+        quadtree_free(copy);
+
+        assert(quadtree_wal_close(wal) == 0);
+        quadtree_free(tree);
+        remove(log);
+        remove(snap);
+
+        /*
+         * A move onto the edge se shares with sw, where a point already is:
+         * searches take sw, so the move replaces that point rather than
+         * leaving a second one in se that recovery could not tell apart.
+         */
+        tree = quadtree_new(0, 0, 100, 100);
+        tree->key_free = free;
+        assert((wal = quadtree_wal_open(log, QUADTREE_WAL_SYNC_ALWAYS, 0, &int_codec)) != NULL);
+        quadtree_set_wal(tree, wal);
+        for (i = 0; i < 3; i++) {
+                key = malloc(sizeof(int));
+                *key = i;
+                assert(quadtree_insert(tree, i == 0 ? 40 : i == 1 ? 60 : 50, 10, key, NULL) == 1);
+        }
+        node = quadtree_node_search(tree, 60, 10);
+        assert(node->parent == tree->root && node == tree->root->se);
+        to.x = 50;
+        to.y = 10;
+        assert(quadtree_move_leaf(tree, &node, &to) == 2);
+        assert(tree->length == 2 && quadtree_node_search(tree, 50, 10) == node && *(int *)node->key == 1);
+        copy = quadtree_recover(NULL, log, &int_codec);
+        check_same_points(tree, copy);
+        quadtree_free(copy);
+        assert(quadtree_snapshot(tree, snap, &int_codec) == 0);
+        copy = quadtree_recover(snap, log, &int_codec);
+        check_same_points(tree, copy);
+        quadtree_free(copy);
+        assert(quadtree_wal_close(wal) == 0);
+        quadtree_free(tree);
+        remove(log);
+        remove(snap);
+}
+
+/* Brings replica up to date from feed, returns how many changes that took. */
+static long
+pull(quadtree_feed_t *feed, quadtree_t **replica, uint64_t *version) {
+        void *data;
+        size_t size;
+        long n = quadtree_changes_since(feed, *version, &data, &size);
+        if (n > 0)
+                assert(quadtree_apply_changes(replica, version, data, size, &int_codec) == n);
+        free(data);
+        assert(n < 0 || *version == quadtree_feed_version(feed));
+        return n;
+}
+
+static void
+test_feed(void) {
+        unsigned int i;
+        int *key;
+        double xs[1500], ys[1500];
+        uint64_t version = 0, lagging;
+        void *data;
+        size_t size;
+        quadtree_point_t to;
+        quadtree_node_t *node, *cut;
+        quadtree_t *replica = NULL, *tree = quadtree_new(0, 0, 100, 100);
+        quadtree_feed_t *feed = quadtree_feed_new(1 << 20, &int_codec);
+
+        tree->key_free = free;
+        quadtree_set_depth_limit(tree, 6, 0);
+        quadtree_set_feed(tree, feed);
+        for (i = 0; i < 1500; i++) {
+                xs[i] = (double)rand() / RAND_MAX * 100;
+                ys[i] = (double)rand() / RAND_MAX * 100;
+                if (i % 10 == 0)
+                        xs[i] = 5 + i * 1e-9, ys[i] = 5;
+                key = malloc(sizeof(int));
+                *key = i;
+                assert(quadtree_insert_at(tree, xs[i], ys[i], i, key, NULL) == 1);
+        }
+        assert(pull(feed, &replica, &version) == 1501);
+        check_same_points(tree, replica);
+        check_same_points(replica, tree);
+        assert(pull(feed, &replica, &version) == 0);
+
+        /* Moves, clears and expiry in one batch; an old batch again is a no-op. */
+        lagging = version;
+        for (i = 1; i < 1500; i += 5) {
+                node = quadtree_node_search(tree, xs[i], ys[i]);
+                to.x = xs[i] = (double)rand() / RAND_MAX * 100;
+                to.y = ys[i] = (double)rand() / RAND_MAX * 100;
+                assert(quadtree_move_leaf(tree, &node, &to) == 1);
+        }
+        for (i = 2; i < 1500; i += 7)
+                free(quadtree_clear_leaf_with_condense(tree, quadtree_node_search(tree, xs[i], ys[i])));
+        assert(quadtree_expire_before(tree, 200) > 0);
+        assert(quadtree_changes_since(feed, lagging, &data, &size) > 0);
+        assert(pull(feed, &replica, &version) > 0);
+        assert(quadtree_apply_changes(&replica, &version, data, size, &int_codec) == 0);
+        free(data);
+        check_same_points(tree, replica);
+        check_same_points(replica, tree);
+
+        /* A cut out subtree. */
+        assert(quadtree_node_ispointer(tree->root));
+        cut = tree->root->sw;
+        quadtree_unlink_subtree(tree, cut);
+        quadtree_node_free(cut, free);
+        assert(pull(feed, &replica, &version) == 1);
+        check_same_points(tree, replica);
+
+        /* Changes that skip one are refused and leave the replica as it was. */
+        lagging = version;
+        key = malloc(sizeof(int));
+        *key = -1;
+        assert(quadtree_insert_at(tree, 1, 99, 5000, key, NULL) == 1);
+        key = malloc(sizeof(int));
+        *key = -2;
+        assert(quadtree_insert_at(tree, 2, 99, 5000, key, NULL) == 1);
+        assert(quadtree_changes_since(feed, version + 1, &data, &size) == 1);
+        assert(quadtree_apply_changes(&replica, &version, data, size, &int_codec) == -1);
+        assert(version == lagging && quadtree_node_search(replica, 1, 99) == NULL);
+        free(data);
+        assert(pull(feed, &replica, &version) == 2);
+        check_same_points(tree, replica);
+        assert(quadtree_changes_since(feed, version + 1, &data, &size) == -1 && data == NULL);
+
+        /* A new replica, and one past the budget, start from a snapshot. */
+        quadtree_set_feed(tree, NULL);
+        quadtree_feed_free(feed);
+        feed = quadtree_feed_new(512, &int_codec);
+        quadtree_set_feed(tree, feed);
+        quadtree_free(replica);
+        replica = NULL;
+        version = 0;
+        assert(quadtree_feed_snapshot(feed, tree, &data, &size) == (long)tree->length + 1);
+        assert(quadtree_apply_changes(&replica, &version, data, size, &int_codec) == (long)tree->length + 1);
+        free(data);
+        check_same_points(tree, replica);
+        for (i = 0; i < 200; i++) {
+                key = malloc(sizeof(int));
+                *key = 6000 + i;
+                assert(quadtree_insert_at(tree, 0.5 + i * 0.01, 0.5, 6000, key, NULL) == 1);
+        }
+        assert(pull(feed, &replica, &version) == -1);
+        assert(quadtree_feed_snapshot(feed, tree, &data, &size) > 0);
+        assert(quadtree_apply_changes(&replica, &version, data, size, &int_codec) == (long)tree->length + 1);
+        assert(version == quadtree_feed_version(feed));
+        free(data);
+        check_same_points(tree, replica);
+        check_same_points(replica, tree);
+        key = malloc(sizeof(int));
+        *key = 7000;
+        assert(quadtree_insert_at(tree, 99, 1, 7000, key, NULL) == 1);
+        assert(pull(feed, &replica, &version) == 1);
+        check_same_points(tree, replica);
+
+        quadtree_free(replica);
+        quadtree_free(tree);
+        quadtree_feed_free(feed);
+}
+
+static void
+test_record(void) {
+        const char *path = "/tmp/quadtree_test.qtrc";
+        quadtree_t *tree = quadtree_new(0, 0, 100, 100);
+        quadtree_recording_header_t header;
+        quadtree_recording_record_t rec[24];
+        quadtree_point_t to = {70, 70}, nw = {0, 80}, se = {80, 0};
+        quadtree_point_t triangle[3] = {{0, 0}, {100, 0}, {0, 100}};
+        quadtree_bounds_t box = {&nw, &se, 80, 80};
+        quadtree_node_t *node, *cut, *found[3];
+        double xs[3] = {20, 70, 5}, ys[3] = {20, 70, 5};
+        unsigned int counts[2];
+        uint32_t calls[] = {QUADTREE_CALL_PRELOAD,        QUADTREE_CALL_PRELOAD,      QUADTREE_CALL_INSERT,
+                            QUADTREE_CALL_SEARCH,         QUADTREE_CALL_SEARCH,       QUADTREE_CALL_SEARCH_BOUNDS,
+                            QUADTREE_CALL_SEARCH_PARTIAL, QUADTREE_CALL_SEARCH,       QUADTREE_CALL_MOVE_LEAF,
+                            QUADTREE_CALL_SEARCH,         QUADTREE_CALL_CLEAR,        QUADTREE_CALL_INSERT,
+                            QUADTREE_CALL_UNLINK_SUBTREE, QUADTREE_CALL_COUNT_BOUNDS, QUADTREE_CALL_DENSITY_GRID,
+                            QUADTREE_CALL_MORE,           QUADTREE_CALL_SEARCH_BATCH, QUADTREE_CALL_MORE,
+                            QUADTREE_CALL_SEARCH_POLYGON, QUADTREE_CALL_MORE};
+        FILE *fp;
+        size_t i, n;
+        int val = 10;
+
+        quadtree_set_depth_limit(tree, 5, 0);
+        assert(quadtree_insert_at(tree, 10, 10, 3, &val, NULL) == 1);
+        assert(quadtree_insert(tree, 20, 20, &val, NULL) == 1);
+        assert(quadtree_record_start(tree, path) == 0);
+        assert(quadtree_record_start(tree, path) == -1);
+        assert(quadtree_insert(tree, 30, 30, &val, NULL) == 1);
+        assert(quadtree_search(tree, 30, 30) != NULL);
+        assert(quadtree_search(tree, 31, 31) == NULL);
+        quadtree_node_list_free(quadtree_search_bounds(tree, 20, 20, 5));
+        quadtree_node_list_free(quadtree_search_bounds_include_partial(tree, 20, 20, 5));
+        node = quadtree_node_search(tree, 30, 30);
+        assert(quadtree_move_leaf(tree, &node, &to) == 1);
+        quadtree_clear_leaf_with_condense(tree, quadtree_node_search(tree, 10, 10));
+        assert(quadtree_insert(tree, 90, 10, &val, NULL) == 1);
+        cut = tree->root->se;
+        quadtree_unlink_subtree(tree, cut);
+        quadtree_node_free(cut, do_nothing);
+        assert(quadtree_count_bounds(tree, &box) == 2);
+        assert(quadtree_density_grid(tree, &box, 2, 1, counts) == 2);
+        assert(quadtree_search_batch(tree, xs, ys, 3, found) == 2);
+        quadtree_node_list_free(quadtree_search_polygon(tree, triangle, 3));
+        assert(quadtree_record_stop(tree) == 0);
+        assert(quadtree_record_stop(tree) == -1);
+        assert(quadtree_search(tree, 70, 70) != NULL);
+
+        assert((fp = fopen(path, "rb")) != NULL);
+        assert(fread(&header, sizeof(header), 1, fp) == 1);
+        assert(memcmp(header.magic, QUADTREE_RECORDING_MAGIC, 4) == 0 && header.record_size == sizeof(*rec));
+        assert(header.shape[2] == 100 && header.shape[3] == 100 && header.shape[4] == 5 && header.shape[8] == 0);
+        n = fread(rec, sizeof(*rec), 24, fp);
+        fclose(fp);
+        assert(n == sizeof(calls) / sizeof(*calls));
+        for (i = 0; i < n; i++) {
+                assert(rec[i].call == calls[i]);
+                assert(i == 0 || rec[i].ns >= rec[i - 1].ns);
+                assert(rec[i].thread == rec[0].thread);
+        }
+        assert(rec[0].args[0] + rec[1].args[0] == 30 && rec[0].args[2] + rec[1].args[2] == 3);
+        assert(rec[5].args[0] == 20 && rec[5].args[2] == 5);
+        assert(rec[8].args[0] == 30 && rec[8].args[2] == 70 && rec[8].args[3] == 70);
+        assert(rec[10].args[0] == 10 && rec[10].args[1] == 10);
+        assert(rec[12].args[0] == 50 && rec[12].args[1] == 0 && rec[12].args[2] == 100 && rec[12].args[3] == 50);
+        assert(rec[13].args[0] == 0 && rec[13].args[1] == 0 && rec[13].args[2] == 80 && rec[13].args[3] == 80);
+        assert(rec[15].args[0] == 2 && rec[15].args[1] == 1 && rec[15].ns == rec[14].ns);
+        /* n, x0, y0, x1, then y1, x2, y2 and padding */
+        assert(rec[16].args[0] == 3 && rec[16].args[3] == 70 && rec[17].args[0] == 70 && rec[17].args[2] == 5);
+        assert(rec[17].args[3] == 0 && rec[19].args[0] == 0 && rec[19].args[2] == 100);
+        quadtree_free(tree);
+        remove(path);
+}
+
 int
 main(int argc, const char *argv[]) {
         /* printf("\nquadtree_t: %ld\n", sizeof(quadtree_t)); */
@@ -606,5 +2417,33 @@ main(int argc, const char *argv[]) {
         */
         /* test(rand_tree); */
         test(leaf_move_complex);
+        test(trace);
+        test(overflow_bucket);
+        test(auto_grow);
+        test(cursor);
+        test(lazy_weight);
+        test(self_join);
+        test(join);
+        test(count_bounds);
+        test(aggregate);
+        test(polygon);
+        test(ids);
+        test(clear_leaf_ids);
+        test(finger_search);
+        test(move_onto_point);
+        test(loose);
+        test(density_grid);
+        test(freeze);
+        test(allocator);
+        test(allocator_readers);
+        test(prefetch);
+        test(search_batch);
+        test(search_bounds_multi);
+        test(tidy);
+        test(expire);
+        test(extend);
+        test(wal);
+        test(feed);
+        test(record);
         // test(leaf_move_stable);
 }
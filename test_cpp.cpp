@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "src/quadtree.hpp"
+
+#define test(fn)                           \
+        printf("\x1b[33m" #fn "\x1b[0m "); \
+        test_##fn();                       \
+        puts("\x1b[1;32m ✓ \x1b[0m");
+
+static void
+test_typed_insert(void) {
+        qt::quadtree<std::string> tree(0, 0, 10, 10);
+        typedef qt::quadtree<std::string>::box box;
+
+        assert(tree.insert(1, 1, std::string("one")) == tree.inserted);
+        assert(tree.insert(2, 2, "two") == tree.inserted);
+        assert(tree.insert(2, 2, "deux") == tree.replaced);
+        assert(tree.insert(11, 2, "out") == tree.out_of_range);
+        assert(tree.size() == 2);
+        assert(*tree.find(2, 2) == "deux");
+        assert(tree.find(3, 3) == nullptr);
+
+        std::string seen;
+        tree.search(box{0, 0, 1.5, 1.5}, [&seen](double x, double y, std::string &value) { seen += value; });
+        assert(seen == "one");
+        assert(tree.remove(1, 1) && !tree.remove(1, 1));
+        assert(tree.size() == 1 && tree.count(box{0, 0, 10, 10}) == 1);
+}
+
+/* Against a std::map over enough points to split and collapse many cells. */
+static void
+test_against_map(void) {
+        qt::quadtree<int, int, 4> tree(0, 0, 1023, 1023);
+        typedef qt::quadtree<int, int, 4>::box box;
+        std::map<std::pair<int, int>, int> expect;
+        int i;
+
+        for (i = 0; i < 20000; i++) {
+                int x = rand() % 1024, y = rand() % 1024;
+                if (rand() % 3 == 0) {
+                        assert(tree.remove(x, y) == (expect.erase(std::make_pair(x, y)) == 1));
+                } else {
+                        bool fresh = expect.find(std::make_pair(x, y)) == expect.end();
+                        assert(tree.insert(x, y, i) == (fresh ? tree.inserted : tree.replaced));
+                        expect[std::make_pair(x, y)] = i;
+                }
+        }
+        assert(tree.size() == expect.size());
+        for (auto &kv : expect)
+                assert(*tree.find(kv.first.first, kv.first.second) == kv.second);
+
+        for (i = 0; i < 50; i++) {
+                int x = rand() % 900, y = rand() % 900;
+                box query{x, y, x + rand() % 120, y + rand() % 120};
+                std::size_t want = 0, got = 0;
+                for (auto &kv : expect)
+                        want += query.contains(kv.first.first, kv.first.second);
+                tree.search(query, [&got](int, int, int &) { got++; });
+                assert(got == want && tree.count(query) == want);
+        }
+}
+
+/* Move only values and trees, past max_depth points pile up in one leaf. */
+static void
+test_move_only(void) {
+        qt::quadtree<std::unique_ptr<int>, double, 2> tree(0, 0, 1, 1, 3);
+        int i, sum = 0;
+
+        for (i = 0; i < 10; i++)
+                assert(tree.insert(0.01 + i * 1e-4, 0.01, std::unique_ptr<int>(new int(i))) == tree.inserted);
+        qt::quadtree<std::unique_ptr<int>, double, 2> moved(std::move(tree));
+        assert(moved.size() == 10);
+        moved.for_each([&sum](double, double, std::unique_ptr<int> &value) { sum += *value; });
+        assert(sum == 45);
+        for (i = 0; i < 10; i += 2)
+                assert(moved.remove(0.01 + i * 1e-4, 0.01));
+        assert(moved.size() == 5 && **moved.find(0.01 + 9e-4, 0.01) == 9);
+        tree = std::move(moved);
+        tree.clear();
+        assert(tree.empty());
+}
+
+int
+main(int argc, const char *argv[]) {
+        srand(1);
+        test(typed_insert);
+        test(against_map);
+        test(move_only);
+}
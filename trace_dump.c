@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+#include "src/quadtree.h"
+
+static const char *event_names[] = {
+        "insert", "split", "swap", "move_inplace", "move_relocate", "condense", "unlink_subtree",
+};
+
+int
+main(int argc, const char *argv[]) {
+        quadtree_trace_header_t header;
+        quadtree_trace_record_t rec;
+        uint64_t first = 0;
+        uint64_t i;
+        FILE *fp;
+
+        if (argc != 2) {
+                fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+                return 1;
+        }
+        if (!(fp = fopen(argv[1], "rb"))) {
+                perror(argv[1]);
+                return 1;
+        }
+        if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, QUADTREE_TRACE_MAGIC, 4) != 0 ||
+            header.version != QUADTREE_TRACE_FORMAT || header.record_size != sizeof(rec)) {
+                fprintf(stderr, "%s: not a quadtree trace\n", argv[1]);
+                fclose(fp);
+                return 1;
+        }
+
+        printf("# %llu records, %.0f ticks/s\n", (unsigned long long)header.count, header.ticks_per_sec);
+        printf("# %14s %-15s %5s %10s\n", "ns", "event", "depth", "count");
+        for (i = 0; i < header.count && fread(&rec, sizeof(rec), 1, fp) == 1; i++) {
+                if (i == 0)
+                        first = rec.timestamp;
+                printf("%16.0f %-15s %5u %10u\n", (double)(int64_t)(rec.timestamp - first) * 1e9 / header.ticks_per_sec,
+                       rec.event < sizeof(event_names) / sizeof(*event_names) ? event_names[rec.event] : "?",
+                       rec.depth, rec.count);
+        }
+        fclose(fp);
+        return 0;
+}